@@ -32,6 +32,9 @@
 #include "xo-file.h"
 #include "xo-paint.h"
 #include "xo-shapes.h"
+#include "xo-render.h"
+#include "xo-view.h"
+#include "xo-print.h"
 
 GtkWidget *winMain;
 GnomeCanvas *canvas;
@@ -44,6 +47,9 @@ typedef struct command_line_options {
     gint openAtPageNumber;
     gboolean screenshot;
     gboolean noNextSplash;
+    gboolean benchmarkRender;
+    gboolean benchmarkPdf;
+    gboolean benchmarkView;
     int fileCount;
     char **fileArguments;
 } command_line_options;
@@ -217,6 +223,7 @@ void init_stuff (command_line_options *clOptions)
 
   // set up the page size and canvas size
   update_page_stuff();
+  if (ui.drawing_area_view) xo_view_init(); // over the canvas, once it's set up
 
   g_signal_connect ((gpointer) canvas, "button_press_event",
                     G_CALLBACK (on_canvas_button_press_event),
@@ -475,6 +482,9 @@ void parse_command_line(int argc, char* argv[], command_line_options *clo)
     { "page", 'p', 0, G_OPTION_ARG_INT,       &(clo->openAtPageNumber), "Jump to Page", "N" },
     { "screenshot", 's', 0, G_OPTION_ARG_NONE, &(clo->screenshot), "Start with screenshot", "S" },
     { "no-next-splash-message", 0, 0, G_OPTION_ARG_NONE, &(clo->noNextSplash), "Do not show the Next splash message ", NULL },
+    { "benchmark-render", 0, 0, G_OPTION_ARG_NONE, &(clo->benchmarkRender), "Time page rendering through the canvas and with cairo, then exit", NULL },
+    { "benchmark-pdf", 0, 0, G_OPTION_ARG_NONE, &(clo->benchmarkPdf), "Measure the PDF content streams and the time to make them, then exit", NULL },
+    { "benchmark-view", 0, 0, G_OPTION_ARG_NONE, &(clo->benchmarkView), "Time scrolling on screen with the canvas and with the drawing area, then exit", NULL },
     { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &(clo->fileArguments), NULL, N_("[FILE]") },
     { NULL }
   };
@@ -490,7 +500,7 @@ void parse_command_line(int argc, char* argv[], command_line_options *clo)
     exit (1);
   }
 
-  if (clo->screenshot) {
+  if (clo->screenshot || clo->benchmarkRender || clo->benchmarkPdf || clo->benchmarkView) {
       // simply disable it it. It gets on the way
       clo->noNextSplash = TRUE;
   }
@@ -517,6 +527,9 @@ main (int argc, char *argv[])
       1, // openAtPagenumber
       FALSE, // screenshot
       FALSE, // noNextSplash
+      FALSE, // benchmarkRender
+      FALSE, // benchmarkPdf
+      FALSE, // benchmarkView
       0, // fileCount
       NULL, //fileArguments
   };
@@ -530,6 +543,9 @@ main (int argc, char *argv[])
   
   gtk_set_locale ();
 
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+  if (!g_thread_supported()) g_thread_init(NULL); // for the PDF export workers
+#endif
 
   gtk_init (&argc, &argv);
 
@@ -552,6 +568,27 @@ main (int argc, char *argv[])
   init_stuff (&clOptions);
 
   gtk_window_set_icon(GTK_WINDOW(winMain), create_pixbuf("xournal.png"));
+
+  if (clOptions.benchmarkRender) {
+    while (gtk_events_pending()) gtk_main_iteration();
+    xo_render_benchmark(BENCHMARK_RENDER_ITERATIONS);
+    if (bgpdf.status != STATUS_NOT_INIT) shutdown_bgpdf();
+    return 0;
+  }
+
+  if (clOptions.benchmarkPdf) {
+    while (gtk_events_pending()) gtk_main_iteration();
+    pdf_stream_benchmark(BENCHMARK_PDF_ITERATIONS);
+    if (bgpdf.status != STATUS_NOT_INIT) shutdown_bgpdf();
+    return 0;
+  }
+
+  if (clOptions.benchmarkView) {
+    while (gtk_events_pending()) gtk_main_iteration();
+    xo_view_benchmark(BENCHMARK_VIEW_FRAMES);
+    if (bgpdf.status != STATUS_NOT_INIT) shutdown_bgpdf();
+    return 0;
+  }
   
   if (!clOptions.noNextSplash) {
       xo_warn_user(_("This is not an official build of xournal.\n\n You should not use it unless you understand what you are doing. You have been warned.\n\n--dmg"));
@@ -38,6 +38,8 @@
 #include "xo-shapes.h"
 #include "xo-clipboard.h"
 #include "xo-image.h"
+#include "xo-canvas-cache.h"
+#include "xo-view.h"
 
 
 
@@ -336,6 +338,7 @@ on_filePrint_activate                  (GtkMenuItem     *menuitem,
       gtk_print_operation_set_job_name(print, xo_basename(ui.filename, FALSE));
     }
     g_signal_connect (print, "draw_page", G_CALLBACK (print_job_render_page), NULL);
+    g_signal_connect (print, "end_print", G_CALLBACK (print_job_end), NULL);
     if (!gtk_check_version(2, 17, 0)) emergency_enable_xinput(GDK_MODE_DISABLED); // bug #159
     res = gtk_print_operation_run(print, GTK_PRINT_OPERATION_ACTION_PRINT_DIALOG,
                                   GTK_WINDOW(winMain), NULL);
@@ -452,7 +455,7 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
                                         gpointer         user_data)
 {
   struct UndoItem *u;
-  GList *list, *itemlist;
+  GList *list, *itemlist, *canvas_items;
   struct UndoErasureData *erasure;
   struct Item *it;
   struct Brush tmp_brush;
@@ -463,6 +466,8 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
   
   end_text_and_stop_scrolling();
   if (undo == NULL) return; // nothing to undo!
+  xo_canvas_cache_invalidate_undo(undo);
+  xo_view_invalidate_undo(undo);
   reset_selection(); // safer
   reset_recognizer(); // safer
   if (undo->type == ITEM_STROKE || undo->type == ITEM_TEXT || undo->type == ITEM_IMAGE) {
@@ -515,6 +520,7 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
       undo->val_x = tmp_x;
       undo->val_y = tmp_y;
       make_page_clipbox(undo->page);
+      invalidate_page_index(g_list_index(journal.pages, undo->page));
     }
     update_canvas_bg(undo->page);
     do_switch_page(g_list_index(journal.pages, undo->page), TRUE, TRUE);
@@ -537,6 +543,7 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
     undo->page->group = NULL;
     undo->page->bg->canvas_item = NULL;
     journal.pages = g_list_remove(journal.pages, undo->page);
+    invalidate_page_index(undo->val);
     journal.npages--;
     if (ui.cur_page == undo->page) ui.cur_page = NULL;
         // so do_switch_page() won't try to remap the layers of the defunct page
@@ -546,19 +553,24 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
   }
   else if (undo->type == ITEM_DELETE_PAGE) {
     journal.pages = g_list_insert(journal.pages, undo->page, undo->val);
+    invalidate_page_index(undo->val);
     journal.npages++;
     make_canvas_items(); // re-create the canvas items
     do_switch_page(undo->val, TRUE, TRUE);
   }
   else if (undo->type == ITEM_MOVESEL) {
+    canvas_items = NULL;
     for (itemlist = undo->itemlist; itemlist != NULL; itemlist = itemlist->next) {
       it = (struct Item *)itemlist->data;
       if (it->canvas_item != NULL) {
-        if (undo->layer != undo->layer2)
-          gnome_canvas_item_reparent(it->canvas_item, undo->layer->group);
         gnome_canvas_item_move(it->canvas_item, -undo->val_x, -undo->val_y);
+        canvas_items = g_list_prepend(canvas_items, it->canvas_item);
       }
     }
+    canvas_items = g_list_reverse(canvas_items);
+    if (undo->layer != undo->layer2)
+      xo_canvas_items_reparent(canvas_items, undo->layer->group);
+    g_list_free(canvas_items);
     move_journal_items_by(undo->itemlist, -undo->val_x, -undo->val_y,
                             undo->layer2, undo->layer, undo->auxlist);
   }
@@ -688,7 +700,7 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
                                         gpointer         user_data)
 {
   struct UndoItem *u;
-  GList *list, *itemlist, *target;
+  GList *list, *itemlist, *target, *canvas_items;
   struct UndoErasureData *erasure;
   struct Item *it;
   struct Brush tmp_brush;
@@ -700,6 +712,8 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
   
   end_text_and_stop_scrolling();
   if (redo == NULL) return; // nothing to redo!
+  xo_canvas_cache_invalidate_undo(redo);
+  xo_view_invalidate_undo(redo);
   reset_selection(); // safer
   reset_recognizer(); // safer
   if (redo->type == ITEM_STROKE || redo->type == ITEM_TEXT || redo->type == ITEM_IMAGE) {
@@ -746,6 +760,7 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
       redo->val_x = tmp_x;
       redo->val_y = tmp_y;
       make_page_clipbox(redo->page);
+      invalidate_page_index(g_list_index(journal.pages, redo->page));
     }
     update_canvas_bg(redo->page);
     do_switch_page(g_list_index(journal.pages, redo->page), TRUE, TRUE);
@@ -773,6 +788,7 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
       redo->page->group, gnome_canvas_group_get_type(), NULL);
     
     journal.pages = g_list_insert(journal.pages, redo->page, redo->val);
+    invalidate_page_index(redo->val);
     journal.npages++;
     do_switch_page(redo->val, TRUE, TRUE);
   }
@@ -788,6 +804,7 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
       l->group = NULL;
     }
     journal.pages = g_list_remove(journal.pages, redo->page);
+    invalidate_page_index(redo->val);
     journal.npages--;
     if (ui.pageno > redo->val || ui.pageno == journal.npages) ui.pageno--;
     ui.cur_page = NULL;
@@ -795,14 +812,18 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
     do_switch_page(ui.pageno, TRUE, TRUE);
   }
   else if (redo->type == ITEM_MOVESEL) {
+    canvas_items = NULL;
     for (itemlist = redo->itemlist; itemlist != NULL; itemlist = itemlist->next) {
       it = (struct Item *)itemlist->data;
       if (it->canvas_item != NULL) {
-        if (redo->layer != redo->layer2)
-          gnome_canvas_item_reparent(it->canvas_item, redo->layer2->group);
         gnome_canvas_item_move(it->canvas_item, redo->val_x, redo->val_y);
+        canvas_items = g_list_prepend(canvas_items, it->canvas_item);
       }
     }
+    canvas_items = g_list_reverse(canvas_items);
+    if (redo->layer != redo->layer2)
+      xo_canvas_items_reparent(canvas_items, redo->layer2->group);
+    g_list_free(canvas_items);
     move_journal_items_by(redo->itemlist, redo->val_x, redo->val_y,
                             redo->layer, redo->layer2, NULL);
   }
@@ -1014,12 +1035,7 @@ G_MODULE_EXPORT void
 on_viewZoomIn_activate                 (GtkMenuItem     *menuitem,
                                         gpointer         user_data)
 {
-  if (ui.zoom > MAX_ZOOM) return;
-  ui.zoom *= ui.zoom_step_factor;
-  gnome_canvas_set_pixels_per_unit(canvas, ui.zoom);
-  rescale_text_items();
-  rescale_bg_pixmaps();
-  rescale_images();
+  zoom_with_preview(ui.zoom_step_factor);
 }
 
 
@@ -1027,12 +1043,7 @@ G_MODULE_EXPORT void
 on_viewZoomOut_activate                (GtkMenuItem     *menuitem,
                                         gpointer         user_data)
 {
-  if (ui.zoom < MIN_ZOOM) return;
-  ui.zoom /= ui.zoom_step_factor;
-  gnome_canvas_set_pixels_per_unit(canvas, ui.zoom);
-  rescale_text_items();
-  rescale_bg_pixmaps();
-  rescale_images();
+  zoom_with_preview(1/ui.zoom_step_factor);
 }
 
 
@@ -1043,6 +1054,7 @@ on_viewNormalSize_activate             (GtkMenuItem     *menuitem,
   ui.zoom = DEFAULT_ZOOM;
   gnome_canvas_set_pixels_per_unit(canvas, ui.zoom);
   rescale_text_items();
+  rescale_stroke_items();
   rescale_bg_pixmaps();
   rescale_images();
 }
@@ -1055,6 +1067,7 @@ on_viewPageWidth_activate              (GtkMenuItem     *menuitem,
   ui.zoom = (GTK_WIDGET(canvas))->allocation.width/ui.cur_page->width;
   gnome_canvas_set_pixels_per_unit(canvas, ui.zoom);
   rescale_text_items();
+  rescale_stroke_items();
   rescale_bg_pixmaps();
   rescale_images();
 }
@@ -1136,6 +1149,8 @@ on_viewShowLayer_activate              (GtkMenuItem     *menuitem,
   end_text_and_stop_scrolling();
   if (ui.layerno == ui.cur_page->nlayers-1) return;
   reset_selection();
+  xo_canvas_cache_reset();
+  xo_view_invalidate_page(ui.cur_page);
   ui.layerno++;
   ui.cur_layer = g_list_nth_data(ui.cur_page->layers, ui.layerno);
   gnome_canvas_item_show(GNOME_CANVAS_ITEM(ui.cur_layer->group));
@@ -1150,6 +1165,8 @@ on_viewHideLayer_activate              (GtkMenuItem     *menuitem,
   end_text_and_stop_scrolling();
   if (ui.layerno == -1) return;
   reset_selection();
+  xo_canvas_cache_reset();
+  xo_view_invalidate_page(ui.cur_page);
   gnome_canvas_item_hide(GNOME_CANVAS_ITEM(ui.cur_layer->group));
   ui.layerno--;
   if (ui.layerno<0) ui.cur_layer = NULL;
@@ -1168,6 +1185,7 @@ on_journalNewPageBefore_activate       (GtkMenuItem     *menuitem,
   reset_selection();
   pg = new_page(ui.cur_page);
   journal.pages = g_list_insert(journal.pages, pg, ui.pageno);
+  invalidate_page_index(ui.pageno);
   journal.npages++;
   do_switch_page(ui.pageno, TRUE, TRUE);
   
@@ -1188,6 +1206,7 @@ on_journalNewPageAfter_activate        (GtkMenuItem     *menuitem,
   reset_selection();
   pg = new_page(ui.cur_page);
   journal.pages = g_list_insert(journal.pages, pg, ui.pageno+1);
+  invalidate_page_index(ui.pageno+1);
   journal.npages++;
   do_switch_page(ui.pageno+1, TRUE, TRUE);
 
@@ -1208,6 +1227,7 @@ on_journalNewPageEnd_activate          (GtkMenuItem     *menuitem,
   reset_selection();
   pg = new_page((struct Page *)g_list_last(journal.pages)->data);
   journal.pages = g_list_append(journal.pages, pg);
+  invalidate_page_index(journal.npages);
   journal.npages++;
   do_switch_page(journal.npages-1, TRUE, TRUE);
 
@@ -1246,6 +1266,7 @@ on_journalDeletePage_activate          (GtkMenuItem     *menuitem,
   }
   
   journal.pages = g_list_remove(journal.pages, ui.cur_page);
+  invalidate_page_index(ui.pageno);
   journal.npages--;
   if (ui.pageno == journal.npages) ui.pageno--;
   ui.cur_page = NULL;
@@ -1441,6 +1462,7 @@ on_journalPaperSize_activate           (GtkMenuItem     *menuitem,
     if (papersize_width_valid) pg->width = papersize_width;
     if (papersize_height_valid) pg->height = papersize_height;
     make_page_clipbox(pg);
+    invalidate_page_index(ui.bg_apply_all_pages ? 0 : ui.pageno);
     update_canvas_bg(pg);
     if (!ui.bg_apply_all_pages) break;
   }
@@ -1657,6 +1679,7 @@ on_journalLoadBackground_activate      (GtkMenuItem     *menuitem,
               gdk_pixbuf_get_width(bg->pixbuf)/bg->pixbuf_scale,
               gdk_pixbuf_get_height(bg->pixbuf)/bg->pixbuf_scale);
       journal.pages = g_list_append(journal.pages, pg);
+      invalidate_page_index(pageno);
       journal.npages++;
       undo->val = pageno;
       undo->page = pg;
@@ -1674,6 +1697,7 @@ on_journalLoadBackground_activate      (GtkMenuItem     *menuitem,
       pg->width = gdk_pixbuf_get_width(bg->pixbuf)/bg->pixbuf_scale;
       pg->height = gdk_pixbuf_get_height(bg->pixbuf)/bg->pixbuf_scale;
       make_page_clipbox(pg);
+      invalidate_page_index(pageno);
       update_canvas_bg(pg);
     }
   }
@@ -1683,6 +1707,7 @@ on_journalLoadBackground_activate      (GtkMenuItem     *menuitem,
     ui.zoom = DEFAULT_ZOOM;
     gnome_canvas_set_pixels_per_unit(canvas, ui.zoom);
     rescale_text_items();
+    rescale_stroke_items();
     rescale_bg_pixmaps();
     rescale_images();
   }
@@ -1724,12 +1749,14 @@ on_journalScreenshot_activate          (GtkMenuItem     *menuitem,
   ui.cur_page->height = gdk_pixbuf_get_height(bg->pixbuf)/bg->pixbuf_scale;
 
   make_page_clipbox(ui.cur_page);
+  invalidate_page_index(ui.pageno);
   update_canvas_bg(ui.cur_page);
 
   if (ui.zoom != DEFAULT_ZOOM) {
     ui.zoom = DEFAULT_ZOOM;
     gnome_canvas_set_pixels_per_unit(canvas, ui.zoom);
     rescale_text_items();
+    rescale_stroke_items();
     rescale_bg_pixmaps();
     rescale_images();
   }
@@ -1772,6 +1799,7 @@ on_journalApplyAllPages_activate       (GtkMenuItem     *menuitem,
     undo->bg->canvas_item = NULL;
   
     make_page_clipbox(page);
+    invalidate_page_index(0);
     update_canvas_bg(page);
   }
   do_switch_page(ui.pageno, TRUE, TRUE);
@@ -2520,6 +2548,81 @@ on_buttonThick_clicked                 (GtkToolButton   *toolbutton,
 }
 
 
+/* Motion events are queued and applied once per display frame: all the
+   samples still go into the stroke (or eraser, lasso...), but the canvas
+   doesn't get mutated at the full rate of the tablet. Everything runs in
+   the main loop, so the queue needs no locking. */
+
+#define MOTION_QUEUE_SIZE 64
+#define MOTION_FRAME_INTERVAL 16 // time between two display frames (in millisec)
+
+static GdkEvent *motion_queue[MOTION_QUEUE_SIZE];
+static int motion_queue_len = 0;
+static guint motion_flush_id = 0;
+
+static void process_motion_event(GdkEvent *event)
+{
+  double pt[2];
+
+  if (ui.cur_item_type == ITEM_STROKE) {
+    continue_stroke(event);
+  }
+  else if (ui.cur_item_type == ITEM_ERASURE) {
+    do_eraser(event, ui.cur_brush->thickness/2,
+               ui.cur_brush->tool_options == TOOLOPT_ERASER_STROKES);
+  }
+  else if (ui.cur_item_type == ITEM_SELECTREGION) {
+    continue_selectregion(event);
+  }
+  else if (ui.cur_item_type == ITEM_SELECTRECT) {
+    get_pointer_coords(event, pt);
+    ui.selection->bbox.right = pt[0];
+    ui.selection->bbox.bottom = pt[1];
+    gnome_canvas_item_set(ui.selection->canvas_item,
+                               "x2", pt[0], "y2", pt[1], NULL);
+  }
+  else if (ui.cur_item_type == ITEM_MOVESEL || ui.cur_item_type == ITEM_MOVESEL_VERT) {
+    continue_movesel(event);
+  }
+  else if (ui.cur_item_type == ITEM_RESIZESEL) {
+    continue_resizesel(event);
+  }
+}
+
+static void flush_motion_events(void)
+{
+  int i;
+
+  if (motion_flush_id != 0) {
+    g_source_remove(motion_flush_id);
+    motion_flush_id = 0;
+  }
+  for (i=0; i<motion_queue_len; i++) {
+    // the operation may have been ended or aborted since the event came
+    if (ui.cur_item_type != ITEM_NONE) process_motion_event(motion_queue[i]);
+    gdk_event_free(motion_queue[i]);
+  }
+  motion_queue_len = 0;
+  // the lasso outline gets updated once for the whole batch
+  if (ui.cur_item_type == ITEM_SELECTREGION) update_selectregion_outline();
+  if (ui.cur_item_type == ITEM_STROKE) update_stroke_prediction();
+}
+
+static gboolean motion_flush_cb(gpointer data)
+{
+  motion_flush_id = 0;
+  flush_motion_events();
+  return FALSE;
+}
+
+static void queue_motion_event(GdkEvent *event)
+{
+  if (motion_queue_len == MOTION_QUEUE_SIZE) flush_motion_events();
+  motion_queue[motion_queue_len++] = gdk_event_copy(event);
+  if (motion_flush_id == 0)
+    motion_flush_id = g_timeout_add(MOTION_FRAME_INTERVAL, motion_flush_cb, NULL);
+}
+
 G_MODULE_EXPORT gboolean
 on_canvas_button_press_event           (GtkWidget       *widget,
                                         GdkEventButton  *event,
@@ -2532,6 +2635,9 @@ on_canvas_button_press_event           (GtkWidget       *widget,
   struct Item *item;
   GdkEvent scroll_event;
 
+  flush_motion_events(); // anything still pending belongs to the previous operation
+  flush_zoom_preview(); // the click is meant for what the preview shows
+
 #ifdef INPUT_DEBUG
   printf("DEBUG: ButtonPress (%s) (x,y)=(%.2f,%.2f), button %d, modifier %x\n", 
     event->device->name, event->x, event->y, event->button, event->state);
@@ -2572,6 +2678,7 @@ on_canvas_button_press_event           (GtkWidget       *widget,
     }
     return FALSE;
   }
+  if (ui.drawing_area_view) return FALSE; // display only: the pages aren't canvas items on screen
   if ((event->state & (GDK_CONTROL_MASK|GDK_MOD1_MASK)) != 0) return FALSE;
     // no control-clicking or alt-clicking
   if (!is_core) gdk_device_get_state(event->device, event->window, event->axes, NULL);
@@ -2733,6 +2840,7 @@ on_canvas_button_release_event         (GtkWidget       *widget,
       event->button != ui.which_unswitch_button)
     return FALSE;
 
+  flush_motion_events();
   if (ui.cur_item_type == ITEM_STROKE) {
     finalize_stroke();
     if (ui.cur_brush->recognizer) recognize_patterns();
@@ -2976,6 +3084,7 @@ on_canvas_motion_notify_event          (GtkWidget       *widget,
 #ifdef INPUT_DEBUG
   printf("DEBUG: aborting on suspicious MotionNotify\n");
 #endif
+    flush_motion_events();
     if (ui.cur_item_type == ITEM_STROKE) {
       if (ui.cur_path.num_points <= 1) abort_stroke();
       else { 
@@ -3010,32 +3119,8 @@ on_canvas_motion_notify_event          (GtkWidget       *widget,
   if (!looks_wrong) ui.current_ignore_btn_reported_up = FALSE;
     // we trust this device knows how to report button state properly
   
-  if (ui.cur_item_type == ITEM_STROKE) {
-    continue_stroke((GdkEvent *)event);
-  }
-  else if (ui.cur_item_type == ITEM_ERASURE) {
-    do_eraser((GdkEvent *)event, ui.cur_brush->thickness/2,
-               ui.cur_brush->tool_options == TOOLOPT_ERASER_STROKES);
-  }
-  else if (ui.cur_item_type == ITEM_SELECTREGION) {
-    continue_selectregion((GdkEvent *)event);
-  }
-  else if (ui.cur_item_type == ITEM_SELECTRECT) {
-    get_pointer_coords((GdkEvent *)event, pt);
-    ui.selection->bbox.right = pt[0];
-    ui.selection->bbox.bottom = pt[1];
-    gnome_canvas_item_set(ui.selection->canvas_item,
-                               "x2", pt[0], "y2", pt[1], NULL);
-  }
-  else if (ui.cur_item_type == ITEM_MOVESEL || ui.cur_item_type == ITEM_MOVESEL_VERT) {
-    continue_movesel((GdkEvent *)event);
-  }
-  else if (ui.cur_item_type == ITEM_RESIZESEL) {
-    continue_resizesel((GdkEvent *)event);
-  }
-  else if (ui.cur_item_type == ITEM_HAND) {
-    do_hand((GdkEvent *)event);
-  }
+  if (ui.cur_item_type == ITEM_HAND) do_hand((GdkEvent *)event);
+  else queue_motion_event((GdkEvent *)event);
   
   return FALSE;
 }
@@ -3133,25 +3218,28 @@ on_vscroll_changed                     (GtkAdjustment   *adjustment,
   gboolean need_update;
   double viewport_top, viewport_bottom;
   struct Page *tmppage;
+  int pageno;
   
   if (ui.view_continuous!=VIEW_MODE_CONTINUOUS) return;
   
-  if (ui.progressive_bg) rescale_bg_pixmaps();
+  if (ui.progressive_bg) schedule_rescale_bg_pixmaps();
+  xo_canvas_cache_schedule(); // pages coming into view
   need_update = FALSE;
   viewport_top = adjustment->value / ui.zoom;
   viewport_bottom = (adjustment->value + adjustment->page_size) / ui.zoom;
   tmppage = ui.cur_page;
-  while (viewport_top > tmppage->voffset + tmppage->height) {
-    if (ui.pageno == journal.npages-1) break;
-    need_update = TRUE;
-    ui.pageno++;
-    tmppage = g_list_nth_data(journal.pages, ui.pageno);
-  }
-  while (viewport_bottom < tmppage->voffset) {
-    if (ui.pageno == 0) break;
+  pageno = ui.pageno;
+  if (viewport_top > tmppage->voffset + tmppage->height) {
+    // the first page that isn't entirely before the viewport
+    pageno = page_at_position(viewport_top);
+    tmppage = journal_page(pageno);
+    if (viewport_top > tmppage->voffset + tmppage->height && pageno < journal.npages-1) pageno++;
+  }
+  else if (viewport_bottom < tmppage->voffset)
+    pageno = page_at_position(viewport_bottom); // the last page not entirely after it
+  if (pageno != ui.pageno) {
     need_update = TRUE;
-    ui.pageno--;
-    tmppage = g_list_nth_data(journal.pages, ui.pageno);
+    ui.pageno = pageno;
   }
   if (need_update) {
     end_text();
@@ -3166,25 +3254,28 @@ on_hscroll_changed                     (GtkAdjustment   *adjustment,
   gboolean need_update;
   double viewport_left, viewport_right;
   struct Page *tmppage;
+  int pageno;
   
   if (ui.view_continuous!=VIEW_MODE_HORIZONTAL) return;
   
-  if (ui.progressive_bg) rescale_bg_pixmaps();
+  if (ui.progressive_bg) schedule_rescale_bg_pixmaps();
+  xo_canvas_cache_schedule(); // pages coming into view
   need_update = FALSE;
   viewport_left = adjustment->value / ui.zoom;
   viewport_right = (adjustment->value + adjustment->page_size) / ui.zoom;
   tmppage = ui.cur_page;
-  while (viewport_left > tmppage->hoffset + tmppage->width) {
-    if (ui.pageno == journal.npages-1) break;
-    need_update = TRUE;
-    ui.pageno++;
-    tmppage = g_list_nth_data(journal.pages, ui.pageno);
-  }
-  while (viewport_right < tmppage->hoffset) {
-    if (ui.pageno == 0) break;
+  pageno = ui.pageno;
+  if (viewport_left > tmppage->hoffset + tmppage->width) {
+    // the first page that isn't entirely before the viewport
+    pageno = page_at_position(viewport_left);
+    tmppage = journal_page(pageno);
+    if (viewport_left > tmppage->hoffset + tmppage->width && pageno < journal.npages-1) pageno++;
+  }
+  else if (viewport_right < tmppage->hoffset)
+    pageno = page_at_position(viewport_right); // the last page not entirely after it
+  if (pageno != ui.pageno) {
     need_update = TRUE;
-    ui.pageno--;
-    tmppage = g_list_nth_data(journal.pages, ui.pageno);
+    ui.pageno = pageno;
   }
   if (need_update) {
     end_text();
@@ -3252,6 +3343,7 @@ on_journalDefaultBackground_activate   (GtkMenuItem     *menuitem,
     undo->bg->canvas_item = NULL;
   
     make_page_clipbox(pg);
+    invalidate_page_index(ui.bg_apply_all_pages ? 0 : ui.pageno);
     update_canvas_bg(pg);
     if (!ui.bg_apply_all_pages) break;
   }
@@ -3417,6 +3509,7 @@ on_buttonZoomFast_activate             (GtkMenuItem     *menuitem,
     oldZoom = currentZoom;
     gnome_canvas_set_pixels_per_unit(canvas, ui.zoom);
     rescale_text_items();
+    rescale_stroke_items();
     rescale_bg_pixmaps();
     rescale_images();
 }
@@ -3712,6 +3805,7 @@ on_viewSetZoom_activate                (GtkMenuItem     *menuitem,
       ui.zoom = DEFAULT_ZOOM*zoom_percent/100;
       gnome_canvas_set_pixels_per_unit(canvas, ui.zoom);
       rescale_text_items();
+      rescale_stroke_items();
       rescale_bg_pixmaps();
       rescale_images();
     }
@@ -3915,6 +4009,8 @@ on_viewDisplayLayersAbovePrefs_activate       (GtkMenuItem     *menuitem,
 
   end_text();
   reset_selection();
+  xo_canvas_cache_reset();
+  xo_view_invalidate_page(ui.cur_page);
 
   // layers below should be visible, so only update those above
   i = ui.layerno+1;
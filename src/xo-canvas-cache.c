@@ -0,0 +1,396 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <math.h>
+#include <string.h>
+#include <gtk/gtk.h>
+#include <libgnomecanvas/libgnomecanvas.h>
+
+#include "xournal.h"
+#include "xo-misc.h"
+#include "xo-canvas-cache.h"
+#include "xo-render.h"
+
+#define CACHE_MAX_PIXELS (2048*2048) // don't cache pages bigger than this on screen
+#define CACHE_NOT_PICKABLE 1e6 // distance reported to the canvas when picking
+#define CACHE_ITEM_KEY "xo-canvas-cache"  // on the page group: its cache item
+
+struct _XoCanvasCache {
+  GnomeCanvasItem item;
+
+  struct Page *page;
+  guchar *pixels; // RGB, covering the page rectangle in canvas pixels
+  int x0, y0, x1, y1, rowstride;
+  gboolean active; // the covered items are hidden and drawn by us
+  int nlayers; // how many layers are covered, on top of the background
+  guint generation; // the value of cache_generation when the pixels were made
+  double affine[6]; // the item-to-canvas affine the pixels were made for
+  double cur_affine[6];
+};
+
+struct _XoCanvasCacheClass {
+  GnomeCanvasItemClass parent_class;
+};
+
+G_DEFINE_TYPE (XoCanvasCache, xo_canvas_cache, GNOME_TYPE_CANVAS_ITEM)
+
+static guint cache_generation = 1;
+static guint cache_idle_id = 0;
+static GList *cache_live = NULL; // the caches holding pixels
+static int cache_pending_undo = 0; // undo items created since the last idle
+
+// the n-th item a page cache may cover: 0 is the background, then the layers
+
+static GnomeCanvasItem *cache_covered_item(struct Page *pg, int n)
+{
+  struct Layer *l;
+
+  if (n == 0) return pg->bg->canvas_item;
+  l = (struct Layer *)g_list_nth_data(pg->layers, n-1);
+  return (l != NULL) ? GNOME_CANVAS_ITEM(l->group) : NULL;
+}
+
+// how many layers the cache of a page should cover right now
+
+static int cache_wanted_layers(struct Page *pg)
+{
+  int n;
+
+  n = (pg == ui.cur_page) ? MAX(ui.layerno, 0) : pg->nlayers;
+  // a selection being dragged lives in the layer it's going to: keep it shown
+  if ((ui.cur_item_type == ITEM_MOVESEL || ui.cur_item_type == ITEM_MOVESEL_VERT) &&
+      ui.selection != NULL && ui.selection->move_layer != NULL &&
+      pg == journal_page(ui.selection->move_pageno))
+    n = MIN(n, MAX(g_list_index(pg->layers, ui.selection->move_layer), 0));
+  return n;
+}
+
+static gboolean cache_is_hidden(GnomeCanvasItem *item)
+{
+  return item != NULL && g_object_get_data(G_OBJECT(item), XO_CANVAS_CACHE_HIDDEN_KEY) != NULL;
+}
+
+static void cache_render_item(GnomeCanvasItem *item, GnomeCanvasBuf *buf)
+{
+  if (item->x1 < buf->rect.x1 && item->y1 < buf->rect.y1 &&
+      item->x2 > buf->rect.x0 && item->y2 > buf->rect.y0 &&
+      GNOME_CANVAS_ITEM_GET_CLASS(item)->render != NULL)
+    GNOME_CANVAS_ITEM_GET_CLASS(item)->render(item, buf);
+}
+
+static void cache_restore(XoCanvasCache *cache)
+{
+  GnomeCanvasItem *item;
+  int n;
+
+  for (n = 0; n <= cache->page->nlayers; n++) {
+    item = cache_covered_item(cache->page, n);
+    if (!cache_is_hidden(item)) continue;
+    g_object_set_data(G_OBJECT(item), XO_CANVAS_CACHE_HIDDEN_KEY, NULL);
+    gnome_canvas_item_show(item);
+  }
+  cache->active = FALSE;
+}
+
+static gboolean cache_is_valid(XoCanvasCache *cache)
+{
+  return cache->active && cache->generation == cache_generation &&
+         cache->nlayers == cache_wanted_layers(cache->page) &&
+         memcmp(cache->affine, cache->cur_affine, sizeof(cache->affine)) == 0;
+}
+
+static void cache_build(XoCanvasCache *cache)
+{
+  GnomeCanvasItem *item = GNOME_CANVAS_ITEM(cache);
+  GnomeCanvasItem *covered;
+  GnomeCanvasBuf buf;
+  GdkColor *color;
+  int n, nlayers;
+
+  cache_restore(cache);
+  if (!ui.raster_cache || ui.drawing_area_view) return; // nothing to gain if the canvas isn't shown
+  cache->x0 = (int)floor(item->x1); cache->y0 = (int)floor(item->y1);
+  cache->x1 = (int)ceil(item->x2); cache->y1 = (int)ceil(item->y2);
+  if (cache->x1 <= cache->x0 || cache->y1 <= cache->y0 ||
+      (double)(cache->x1-cache->x0)*(cache->y1-cache->y0) > CACHE_MAX_PIXELS) {
+    g_free(cache->pixels);
+    cache->pixels = NULL;
+    cache_live = g_list_remove(cache_live, cache);
+    return;
+  }
+  if (cache->pixels == NULL) cache_live = g_list_prepend(cache_live, cache);
+  cache->rowstride = 3*(cache->x1-cache->x0);
+  cache->pixels = g_realloc(cache->pixels, cache->rowstride*(cache->y1-cache->y0));
+
+  buf.buf = cache->pixels;
+  buf.buf_rowstride = cache->rowstride;
+  buf.rect.x0 = cache->x0; buf.rect.y0 = cache->y0;
+  buf.rect.x1 = cache->x1; buf.rect.y1 = cache->y1;
+  color = &(GTK_WIDGET(item->canvas)->style->bg[GTK_STATE_NORMAL]);
+  buf.bg_color = ((color->red & 0xff00) << 8) | (color->green & 0xff00) | (color->blue >> 8);
+  buf.is_bg = 1;
+  buf.is_buf = 0;
+
+  // render the covered items in stacking order, then take them off the canvas
+  nlayers = cache_wanted_layers(cache->page);
+  if (ui.cairo_renderer)
+    xo_render_page_to_rgb(cache->page, nlayers, cache->cur_affine, cache->pixels,
+                          cache->rowstride, cache->x0, cache->y0, cache->x1, cache->y1,
+                          buf.bg_color);
+  for (n = 0; n <= nlayers; n++) {
+    covered = cache_covered_item(cache->page, n);
+    if (covered == NULL || !(covered->object.flags & GNOME_CANVAS_ITEM_VISIBLE)) continue;
+    if (!ui.cairo_renderer) cache_render_item(covered, &buf);
+    g_object_set_data(G_OBJECT(covered), XO_CANVAS_CACHE_HIDDEN_KEY, GINT_TO_POINTER(1));
+    gnome_canvas_item_hide(covered);
+  }
+  if (!ui.cairo_renderer) gnome_canvas_buf_ensure_buf(&buf);
+
+  cache->nlayers = nlayers;
+  cache->generation = cache_generation;
+  g_memmove(cache->affine, cache->cur_affine, sizeof(cache->affine));
+  cache->active = TRUE;
+  gnome_canvas_item_lower_to_bottom(item);
+}
+
+static gboolean cache_idle_cb(gpointer data)
+{
+  GList *list, *next;
+  struct Page *pg;
+  XoCanvasCache *cache;
+  struct UndoItem *u;
+  int n, first, last;
+
+  cache_idle_id = 0;
+  // the undo items made since last time are filled in by now: see what they touch
+  for (u = undo; u != NULL && cache_pending_undo > 0; u = u->next, cache_pending_undo--)
+    xo_canvas_cache_invalidate_undo(u);
+  cache_pending_undo = 0;
+  gnome_canvas_update_now(canvas); // the covered items must be up to date
+  // free the memory of pages scrolled out of view
+  for (list = cache_live; list != NULL; list = next) {
+    next = list->next;
+    cache = (XoCanvasCache *)list->data;
+    if (is_visible(cache->page)) continue;
+    cache_restore(cache);
+    g_free(cache->pixels);
+    cache->pixels = NULL;
+    cache_live = g_list_delete_link(cache_live, list);
+  }
+  get_visible_pages(&first, &last);
+  for (n = first; n <= last; n++) {
+    pg = journal_page(n);
+    if (pg == NULL || pg->group == NULL || !is_visible(pg)) continue;
+    cache = (XoCanvasCache *)g_object_get_data(G_OBJECT(pg->group), CACHE_ITEM_KEY);
+    if (cache == NULL) {
+      cache = XO_CANVAS_CACHE(gnome_canvas_item_new(pg->group, XO_TYPE_CANVAS_CACHE, NULL));
+      cache->page = pg;
+      g_object_set_data(G_OBJECT(pg->group), CACHE_ITEM_KEY, cache);
+      gnome_canvas_update_now(canvas); // get its bounds
+    }
+    if (!cache_is_valid(cache)) cache_build(cache);
+  }
+  return FALSE;
+}
+
+void xo_canvas_cache_schedule(void)
+{
+  /* run before the canvas repaints, so that an invalidated cache gets
+     rebuilt rather than drawn through its covered items */
+  if (cache_idle_id == 0)
+    cache_idle_id = g_idle_add_full(G_PRIORITY_HIGH_IDLE + 10, cache_idle_cb, NULL, NULL);
+}
+
+void xo_canvas_cache_invalidate(void)
+{
+  cache_generation++;
+  xo_canvas_cache_schedule();
+}
+
+void xo_canvas_cache_invalidate_page(struct Page *pg)
+{
+  GList *list;
+  XoCanvasCache *cache;
+
+  for (list = cache_live; list != NULL; list = list->next) {
+    cache = (XoCanvasCache *)list->data;
+    if (cache->page == pg) cache->generation = 0;
+  }
+  // the page may have been resized: get the bounds redone before rebuilding
+  if (pg->group != NULL) {
+    cache = (XoCanvasCache *)g_object_get_data(G_OBJECT(pg->group), CACHE_ITEM_KEY);
+    if (cache != NULL) gnome_canvas_item_request_update(GNOME_CANVAS_ITEM(cache));
+  }
+  xo_canvas_cache_schedule();
+}
+
+void xo_canvas_cache_invalidate_layer(struct Layer *l)
+{
+  GList *list;
+  XoCanvasCache *cache;
+  int n;
+
+  // only the caches covering that layer need rebuilding
+  for (list = cache_live; list != NULL; list = list->next) {
+    cache = (XoCanvasCache *)list->data;
+    n = g_list_index(cache->page->layers, l);
+    if (n >= 0 && n < cache->nlayers) {
+      cache->generation = 0;
+      xo_canvas_cache_schedule();
+    }
+  }
+}
+
+void xo_canvas_cache_invalidate_undo(struct UndoItem *u)
+{
+  switch (u->type) {
+    case ITEM_STROKE: case ITEM_ERASURE: case ITEM_PASTE: case ITEM_TEXT:
+    case ITEM_TEXT_EDIT: case ITEM_RECOGNIZER: case ITEM_IMAGE:
+      xo_canvas_cache_invalidate_layer(u->layer);
+      break;
+    case ITEM_MOVESEL:
+      xo_canvas_cache_invalidate_layer(u->layer);
+      xo_canvas_cache_invalidate_layer(u->layer2);
+      break;
+    case ITEM_NEW_LAYER: case ITEM_DELETE_LAYER: case ITEM_MOVE_LAYER_DOWN:
+    case ITEM_NEW_BG_ONE: case ITEM_NEW_BG_RESIZE: case ITEM_PAPER_RESIZE:
+    case ITEM_NEW_PAGE: case ITEM_DELETE_PAGE:
+      xo_canvas_cache_invalidate_page(u->page);
+      break;
+    default: // the undo item doesn't say where the edited items are
+      xo_canvas_cache_invalidate();
+  }
+}
+
+void xo_canvas_cache_note_undo(void)
+{
+  cache_pending_undo++;
+  xo_canvas_cache_schedule();
+}
+
+void xo_canvas_cache_reset(void)
+{
+  GList *list;
+
+  // only the caches holding pixels may have hidden anything
+  for (list = cache_live; list != NULL; list = list->next)
+    cache_restore((XoCanvasCache *)list->data);
+  xo_canvas_cache_schedule();
+}
+
+static void xo_canvas_cache_finalize(GObject *object)
+{
+  XoCanvasCache *cache = XO_CANVAS_CACHE(object);
+
+  cache_live = g_list_remove(cache_live, cache);
+  g_free(cache->pixels);
+  G_OBJECT_CLASS(xo_canvas_cache_parent_class)->finalize(object);
+}
+
+static void xo_canvas_cache_update(GnomeCanvasItem *item, double *affine, ArtSVP *clip_path, int flags)
+{
+  XoCanvasCache *cache = XO_CANVAS_CACHE(item);
+  ArtDRect page, rect;
+
+  if (GNOME_CANVAS_ITEM_CLASS(xo_canvas_cache_parent_class)->update)
+    GNOME_CANVAS_ITEM_CLASS(xo_canvas_cache_parent_class)->update(item, affine, clip_path, flags);
+
+  g_memmove(cache->cur_affine, affine, sizeof(cache->cur_affine));
+  page.x0 = 0.; page.y0 = 0.;
+  if (cache->page != NULL) { page.x1 = cache->page->width; page.y1 = cache->page->height; }
+  else page.x1 = page.y1 = 0.;
+  art_drect_affine_transform(&rect, &page, affine);
+  gnome_canvas_update_bbox(item, (int)floor(rect.x0), (int)floor(rect.y0),
+                           (int)ceil(rect.x1), (int)ceil(rect.y1));
+}
+
+static void xo_canvas_cache_render(GnomeCanvasItem *item, GnomeCanvasBuf *buf)
+{
+  XoCanvasCache *cache = XO_CANVAS_CACHE(item);
+  int x0, y0, x1, y1, y;
+  int n;
+
+  if (!cache->active) return;
+  x0 = MAX(buf->rect.x0, cache->x0); x1 = MIN(buf->rect.x1, cache->x1);
+  y0 = MAX(buf->rect.y0, cache->y0); y1 = MIN(buf->rect.y1, cache->y1);
+  if (!cache_is_valid(cache)) {
+    // out of date: draw what we cover the slow way until we're rebuilt
+    xo_canvas_cache_schedule();
+    if (ui.cairo_renderer) { // only the exposed part of the page, from the journal
+      if (x1 <= x0 || y1 <= y0) return;
+      gnome_canvas_buf_ensure_buf(buf);
+      xo_render_page_to_rgb(cache->page, cache->nlayers, cache->cur_affine,
+        buf->buf + (y0-buf->rect.y0)*buf->buf_rowstride + 3*(x0-buf->rect.x0),
+        buf->buf_rowstride, x0, y0, x1, y1, buf->bg_color);
+      buf->is_bg = 0;
+      return;
+    }
+    for (n = 0; n <= cache->page->nlayers; n++)
+      if (cache_is_hidden(cache_covered_item(cache->page, n)))
+        cache_render_item(cache_covered_item(cache->page, n), buf);
+    return;
+  }
+
+  if (x1 <= x0 || y1 <= y0) return;
+  gnome_canvas_buf_ensure_buf(buf);
+  for (y = y0; y < y1; y++)
+    g_memmove(buf->buf + (y-buf->rect.y0)*buf->buf_rowstride + 3*(x0-buf->rect.x0),
+              cache->pixels + (y-cache->y0)*cache->rowstride + 3*(x0-cache->x0),
+              3*(x1-x0));
+  buf->is_bg = 0;
+}
+
+static double xo_canvas_cache_point(GnomeCanvasItem *item, double x, double y,
+                                    int cx, int cy, GnomeCanvasItem **actual_item)
+{
+  *actual_item = item;
+  return CACHE_NOT_PICKABLE;
+}
+
+static void xo_canvas_cache_bounds(GnomeCanvasItem *item, double *x1, double *y1, double *x2, double *y2)
+{
+  XoCanvasCache *cache = XO_CANVAS_CACHE(item);
+
+  *x1 = *y1 = 0.;
+  *x2 = (cache->page != NULL) ? cache->page->width : 0.;
+  *y2 = (cache->page != NULL) ? cache->page->height : 0.;
+}
+
+static void xo_canvas_cache_init(XoCanvasCache *cache)
+{
+  cache->page = NULL;
+  cache->pixels = NULL;
+  cache->active = FALSE;
+  cache->nlayers = 0;
+  cache->generation = 0;
+  memset(cache->affine, 0, sizeof(cache->affine));
+  memset(cache->cur_affine, 0, sizeof(cache->cur_affine));
+}
+
+static void xo_canvas_cache_class_init(XoCanvasCacheClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+  GnomeCanvasItemClass *item_class = GNOME_CANVAS_ITEM_CLASS(klass);
+
+  gobject_class->finalize = xo_canvas_cache_finalize;
+  item_class->update = xo_canvas_cache_update;
+  item_class->render = xo_canvas_cache_render;
+  item_class->point = xo_canvas_cache_point;
+  item_class->bounds = xo_canvas_cache_bounds;
+}
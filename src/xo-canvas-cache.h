@@ -0,0 +1,55 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XO_CANVAS_CACHE_H
+#define XO_CANVAS_CACHE_H
+
+#include <libgnomecanvas/libgnomecanvas.h>
+
+/* XoCanvasCache: a raster cache for the parts of a page that aren't being
+   edited. On every visible page, the background and the layers below the
+   current one (all the layers, on pages other than the current one) are
+   rendered once into an RGB buffer at the current zoom, then hidden; the
+   cache item blits the buffer on expose instead. Undo-tracked edits and
+   background changes invalidate the caches of the pages and layers they
+   touch, and changes to which layers are shown restore the hidden items
+   before they happen. */
+
+#define XO_CANVAS_CACHE_HIDDEN_KEY "xo-cache-hidden" // on items hidden because they're cached
+
+#define XO_TYPE_CANVAS_CACHE         (xo_canvas_cache_get_type())
+#define XO_CANVAS_CACHE(object)      (G_TYPE_CHECK_INSTANCE_CAST((object), XO_TYPE_CANVAS_CACHE, XoCanvasCache))
+#define XO_CANVAS_CACHE_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST((klass), XO_TYPE_CANVAS_CACHE, XoCanvasCacheClass))
+#define XO_IS_CANVAS_CACHE(object)   (G_TYPE_CHECK_INSTANCE_TYPE((object), XO_TYPE_CANVAS_CACHE))
+
+typedef struct _XoCanvasCache      XoCanvasCache;
+typedef struct _XoCanvasCacheClass XoCanvasCacheClass;
+
+GType xo_canvas_cache_get_type(void) G_GNUC_CONST;
+
+// (re)build the caches of the visible pages when the main loop gets idle
+void xo_canvas_cache_schedule(void);
+// the contents of some page changed: rebuild the caches
+void xo_canvas_cache_invalidate(void);
+// rebuild only the cache of that page, or the caches covering that layer
+void xo_canvas_cache_invalidate_page(struct Page *pg);
+void xo_canvas_cache_invalidate_layer(struct Layer *l);
+void xo_canvas_cache_invalidate_undo(struct UndoItem *u);
+// a new undo item is being filled in: invalidate what it touches at idle time
+void xo_canvas_cache_note_undo(void);
+// about to show or hide layers: give the hidden items back to the canvas
+void xo_canvas_cache_reset(void);
+
+#endif /* XO_CANVAS_CACHE_H */
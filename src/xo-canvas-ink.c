@@ -0,0 +1,296 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of  
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <math.h>
+#include <string.h>
+#include <gtk/gtk.h>
+#include <libgnomecanvas/libgnomecanvas.h>
+#include <libart_lgpl/art_affine.h>
+#include <libart_lgpl/art_rect_svp.h>
+#include <libart_lgpl/art_svp_ops.h>
+#include <libart_lgpl/art_svp_vpath.h>
+#include <libart_lgpl/art_svp_vpath_stroke.h>
+#include <libart_lgpl/art_svp_wind.h>
+#include <libart_lgpl/art_vpath.h>
+
+#include "xo-canvas-ink.h"
+
+#define INK_FLATNESS 0.25 // tolerance for libart's curve flattening
+#define INK_NOT_PICKABLE 1e6 // distance reported to the canvas when picking
+
+struct _XoCanvasInk {
+  GnomeCanvasItem item;
+
+  guint color_rgba;
+  gboolean variable_width;
+  double width; // for fixed-width strokes
+  double *coords, *widths; // the points so far, in item coordinates
+  int num_points, alloc;
+
+  // pieces rendered so far, in canvas coordinates, with their bboxes
+  GPtrArray *svps;
+  GArray *rects;
+  int num_done; // points already covered by the pieces
+  double affine[6]; // the item-to-canvas affine used for the pieces
+};
+
+struct _XoCanvasInkClass {
+  GnomeCanvasItemClass parent_class;
+};
+
+G_DEFINE_TYPE (XoCanvasInk, xo_canvas_ink, GNOME_TYPE_CANVAS_ITEM)
+
+static void xo_canvas_ink_clear(XoCanvasInk *ink)
+{
+  int i;
+
+  for (i=0; i<ink->svps->len; i++)
+    art_svp_free((ArtSVP *)g_ptr_array_index(ink->svps, i));
+  g_ptr_array_set_size(ink->svps, 0);
+  g_array_set_size(ink->rects, 0);
+  ink->num_done = 0;
+}
+
+static void xo_canvas_ink_finalize(GObject *object)
+{
+  XoCanvasInk *ink = XO_CANVAS_INK(object);
+
+  xo_canvas_ink_clear(ink);
+  g_ptr_array_free(ink->svps, TRUE);
+  g_array_free(ink->rects, TRUE);
+  g_free(ink->coords);
+  g_free(ink->widths);
+
+  G_OBJECT_CLASS(xo_canvas_ink_parent_class)->finalize(object);
+}
+
+// an SVP for a closed polygon, with its orientation normalized
+
+static ArtSVP *polygon_svp(ArtVpath *vpath)
+{
+  ArtSVP *svp, *uncrossed;
+
+  svp = art_svp_from_vpath(vpath);
+  uncrossed = art_svp_uncross(svp);
+  art_svp_free(svp);
+  svp = art_svp_rewind_uncrossed(uncrossed, ART_WIND_RULE_NONZERO);
+  art_svp_free(uncrossed);
+  return svp;
+}
+
+static ArtSVP *disc_svp(ArtPoint *c, double r)
+{
+  ArtVpath *vpath;
+  ArtSVP *svp;
+
+  vpath = art_vpath_new_circle(c->x, c->y, r);
+  svp = polygon_svp(vpath);
+  art_free(vpath);
+  return svp;
+}
+
+static ArtSVP *trapeze_svp(ArtPoint *p, double *w)
+{
+  ArtVpath vpath[6];
+  double dx, dy, len, nx, ny;
+  int i;
+
+  dx = p[1].x-p[0].x; dy = p[1].y-p[0].y;
+  len = hypot(dx, dy);
+  if (len == 0.) return NULL;
+  nx = -dy/len/2; ny = dx/len/2;
+  vpath[0].x = p[0].x-w[0]*nx; vpath[0].y = p[0].y-w[0]*ny;
+  vpath[1].x = p[1].x-w[1]*nx; vpath[1].y = p[1].y-w[1]*ny;
+  vpath[2].x = p[1].x+w[1]*nx; vpath[2].y = p[1].y+w[1]*ny;
+  vpath[3].x = p[0].x+w[0]*nx; vpath[3].y = p[0].y+w[0]*ny;
+  vpath[4].x = vpath[0].x; vpath[4].y = vpath[0].y;
+  vpath[0].code = ART_MOVETO;
+  for (i=1; i<5; i++) vpath[i].code = ART_LINETO;
+  vpath[5].code = ART_END;
+  return polygon_svp(vpath);
+}
+
+static ArtSVP *segment_svp(ArtPoint *p, double w)
+{
+  ArtVpath vpath[3];
+
+  vpath[0].code = ART_MOVETO_OPEN; vpath[0].x = p[0].x; vpath[0].y = p[0].y;
+  vpath[1].code = ART_LINETO; vpath[1].x = p[1].x; vpath[1].y = p[1].y;
+  vpath[2].code = ART_END;
+  return art_svp_vpath_stroke(vpath, ART_PATH_STROKE_JOIN_ROUND,
+                              ART_PATH_STROKE_CAP_ROUND, w, 4, INK_FLATNESS);
+}
+
+// clip a new piece, store it, and redraw just the area it covers
+
+static void xo_canvas_ink_add_svp(XoCanvasInk *ink, ArtSVP *svp, ArtSVP *clip_path)
+{
+  GnomeCanvasItem *item = GNOME_CANVAS_ITEM(ink);
+  ArtSVP *clipped;
+  ArtDRect rect;
+
+  if (svp == NULL) return;
+  if (clip_path != NULL) {
+    clipped = art_svp_intersect(svp, clip_path);
+    art_svp_free(svp);
+    svp = clipped;
+  }
+  art_drect_svp(&rect, svp);
+  if (rect.x1 <= rect.x0 || rect.y1 <= rect.y0) {
+    art_svp_free(svp);
+    return;
+  }
+  g_ptr_array_add(ink->svps, svp);
+  g_array_append_val(ink->rects, rect);
+
+  if (ink->svps->len == 1) {
+    item->x1 = rect.x0; item->y1 = rect.y0;
+    item->x2 = rect.x1; item->y2 = rect.y1;
+  } else {
+    item->x1 = MIN(item->x1, rect.x0); item->y1 = MIN(item->y1, rect.y0);
+    item->x2 = MAX(item->x2, rect.x1); item->y2 = MAX(item->y2, rect.y1);
+  }
+  gnome_canvas_request_redraw(item->canvas, (int)floor(rect.x0), (int)floor(rect.y0),
+                              (int)ceil(rect.x1)+1, (int)ceil(rect.y1)+1);
+}
+
+static void xo_canvas_ink_update(GnomeCanvasItem *item, double *affine, ArtSVP *clip_path, int flags)
+{
+  XoCanvasInk *ink = XO_CANVAS_INK(item);
+  ArtPoint src, p[2];
+  double expansion, w[2];
+  int i;
+
+  if (GNOME_CANVAS_ITEM_CLASS(xo_canvas_ink_parent_class)->update)
+    GNOME_CANVAS_ITEM_CLASS(xo_canvas_ink_parent_class)->update(item, affine, clip_path, flags);
+
+  if (memcmp(affine, ink->affine, sizeof(ink->affine)) != 0) {
+    // zoom or move: redo all the pieces
+    if (ink->svps->len > 0)
+      gnome_canvas_request_redraw(item->canvas, (int)floor(item->x1), (int)floor(item->y1),
+                                  (int)ceil(item->x2)+1, (int)ceil(item->y2)+1);
+    xo_canvas_ink_clear(ink);
+    g_memmove(ink->affine, affine, sizeof(ink->affine));
+  }
+
+  expansion = art_affine_expansion(affine);
+  for (i = ink->num_done; i < ink->num_points; i++) {
+    src.x = ink->coords[2*i]; src.y = ink->coords[2*i+1];
+    art_affine_point(&p[1], &src, affine);
+    if (i > 0) {
+      src.x = ink->coords[2*i-2]; src.y = ink->coords[2*i-1];
+      art_affine_point(&p[0], &src, affine);
+    }
+    if (ink->variable_width) {
+      w[1] = ink->widths[i]*expansion;
+      if (i > 0) {
+        w[0] = ink->widths[i-1]*expansion;
+        xo_canvas_ink_add_svp(ink, trapeze_svp(p, w), clip_path);
+      }
+      xo_canvas_ink_add_svp(ink, disc_svp(&p[1], w[1]/2), clip_path);
+    }
+    else if (i > 0)
+      xo_canvas_ink_add_svp(ink, segment_svp(p, ink->width*expansion), clip_path);
+  }
+  ink->num_done = ink->num_points;
+}
+
+static void xo_canvas_ink_render(GnomeCanvasItem *item, GnomeCanvasBuf *buf)
+{
+  XoCanvasInk *ink = XO_CANVAS_INK(item);
+  ArtDRect *rect;
+  int i;
+
+  for (i=0; i<ink->svps->len; i++) {
+    rect = &g_array_index(ink->rects, ArtDRect, i);
+    if (rect->x1 < buf->rect.x0 || rect->x0 > buf->rect.x1 ||
+        rect->y1 < buf->rect.y0 || rect->y0 > buf->rect.y1) continue;
+    gnome_canvas_render_svp(buf, (ArtSVP *)g_ptr_array_index(ink->svps, i), ink->color_rgba);
+  }
+}
+
+static double xo_canvas_ink_point(GnomeCanvasItem *item, double x, double y,
+                                  int cx, int cy, GnomeCanvasItem **actual_item)
+{
+  *actual_item = item;
+  return INK_NOT_PICKABLE;
+}
+
+static void xo_canvas_ink_bounds(GnomeCanvasItem *item, double *x1, double *y1, double *x2, double *y2)
+{
+  XoCanvasInk *ink = XO_CANVAS_INK(item);
+  double r;
+  int i;
+
+  *x1 = *y1 = *x2 = *y2 = 0.;
+  for (i=0; i<ink->num_points; i++) {
+    r = (ink->variable_width ? ink->widths[i] : ink->width)/2;
+    if (i == 0 || ink->coords[2*i]-r < *x1) *x1 = ink->coords[2*i]-r;
+    if (i == 0 || ink->coords[2*i]+r > *x2) *x2 = ink->coords[2*i]+r;
+    if (i == 0 || ink->coords[2*i+1]-r < *y1) *y1 = ink->coords[2*i+1]-r;
+    if (i == 0 || ink->coords[2*i+1]+r > *y2) *y2 = ink->coords[2*i+1]+r;
+  }
+}
+
+static void xo_canvas_ink_init(XoCanvasInk *ink)
+{
+  ink->svps = g_ptr_array_new();
+  ink->rects = g_array_new(FALSE, FALSE, sizeof(ArtDRect));
+  ink->coords = ink->widths = NULL;
+  ink->num_points = ink->alloc = ink->num_done = 0;
+  memset(ink->affine, 0, sizeof(ink->affine)); // forces a first full update
+}
+
+static void xo_canvas_ink_class_init(XoCanvasInkClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+  GnomeCanvasItemClass *item_class = GNOME_CANVAS_ITEM_CLASS(klass);
+
+  gobject_class->finalize = xo_canvas_ink_finalize;
+  item_class->update = xo_canvas_ink_update;
+  item_class->render = xo_canvas_ink_render;
+  item_class->point = xo_canvas_ink_point;
+  item_class->bounds = xo_canvas_ink_bounds;
+}
+
+GnomeCanvasItem *xo_canvas_ink_new(GnomeCanvasGroup *group, guint color_rgba,
+                                   gboolean variable_width, double width)
+{
+  XoCanvasInk *ink;
+
+  ink = XO_CANVAS_INK(gnome_canvas_item_new(group, XO_TYPE_CANVAS_INK, NULL));
+  ink->color_rgba = color_rgba;
+  ink->variable_width = variable_width;
+  ink->width = width;
+  return GNOME_CANVAS_ITEM(ink);
+}
+
+void xo_canvas_ink_add_point(XoCanvasInk *ink, double x, double y, double width)
+{
+  if (ink->num_points == ink->alloc) {
+    ink->alloc = 2*ink->alloc + 64;
+    ink->coords = g_renew(double, ink->coords, 2*ink->alloc);
+    if (ink->variable_width) ink->widths = g_renew(double, ink->widths, ink->alloc);
+  }
+  ink->coords[2*ink->num_points] = x;
+  ink->coords[2*ink->num_points+1] = y;
+  if (ink->variable_width) ink->widths[ink->num_points] = width;
+  ink->num_points++;
+  gnome_canvas_item_request_update(GNOME_CANVAS_ITEM(ink));
+}
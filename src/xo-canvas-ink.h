@@ -0,0 +1,39 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of  
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XO_CANVAS_INK_H
+#define XO_CANVAS_INK_H
+
+#include <libgnomecanvas/libgnomecanvas.h>
+
+/* XoCanvasInk: the canvas item for the stroke being drawn. Points are
+   appended in place, and only the area of the newly added piece gets
+   rendered and redrawn, so the cost per motion event doesn't depend on
+   the length of the stroke. Only used on the antialiased canvas. */
+
+#define XO_TYPE_CANVAS_INK         (xo_canvas_ink_get_type())
+#define XO_CANVAS_INK(object)      (G_TYPE_CHECK_INSTANCE_CAST((object), XO_TYPE_CANVAS_INK, XoCanvasInk))
+#define XO_CANVAS_INK_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST((klass), XO_TYPE_CANVAS_INK, XoCanvasInkClass))
+#define XO_IS_CANVAS_INK(object)   (G_TYPE_CHECK_INSTANCE_TYPE((object), XO_TYPE_CANVAS_INK))
+
+typedef struct _XoCanvasInk      XoCanvasInk;
+typedef struct _XoCanvasInkClass XoCanvasInkClass;
+
+GType xo_canvas_ink_get_type(void) G_GNUC_CONST;
+GnomeCanvasItem *xo_canvas_ink_new(GnomeCanvasGroup *group, guint color_rgba,
+                                   gboolean variable_width, double width);
+void xo_canvas_ink_add_point(XoCanvasInk *ink, double x, double y, double width);
+
+#endif /* XO_CANVAS_INK_H */
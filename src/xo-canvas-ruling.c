@@ -0,0 +1,202 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <math.h>
+#include <string.h>
+#include <gtk/gtk.h>
+#include <libgnomecanvas/libgnomecanvas.h>
+
+#include "xournal.h"
+#include "xo-misc.h"
+#include "xo-canvas-ruling.h"
+
+#define RULING_NOT_PICKABLE 1e6 // distance reported to the canvas when picking
+
+struct _XoCanvasRuling {
+  GnomeCanvasItem item;
+
+  double width, height; // the page size
+  guint color_rgba;
+  int ruling;
+  double affine[6]; // item-to-canvas: a scaling and a translation
+};
+
+struct _XoCanvasRulingClass {
+  GnomeCanvasItemClass parent_class;
+};
+
+G_DEFINE_TYPE (XoCanvasRuling, xo_canvas_ruling, GNOME_TYPE_CANVAS_ITEM)
+
+/* fraction of pixel i (covering [i,i+1]) inside the interval [a,b] */
+
+static double ruling_coverage(int i, double a, double b)
+{
+  double c = MIN(b, i+1) - MAX(a, i);
+  return (c > 0.) ? c : 0.;
+}
+
+/* fill an axis-aligned rectangle, given in page coordinates, with exact
+   box-filtered antialiasing of its edges */
+
+static void ruling_fill_rect(XoCanvasRuling *r, GnomeCanvasBuf *buf,
+                             double x0, double y0, double x1, double y1, guint color)
+{
+  double cx0, cy0, cx1, cy1, alpha, cov, *xcov;
+  int i, j, i0, i1, j0, j1, k;
+  guchar *p, rgb[3];
+
+  cx0 = r->affine[0]*x0 + r->affine[4]; cx1 = r->affine[0]*x1 + r->affine[4];
+  cy0 = r->affine[3]*y0 + r->affine[5]; cy1 = r->affine[3]*y1 + r->affine[5];
+  i0 = MAX((int)floor(cx0), buf->rect.x0); i1 = MIN((int)ceil(cx1), buf->rect.x1);
+  j0 = MAX((int)floor(cy0), buf->rect.y0); j1 = MIN((int)ceil(cy1), buf->rect.y1);
+  if (i1 <= i0 || j1 <= j0) return;
+
+  rgb[0] = (color>>24) & 0xff; rgb[1] = (color>>16) & 0xff; rgb[2] = (color>>8) & 0xff;
+  alpha = (color & 0xff)/255.;
+  xcov = g_new(double, i1-i0);
+  for (i = i0; i < i1; i++) xcov[i-i0] = alpha*ruling_coverage(i, cx0, cx1);
+
+  gnome_canvas_buf_ensure_buf(buf);
+  buf->is_bg = 0;
+  for (j = j0; j < j1; j++) {
+    cov = ruling_coverage(j, cy0, cy1);
+    p = buf->buf + (j-buf->rect.y0)*buf->buf_rowstride + 3*(i0-buf->rect.x0);
+    for (i = i0; i < i1; i++, p += 3) {
+      if (cov*xcov[i-i0] >= 1.) { p[0] = rgb[0]; p[1] = rgb[1]; p[2] = rgb[2]; continue; }
+      for (k = 0; k < 3; k++)
+        p[k] += (int)floor((rgb[k] - p[k])*cov*xcov[i-i0] + 0.5);
+    }
+  }
+  g_free(xcov);
+}
+
+/* the index range of rules at start + k*step that may be visible in [lo,hi]
+   (page coordinates, widened by the half-thickness of a rule) */
+
+static void ruling_range(double start, double step, double lo, double hi, int *k0, int *k1)
+{
+  *k0 = MAX(0, (int)floor((lo - RULING_THICKNESS - start)/step));
+  *k1 = (int)ceil((hi + RULING_THICKNESS - start)/step);
+}
+
+static void xo_canvas_ruling_render(GnomeCanvasItem *item, GnomeCanvasBuf *buf)
+{
+  XoCanvasRuling *r = XO_CANVAS_RULING(item);
+  double top, bottom, left, right, x, y, t = RULING_THICKNESS/2;
+  int k, k0, k1;
+
+  ruling_fill_rect(r, buf, 0., 0., r->width, r->height, r->color_rgba);
+  if (r->ruling == RULING_NONE) return;
+
+  // the exposed area, in page coordinates
+  left = (buf->rect.x0 - r->affine[4])/r->affine[0];
+  right = (buf->rect.x1 - r->affine[4])/r->affine[0];
+  top = (buf->rect.y0 - r->affine[5])/r->affine[3];
+  bottom = (buf->rect.y1 - r->affine[5])/r->affine[3];
+
+  // same rules, in the same order, as print_background() draws them
+  if (r->ruling == RULING_GRAPH) {
+    ruling_range(RULING_GRAPHSPACING, RULING_GRAPHSPACING, left, right, &k0, &k1);
+    for (k = k0; k <= k1; k++) {
+      x = RULING_GRAPHSPACING*(k+1);
+      if (x >= r->width-1) break;
+      ruling_fill_rect(r, buf, x-t, 0., x+t, r->height, RULING_COLOR);
+    }
+    ruling_range(RULING_GRAPHSPACING, RULING_GRAPHSPACING, top, bottom, &k0, &k1);
+    for (k = k0; k <= k1; k++) {
+      y = RULING_GRAPHSPACING*(k+1);
+      if (y >= r->height-1) break;
+      ruling_fill_rect(r, buf, 0., y-t, r->width, y+t, RULING_COLOR);
+    }
+    return;
+  }
+
+  ruling_range(RULING_TOPMARGIN, RULING_SPACING, top, bottom, &k0, &k1);
+  for (k = k0; k <= k1; k++) {
+    y = RULING_TOPMARGIN + RULING_SPACING*k;
+    if (y >= r->height-1) break;
+    ruling_fill_rect(r, buf, 0., y-t, r->width, y+t, RULING_COLOR);
+  }
+  if (r->ruling == RULING_LINED)
+    ruling_fill_rect(r, buf, RULING_LEFTMARGIN-t, 0., RULING_LEFTMARGIN+t, r->height,
+                     RULING_MARGIN_COLOR);
+}
+
+static void xo_canvas_ruling_update(GnomeCanvasItem *item, double *affine, ArtSVP *clip_path, int flags)
+{
+  XoCanvasRuling *r = XO_CANVAS_RULING(item);
+  ArtDRect page, rect;
+
+  if (GNOME_CANVAS_ITEM_CLASS(xo_canvas_ruling_parent_class)->update)
+    GNOME_CANVAS_ITEM_CLASS(xo_canvas_ruling_parent_class)->update(item, affine, clip_path, flags);
+
+  g_memmove(r->affine, affine, sizeof(r->affine));
+  page.x0 = 0.; page.y0 = 0.;
+  page.x1 = r->width; page.y1 = r->height;
+  art_drect_affine_transform(&rect, &page, affine);
+  gnome_canvas_update_bbox(item, (int)floor(rect.x0), (int)floor(rect.y0),
+                           (int)ceil(rect.x1), (int)ceil(rect.y1));
+}
+
+static double xo_canvas_ruling_point(GnomeCanvasItem *item, double x, double y,
+                                     int cx, int cy, GnomeCanvasItem **actual_item)
+{
+  *actual_item = item;
+  return RULING_NOT_PICKABLE;
+}
+
+static void xo_canvas_ruling_bounds(GnomeCanvasItem *item, double *x1, double *y1, double *x2, double *y2)
+{
+  XoCanvasRuling *r = XO_CANVAS_RULING(item);
+
+  *x1 = *y1 = 0.;
+  *x2 = r->width; *y2 = r->height;
+}
+
+static void xo_canvas_ruling_init(XoCanvasRuling *r)
+{
+  r->width = r->height = 0.;
+  r->color_rgba = 0xffffffff;
+  r->ruling = RULING_NONE;
+  memset(r->affine, 0, sizeof(r->affine));
+}
+
+static void xo_canvas_ruling_class_init(XoCanvasRulingClass *klass)
+{
+  GnomeCanvasItemClass *item_class = GNOME_CANVAS_ITEM_CLASS(klass);
+
+  item_class->update = xo_canvas_ruling_update;
+  item_class->render = xo_canvas_ruling_render;
+  item_class->point = xo_canvas_ruling_point;
+  item_class->bounds = xo_canvas_ruling_bounds;
+}
+
+GnomeCanvasItem *xo_canvas_ruling_new(GnomeCanvasGroup *group, double width, double height,
+                                      guint color_rgba, int ruling)
+{
+  XoCanvasRuling *r;
+
+  r = XO_CANVAS_RULING(gnome_canvas_item_new(group, XO_TYPE_CANVAS_RULING, NULL));
+  r->width = width;
+  r->height = height;
+  r->color_rgba = color_rgba;
+  r->ruling = ruling;
+  gnome_canvas_item_request_update(GNOME_CANVAS_ITEM(r));
+  return GNOME_CANVAS_ITEM(r);
+}
@@ -0,0 +1,37 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XO_CANVAS_RULING_H
+#define XO_CANVAS_RULING_H
+
+#include <libgnomecanvas/libgnomecanvas.h>
+
+/* XoCanvasRuling: the background of a BG_SOLID page, as one canvas item.
+   The paper color and the ruled or graph lines are drawn procedurally,
+   only over the exposed area, instead of keeping a canvas line per rule. */
+
+#define XO_TYPE_CANVAS_RULING         (xo_canvas_ruling_get_type())
+#define XO_CANVAS_RULING(object)      (G_TYPE_CHECK_INSTANCE_CAST((object), XO_TYPE_CANVAS_RULING, XoCanvasRuling))
+#define XO_CANVAS_RULING_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST((klass), XO_TYPE_CANVAS_RULING, XoCanvasRulingClass))
+#define XO_IS_CANVAS_RULING(object)   (G_TYPE_CHECK_INSTANCE_TYPE((object), XO_TYPE_CANVAS_RULING))
+
+typedef struct _XoCanvasRuling      XoCanvasRuling;
+typedef struct _XoCanvasRulingClass XoCanvasRulingClass;
+
+GType xo_canvas_ruling_get_type(void) G_GNUC_CONST;
+GnomeCanvasItem *xo_canvas_ruling_new(GnomeCanvasGroup *group, double width, double height,
+                                      guint color_rgba, int ruling);
+
+#endif /* XO_CANVAS_RULING_H */
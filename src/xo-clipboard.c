@@ -207,6 +207,7 @@ void clipboard_paste_from_xournal(GtkSelectionData *sel_data)
   g_memmove(&nitems, p, sizeof(int)); p+= sizeof(int);
   ui.selection->type = ITEM_SELECTRECT;
   ui.selection->layer = ui.cur_layer;
+  ui.selection->preview_group = NULL;
   g_memmove(&ui.selection->bbox, p, sizeof(struct BBox)); p+= sizeof(struct BBox);
   ui.selection->items = NULL;
   
@@ -326,6 +327,7 @@ void clipboard_paste_text(gchar *text)
   ui.selection = g_new(struct Selection, 1);
   ui.selection->type = ITEM_SELECTRECT;
   ui.selection->layer = ui.cur_layer;
+  ui.selection->preview_group = NULL;
   ui.selection->items = NULL;
 
   item = g_new(struct Item, 1);
@@ -30,6 +30,7 @@
 #include <locale.h>
 #include <glib.h>
 #include <glib/gstdio.h>
+#include <sys/stat.h>
 #include <poppler/glib/poppler.h>
 
 #ifdef GDK_WINDOWING_X11
@@ -221,14 +222,22 @@ gboolean save_journal(const char *filename, gboolean is_auto)
             tmppg->bg->filename == pg->bg->filename)
           { is_clone = i; break; }
       }
-      if (is_clone >= 0)
+      if (is_clone >= 0) {
         gzprintf(f, "domain=\"clone\" filename=\"%d\" ", is_clone);
+        if (!is_auto) {
+          pg->bg->file_size = tmppg->bg->file_size;
+          pg->bg->file_mtime = tmppg->bg->file_mtime;
+        }
+      }
       else {
         if (pg->bg->file_domain == DOMAIN_ATTACH) {
           tmpfn = g_strdup_printf("%s.%s", filename, pg->bg->filename->s);
           if (is_auto)
             ui.autosave_filename_list = g_list_append(ui.autosave_filename_list, g_strdup(tmpfn));
-          if (!gdk_pixbuf_save(pg->bg->pixbuf, tmpfn, "png", NULL, NULL) && !is_auto) {
+          if (gdk_pixbuf_save(pg->bg->pixbuf, tmpfn, "png", NULL, NULL)) {
+            if (!is_auto) stamp_bg_file(pg->bg, tmpfn);
+          }
+          else if (!is_auto) {
             dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
               GTK_MESSAGE_ERROR, GTK_BUTTONS_OK, 
               _("Could not write background '%s'. Continuing anyway."), tmpfn);
@@ -605,6 +614,7 @@ void xoj_parser_start_element(GMarkupParseContext *context,
     tmpPage->bg->canvas_item = NULL;
     tmpPage->bg->pixbuf = NULL;
     tmpPage->bg->filename = NULL;
+    tmpPage->bg->file_size = -1;
     tmpJournal.pages = g_list_append(tmpJournal.pages, tmpPage);
     tmpJournal.npages++;
     // scan for height and width attributes
@@ -705,6 +715,8 @@ void xoj_parser_start_element(GMarkupParseContext *context,
           tmpPage->bg->pixbuf = tmpbg->pixbuf;
           if (tmpbg->pixbuf!=NULL) g_object_ref(tmpbg->pixbuf);
           tmpPage->bg->file_domain = tmpbg->file_domain;
+          tmpPage->bg->file_size = tmpbg->file_size;
+          tmpPage->bg->file_mtime = tmpbg->file_mtime;
         }
         else {
           tmpPage->bg->filename = new_refstring(*attribute_values);
@@ -717,7 +729,8 @@ void xoj_parser_start_element(GMarkupParseContext *context,
             }
             else tmpbg_filename = g_strdup(*attribute_values);
             tmpPage->bg->pixbuf = gdk_pixbuf_new_from_file(tmpbg_filename, NULL);
-            if (tmpPage->bg->pixbuf == NULL) {
+            if (tmpPage->bg->pixbuf != NULL) stamp_bg_file(tmpPage->bg, tmpbg_filename);
+            else {
               dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
                 GTK_MESSAGE_WARNING, GTK_BUTTONS_OK, 
                 _("Could not open background '%s'. Setting background to white."),
@@ -1151,6 +1164,7 @@ gboolean open_journal(char *filename)
   tmpJournal.npages = 0;
   tmpJournal.pages = NULL;
   tmpJournal.last_attach_no = 0;
+  tmpJournal.page_index = NULL;
   tmpPage = NULL;
   tmpLayer = NULL;
   tmpItem = NULL;
@@ -1303,13 +1317,29 @@ struct Background *attempt_load_pix_bg(char *filename, gboolean attach)
   if (attach) {
     bg->filename = new_refstring(NULL);
     bg->file_domain = DOMAIN_ATTACH;
+    bg->file_size = -1; // until it gets saved
   } else {
     bg->filename = new_refstring(filename);
     bg->file_domain = DOMAIN_ABSOLUTE;
+    stamp_bg_file(bg, filename);
   }
   return bg;
 }
 
+/* remember the size and date of the file a bitmap background was read
+   from or saved to: exports only reuse that file if it hasn't changed */
+
+void stamp_bg_file(struct Background *bg, const char *filename)
+{
+  struct stat st;
+
+  if (g_stat(filename, &st) == 0) {
+    bg->file_size = st.st_size;
+    bg->file_mtime = st.st_mtime;
+  }
+  else bg->file_size = -1;
+}
+
 #define BUFSIZE 65536 // a reasonable buffer size for reads from gs pipe
 
 GList *attempt_load_gv_bg(char *filename)
@@ -1375,6 +1405,7 @@ GList *attempt_load_gv_bg(char *filename)
       bg->type = BG_PIXMAP;
       bg->filename = new_refstring(NULL);
       bg->file_domain = DOMAIN_ATTACH;
+      bg->file_size = -1;
       file_pageno++;
       bg_list = g_list_append(bg_list, bg);
     }
@@ -1426,6 +1457,7 @@ struct Background *attempt_screenshot_bg(void)
   bg->pixbuf_scale = DEFAULT_ZOOM;
   bg->filename = new_refstring(NULL);
   bg->file_domain = DOMAIN_ATTACH;
+  bg->file_size = -1;
   return bg;
 #else
   // not implemented on non-X11 backends
@@ -1669,11 +1701,13 @@ gboolean init_bgpdf(char *pdfname, gboolean create_pages, int file_domain)
     if (pg == NULL) {
       pg = new_page_with_bg(bg, width, height);
       journal.pages = g_list_append(journal.pages, pg);
+      invalidate_page_index(i-1);
       journal.npages++;
     } else {
       pg->width = width; 
       pg->height = height;
       make_page_clipbox(pg);
+      invalidate_page_index(i-1);
       update_canvas_bg(pg);
     }
   }
@@ -1732,11 +1766,13 @@ void init_config_default(void)
   ui.scrollbar_step_increment = 30;
   ui.zoom_step_increment = 1;
   ui.zoom_step_factor = 1.5;
+  ui.zoom_preview = TRUE;
   ui.zoom_fast_factor = DEFAULT_ZOOM_FAST_FACTOR;
   ui.progressive_bg = TRUE;
   ui.print_ruling = TRUE;
   ui.exportpdf_prefer_legacy = FALSE;
   ui.exportpdf_layers = FALSE;
+  ui.exportpdf_incremental = FALSE;
   ui.default_unit = UNIT_CM;
   ui.default_path = NULL;
   ui.default_image = NULL;
@@ -1745,6 +1781,12 @@ void init_config_default(void)
   ui.pressure_sensitivity = FALSE;
   ui.width_minimum_multiplier = 0.0;
   ui.width_maximum_multiplier = 1.25;
+  ui.predict_horizon = 0;
+  ui.predict_measure = FALSE;
+  ui.raster_cache = TRUE;
+  ui.cairo_renderer = FALSE;
+  ui.drawing_area_view = FALSE;
+  ui.simplify_tolerance = 0.;
   ui.button_switch_mapping = FALSE;
   ui.autoload_pdf_xoj = FALSE;
   ui.autocreate_new_xoj = FALSE;
@@ -1883,6 +1925,9 @@ void save_config_to_file(void)
   update_keyval("general", "zoom_step_factor",
     _(" the multiplicative factor for zoom in/out"),
     g_strdup_printf("%.3f", ui.zoom_step_factor));
+  update_keyval("general", "zoom_preview",
+    _(" zoom in/out shows a scaled copy of the window at once, then redraws (true/false)"),
+    g_strdup(ui.zoom_preview?"true":"false"));
   update_keyval("general", "zoom_fast_factor",
     _(" the multiplicative factor for fast zoom (valid range from 1 to 10)"),
     g_strdup_printf("%.3f", ui.zoom_fast_factor));
@@ -1940,6 +1985,24 @@ void save_config_to_file(void)
   update_keyval("general", "width_maximum_multiplier",
      _(" maximum width multiplier"),
      g_strdup_printf("%.2f", ui.width_maximum_multiplier));
+  update_keyval("general", "pen_prediction_horizon",
+     _(" draw a predicted pen tip this far ahead of the last event (in millisec, 0 to disable)"),
+     g_strdup_printf("%d", ui.predict_horizon));
+  update_keyval("general", "pen_prediction_measure",
+     _(" show the ink lag with and without the predicted tip in the statusbar after each stroke (true/false)"),
+     g_strdup(ui.predict_measure?"true":"false"));
+  update_keyval("general", "raster_cache",
+     _(" keep a bitmap of the pages and layers not being edited, for faster redraws (true/false)"),
+     g_strdup(ui.raster_cache?"true":"false"));
+  update_keyval("general", "cairo_renderer",
+     _(" draw the bitmaps of raster_cache with cairo from the journal, instead of through the canvas (true/false)"),
+     g_strdup(ui.cairo_renderer?"true":"false"));
+  update_keyval("general", "drawing_area_view",
+     _(" show the pages in a drawing area painted with cairo instead of the canvas, from next startup; display only, the tools are disabled (true/false)"),
+     g_strdup(ui.drawing_area_view?"true":"false"));
+  update_keyval("general", "stroke_simplify_tolerance",
+     _(" when a stroke is finished, remove the points it can do without, within this distance (in points, 0 to disable)"),
+     g_strdup_printf("%.2f", ui.simplify_tolerance));
   update_keyval("general", "interface_order",
     _(" interface components from top to bottom\n valid values: drawarea menu main_toolbar pen_toolbar statusbar"),
     verbose_vertical_order(ui.vertical_order[0]));
@@ -1973,6 +2036,9 @@ void save_config_to_file(void)
   update_keyval("general", "exportpdf_layers",
     _(" export successive layers on separate pages in PDFs (true/false)"),
     g_strdup(ui.exportpdf_layers?"true":"false"));
+  update_keyval("general", "exportpdf_incremental",
+    _(" when annotating a PDF page for page, export only the changes as an incremental update of it (true/false)"),
+    g_strdup(ui.exportpdf_incremental?"true":"false"));
 
   update_keyval("general", "show_layers_above_current",
     _(" should xournal display values above the current one? (true/false)"),
@@ -2340,6 +2406,7 @@ void load_config_from_file(void)
   parse_keyval_int("general", "scrollbar_speed", &ui.scrollbar_step_increment, 1, 5000);
   parse_keyval_int("general", "zoom_dialog_increment", &ui.zoom_step_increment, 1, 500);
   parse_keyval_float("general", "zoom_step_factor", &ui.zoom_step_factor, 1., 5.);
+  parse_keyval_boolean("general", "zoom_preview", &ui.zoom_preview);
   parse_keyval_float("general", "zoom_fast_factor", &ui.zoom_fast_factor, 1., 10);
   parse_keyval_enum("general", "view_continuous", &ui.view_continuous, view_mode_names, 3);
   parse_keyval_boolean("general", "use_xinput", &ui.allow_xinput);
@@ -2360,6 +2427,12 @@ void load_config_from_file(void)
   parse_keyval_boolean("general", "pressure_sensitivity", &ui.pressure_sensitivity);
   parse_keyval_float("general", "width_minimum_multiplier", &ui.width_minimum_multiplier, 0., 10.);
   parse_keyval_float("general", "width_maximum_multiplier", &ui.width_maximum_multiplier, 0., 10.);
+  parse_keyval_int("general", "pen_prediction_horizon", &ui.predict_horizon, 0, 100);
+  parse_keyval_boolean("general", "pen_prediction_measure", &ui.predict_measure);
+  parse_keyval_boolean("general", "raster_cache", &ui.raster_cache);
+  parse_keyval_boolean("general", "cairo_renderer", &ui.cairo_renderer);
+  parse_keyval_boolean("general", "drawing_area_view", &ui.drawing_area_view);
+  parse_keyval_float("general", "stroke_simplify_tolerance", &ui.simplify_tolerance, 0., 5.);
 
   parse_keyval_vorderlist("general", "interface_order", ui.vertical_order[0]);
   parse_keyval_vorderlist("general", "interface_fullscreen", ui.vertical_order[1]);
@@ -2373,6 +2446,7 @@ void load_config_from_file(void)
   parse_keyval_boolean("general", "save_page_number", &ui.save_page_number);
   parse_keyval_boolean("general", "exportpdf_prefer_legacy", &ui.exportpdf_prefer_legacy);
   parse_keyval_boolean("general", "exportpdf_layers", &ui.exportpdf_layers);
+  parse_keyval_boolean("general", "exportpdf_incremental", &ui.exportpdf_incremental);
   parse_keyval_boolean("general", "show_layers_above_current", &ui.display_layers_above);
   
   parse_keyval_float("paper", "width", &ui.default_page.width, 1., 5000.);
@@ -34,6 +34,7 @@ gboolean close_journal(void);
 gboolean open_journal(char *filename);
 
 struct Background *attempt_load_pix_bg(char *filename, gboolean attach);
+void stamp_bg_file(struct Background *bg, const char *filename);
 GList *attempt_load_gv_bg(char *filename);
 struct Background *attempt_screenshot_bg(void);
 
@@ -35,6 +35,10 @@
 #include "xo-shapes.h"
 #include "xo-image.h"
 #include "xo-selection.h"
+#include "xo-stroke.h"
+#include "xo-canvas-cache.h"
+#include "xo-canvas-ruling.h"
+#include "xo-view.h"
 
 // some global constants
 
@@ -158,7 +162,7 @@ void set_current_page(gdouble *pt)
       if (ui.pageno == 0) break;
       page_change = TRUE;
       ui.pageno--;
-      tmppage = g_list_nth_data(journal.pages, ui.pageno);
+      tmppage = journal_page(ui.pageno);
       pt[1] += tmppage->height + VIEW_CONTINUOUS_SKIP;
     }
     while (pt[1] > tmppage->height + VIEW_CONTINUOUS_SKIP) {
@@ -166,7 +170,7 @@ void set_current_page(gdouble *pt)
       pt[1] -= tmppage->height + VIEW_CONTINUOUS_SKIP;
       page_change = TRUE;
       ui.pageno++;
-      tmppage = g_list_nth_data(journal.pages, ui.pageno);
+      tmppage = journal_page(ui.pageno);
     }
   }
   if (ui.view_continuous == VIEW_MODE_HORIZONTAL) {
@@ -174,7 +178,7 @@ void set_current_page(gdouble *pt)
       if (ui.pageno == 0) break;
       page_change = TRUE;
       ui.pageno--;
-      tmppage = g_list_nth_data(journal.pages, ui.pageno);
+      tmppage = journal_page(ui.pageno);
       pt[0] += tmppage->width + VIEW_CONTINUOUS_SKIP;
     }
     while (pt[0] > tmppage->width + VIEW_CONTINUOUS_SKIP) {
@@ -182,7 +186,7 @@ void set_current_page(gdouble *pt)
       pt[0] -= tmppage->width + VIEW_CONTINUOUS_SKIP;
       page_change = TRUE;
       ui.pageno++;
-      tmppage = g_list_nth_data(journal.pages, ui.pageno);
+      tmppage = journal_page(ui.pageno);
     }
   }
   if (page_change) do_switch_page(ui.pageno, FALSE, FALSE);
@@ -212,6 +216,8 @@ void prepare_new_undo(void)
   u->next = undo;
   u->multiop = 0;
   undo = u;
+  xo_canvas_cache_note_undo(); // the edit may touch a cached layer or page
+  xo_view_note_undo();
   ui.saved = FALSE;
   ui.need_autosave = TRUE;
   clear_redo_stack();
@@ -377,6 +383,8 @@ void delete_journal(struct Journal *j)
     delete_page((struct Page *)j->pages->data);
     j->pages = g_list_delete_link(j->pages, j->pages);
   }
+  if (j->page_index!=NULL) g_array_free(j->page_index, TRUE);
+  j->page_index = NULL;
 }
 
 void delete_page(struct Page *pg)
@@ -632,99 +640,27 @@ void make_page_clipbox(struct Page *pg)
   gnome_canvas_path_def_unref(pg_clip);
 }
 
-void make_canvas_stroke_disc(struct Item *item, double * pt, double * w)
-{
-  gnome_canvas_item_new((GnomeCanvasGroup *) item->canvas_item,
-     gnome_canvas_ellipse_get_type(),
-     "x1", pt[0]-w[0]/2, "y1", pt[1]-w[0]/2,
-     "x2", pt[0]+w[0]/2, "y2", pt[1]+w[0]/2,
-     "fill-color-rgba", item->brush.color_rgba, NULL);
-}
-
-void make_canvas_stroke_trapeze(struct Item *item, double * pt, double * w)
-{
-  GnomeCanvasPoints poly;
-  double polypt[8];
-
-  poly.coords = polypt;
-  poly.num_points = 4;
-  poly.ref_count = 1;
-  gnome_canvas_get_butt_points(pt[0], pt[1], pt[2], pt[3], w[1], 0,
-    polypt+0, polypt+1, polypt+2, polypt+3);
-  gnome_canvas_get_butt_points(pt[2], pt[3], pt[0], pt[1], w[0], 0,
-    polypt+4, polypt+5, polypt+6, polypt+7);
-
-  gnome_canvas_item_new((GnomeCanvasGroup *) item->canvas_item,
-     gnome_canvas_polygon_get_type(), "points", &poly,
-     "fill-color-rgba", item->brush.color_rgba, NULL);
-
-}
-
 //int CNTP, CNTS, CNTT; // profiling...
 
 void make_canvas_item_one(GnomeCanvasGroup *group, struct Item *item)
 {
   PangoFontDescription *font_desc;
-  GnomeCanvasPoints points;
   GtkWidget *dialog;
-  int j0, j;
-  gboolean disc_done;
-  double wmin, wmax;
 
   if (item->type == ITEM_STROKE) {
     if (!item->brush.variable_width)
       item->canvas_item = gnome_canvas_item_new(group,
-            gnome_canvas_line_get_type(), "points", item->path,   
+            gnome_canvas_line_get_type(),
             "cap-style", GDK_CAP_ROUND, "join-style", GDK_JOIN_ROUND,
             "fill-color-rgba", item->brush.color_rgba,  
             "width-units", item->brush.thickness, NULL);
-    else {
+    else // a single filled outline, rather than a group of lines and polygons
       item->canvas_item = gnome_canvas_item_new(group,
-            gnome_canvas_group_get_type(), NULL);
-
-      points.ref_count = 1;
-      disc_done = FALSE;
-      j0 = 0;
-
-      //CNTP += item->path->num_points - 1; // profiling...
-
-      while (j0 < item->path->num_points - 1) {
-          
-        wmin = wmax = item->widths[j0];
-        
-        j = j0 + 1;
-        while (j < item->path->num_points &&
-               item->widths[j] < wmin * LINE_WIDTH_PRECISION &&
-               item->widths[j] * LINE_WIDTH_PRECISION > wmax) {
-          if (item->widths[j] < wmin) wmin = item->widths[j];
-          if (item->widths[j] > wmax) wmax = item->widths[j];
-          j++;
-        }
-        
-        if (j0 < j - 1) {
-          /* draw from j0 to j-1 */
-          points.num_points = j - j0;
-          points.coords = item->path->coords+2*j0;   
-          gnome_canvas_item_new((GnomeCanvasGroup *) item->canvas_item,
-              gnome_canvas_line_get_type(), "points", &points, 
-              "cap-style", GDK_CAP_ROUND, "join-style", GDK_JOIN_ROUND, 
-              "fill-color-rgba", item->brush.color_rgba,
-              "width-units", (wmin + wmax) / 2, NULL);
-          disc_done = TRUE; //CNTS++; // profiling...
-          j0 = j - 1;
-        } else { /* j == j0+1; draw trapeze from j0 to j */
-          if (!disc_done) {
-            make_canvas_stroke_disc(item, item->path->coords+2*j0, item->widths+j0);
-          }
-          make_canvas_stroke_trapeze(item, item->path->coords+2*j0, item->widths+j0);
-          disc_done = FALSE; //CNTT++; // profiling...
-          j0 = j;
-        }
-      }
-      if (!disc_done)
-        make_canvas_stroke_disc(item, item->path->coords+2*(item->path->num_points-1),
-                                    item->widths+item->path->num_points-1);
-    }
+            gnome_canvas_bpath_get_type(),
+            "fill-color-rgba", item->brush.color_rgba,
+            "wind", ART_WIND_RULE_NONZERO, NULL);
+    // the path itself, simplified if the zoom is low enough
+    xo_stroke_show_lod(item, ui.zoom);
   }
   if (item->type == ITEM_TEXT) {
 #ifdef WIN32  // fontconfig cache generation takes forever, show hourglass
@@ -771,17 +707,19 @@ void make_canvas_items(void)
   struct Layer *l;
   struct Item *item;
   GList *pagelist, *layerlist, *itemlist;
+  int n;
   
   //int ti; // profiling...
   //ti = clock(); // profiling...
   //CNTP=CNTS=CNTT=0; // profiling...
   
-  for (pagelist = journal.pages; pagelist!=NULL; pagelist = pagelist->next) {
+  for (pagelist = journal.pages, n = 0; pagelist!=NULL; pagelist = pagelist->next, n++) {
     pg = (struct Page *)pagelist->data;
     if (pg->group == NULL) {
       pg->group = (GnomeCanvasGroup *) gnome_canvas_item_new(
          gnome_canvas_root(canvas), gnome_canvas_clipgroup_get_type(), NULL);
       make_page_clipbox(pg);
+      invalidate_page_index(n); // the new group needs placing
     }
     if (pg->bg->canvas_item == NULL) update_canvas_bg(pg);
     for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next) {
@@ -797,68 +735,28 @@ void make_canvas_items(void)
     }
   }
   
+  xo_canvas_cache_schedule();
   //printf("Cnts: P=%d, S=%d, T=%d; Time: %d\n", CNTP, CNTS, CNTT, (int)(clock() - ti)); // profiling...
 }
 
 void update_canvas_bg(struct Page *pg)
 {
-  GnomeCanvasGroup *group;
-  GnomeCanvasPoints *seg;
   GdkPixbuf *scaled_pix;
-  double *pt;
-  double x, y;
   int w, h;
   gboolean is_well_scaled;
   
+  xo_canvas_cache_invalidate_page(pg);
+  xo_view_invalidate_page(pg);
   if (pg->bg->canvas_item != NULL)
     gtk_object_destroy(GTK_OBJECT(pg->bg->canvas_item));
   pg->bg->canvas_item = NULL;
   
   if (pg->bg->type == BG_SOLID)
   {
-    pg->bg->canvas_item = gnome_canvas_item_new(pg->group,
-                               gnome_canvas_group_get_type(), NULL);
-    group = GNOME_CANVAS_GROUP(pg->bg->canvas_item);
+    // one item draws the paper and its ruling, whatever the number of rules
+    pg->bg->canvas_item = xo_canvas_ruling_new(pg->group, pg->width, pg->height,
+                               pg->bg->color_rgba, pg->bg->ruling);
     lower_canvas_item_to(pg->group, pg->bg->canvas_item, NULL);
-    gnome_canvas_item_new(group, gnome_canvas_rect_get_type(),
-      "x1", 0., "x2", pg->width, "y1", 0., "y2", pg->height,
-      "fill-color-rgba", pg->bg->color_rgba, NULL);
-    if (pg->bg->ruling == RULING_NONE) return;
-    seg = gnome_canvas_points_new(2);
-    pt = seg->coords;
-    if (pg->bg->ruling == RULING_GRAPH) {
-      pt[1] = 0; pt[3] = pg->height;
-      for (x=RULING_GRAPHSPACING; x<pg->width-1; x+=RULING_GRAPHSPACING) {
-        pt[0] = pt[2] = x;
-        gnome_canvas_item_new(group, gnome_canvas_line_get_type(),
-           "points", seg, "fill-color-rgba", RULING_COLOR,
-           "width-units", RULING_THICKNESS, NULL);
-      }      
-      pt[0] = 0; pt[2] = pg->width;
-      for (y=RULING_GRAPHSPACING; y<pg->height-1; y+=RULING_GRAPHSPACING) {
-        pt[1] = pt[3] = y;
-        gnome_canvas_item_new(group, gnome_canvas_line_get_type(),
-           "points", seg, "fill-color-rgba", RULING_COLOR,
-           "width-units", RULING_THICKNESS, NULL);
-      }      
-      gnome_canvas_points_free(seg);
-      return;
-    }
-    pt[0] = 0; pt[2] = pg->width;
-    for (y=RULING_TOPMARGIN; y<pg->height-1; y+=RULING_SPACING) {
-      pt[1] = pt[3] = y;
-      gnome_canvas_item_new(group, gnome_canvas_line_get_type(),
-         "points", seg, "fill-color-rgba", RULING_COLOR,
-         "width-units", RULING_THICKNESS, NULL);
-    }      
-    if (pg->bg->ruling == RULING_LINED) {
-      pt[0] = pt[2] = RULING_LEFTMARGIN;
-      pt[1] = 0; pt[3] = pg->height;
-      gnome_canvas_item_new(group, gnome_canvas_line_get_type(),
-         "points", seg, "fill-color-rgba", RULING_MARGIN_COLOR,
-         "width-units", RULING_THICKNESS, NULL);
-    }
-    gnome_canvas_points_free(seg);
     return;
   }
   
@@ -896,6 +794,156 @@ void update_canvas_bg(struct Page *pg)
   }
 }
 
+/* the page index: journal.pages as an array, to find pages by number in
+   constant time, and by position along the scrolling direction with a
+   binary search over their offsets (kept as running sums of the page
+   sizes in the continuous view modes). Changes to the pages must be
+   reported with invalidate_page_index(), and only the slots from the first
+   changed page on get recomputed, then placed by update_page_stuff(). */
+
+typedef struct PageSlot {
+  struct Page *page;
+  GnomeCanvasGroup *group; // the group placed at (x,y), or NULL
+  double x, y;
+  double maxsize; // largest page size across the scrolling direction so far
+} PageSlot;
+
+#define PAGE_INDEX_CLEAN G_MAXINT
+
+static int page_index_mode = -1; // the view mode the groups were placed for
+static int page_index_offsets_mode = -1; // the view mode of the offsets
+static int page_index_first = 0; // the first slot that may be out of date
+static int page_index_unplaced = 0; // the first slot whose group may need placing
+
+static void refresh_page_index(void)
+{
+  GList *pglist;
+  PageSlot *slot, *prev;
+  double pos, maxsize;
+  int i;
+
+  if (journal.page_index == NULL) {
+    journal.page_index = g_array_new(FALSE, TRUE, sizeof(PageSlot));
+    page_index_first = 0;
+  }
+  if (page_index_offsets_mode != ui.view_continuous) page_index_first = 0;
+  // a change in the page count that wasn't reported: assume the worst
+  if (journal.page_index->len != journal.npages && page_index_first == PAGE_INDEX_CLEAN)
+    page_index_first = 0;
+  if (page_index_first >= journal.npages) {
+    g_array_set_size(journal.page_index, journal.npages);
+    page_index_first = PAGE_INDEX_CLEAN;
+    return;
+  }
+  g_array_set_size(journal.page_index, journal.npages);
+  page_index_offsets_mode = ui.view_continuous;
+
+  if (page_index_first > 0) {
+    prev = &g_array_index(journal.page_index, PageSlot, page_index_first-1);
+    if (ui.view_continuous == VIEW_MODE_HORIZONTAL)
+      pos = prev->page->hoffset + prev->page->width + VIEW_CONTINUOUS_SKIP;
+    else pos = prev->page->voffset + prev->page->height + VIEW_CONTINUOUS_SKIP;
+    maxsize = prev->maxsize;
+  }
+  else pos = maxsize = 0.;
+  pglist = g_list_nth(journal.pages, page_index_first);
+  for (i = page_index_first; i<journal.npages; i++, pglist = pglist->next) {
+    slot = &g_array_index(journal.page_index, PageSlot, i);
+    if (slot->page != pglist->data) {
+      slot->page = (struct Page *)pglist->data;
+      slot->group = NULL;
+    }
+    if (ui.view_continuous == VIEW_MODE_HORIZONTAL) {
+      slot->page->hoffset = pos; slot->page->voffset = 0.;
+      pos += slot->page->width + VIEW_CONTINUOUS_SKIP;
+      maxsize = MAX(maxsize, slot->page->height);
+    }
+    else if (ui.view_continuous != VIEW_MODE_ONE_PAGE) {
+      slot->page->hoffset = 0.; slot->page->voffset = pos;
+      pos += slot->page->height + VIEW_CONTINUOUS_SKIP;
+      maxsize = MAX(maxsize, slot->page->width);
+    }
+    slot->maxsize = maxsize;
+  }
+  page_index_unplaced = MIN(page_index_unplaced, page_index_first);
+  page_index_first = PAGE_INDEX_CLEAN;
+}
+
+/* to be called whenever pages are added, removed, reordered or resized,
+   with the number of the first page affected */
+
+void invalidate_page_index(int pageno)
+{
+  page_index_first = MIN(page_index_first, MAX(pageno, 0));
+}
+
+struct Page *journal_page(int n)
+{
+  if (page_index_first != PAGE_INDEX_CLEAN || journal.page_index == NULL ||
+      journal.page_index->len != journal.npages)
+    refresh_page_index();
+  if (n < 0 || n >= journal.npages) return NULL;
+  return g_array_index(journal.page_index, PageSlot, n).page;
+}
+
+// returns whether the page moved
+static gboolean place_page_group(PageSlot *slot, gboolean force)
+{
+  struct Page *pg = slot->page;
+
+  if (!force && slot->group == pg->group && slot->x == pg->hoffset && slot->y == pg->voffset) return FALSE;
+  slot->x = pg->hoffset; slot->y = pg->voffset;
+  slot->group = pg->group;
+  if (pg->group == NULL) return TRUE;
+  gnome_canvas_item_set(GNOME_CANVAS_ITEM(pg->group), "x", pg->hoffset, "y", pg->voffset, NULL);
+  gnome_canvas_item_show(GNOME_CANVAS_ITEM(pg->group));
+  return TRUE;
+}
+
+// the last page starting at or before pos, in the continuous view modes
+
+int page_at_position(double pos)
+{
+  int lo, hi, mid;
+  struct Page *pg;
+
+  journal_page(0); // bring the index up to date
+  lo = 0; hi = journal.npages-1;
+  while (lo < hi) {
+    mid = (lo+hi+1)/2;
+    pg = g_array_index(journal.page_index, PageSlot, mid).page;
+    if (((ui.view_continuous == VIEW_MODE_HORIZONTAL) ? pg->hoffset : pg->voffset) <= pos)
+      lo = mid;
+    else hi = mid-1;
+  }
+  return lo;
+}
+
+// the range of pages that may be on screen (check them with is_visible)
+
+void get_visible_pages(int *first, int *last)
+{
+  GtkAdjustment *adj;
+  double top, bottom;
+  struct Page *pg;
+
+  if (ui.view_continuous == VIEW_MODE_ONE_PAGE) {
+    *first = *last = ui.pageno;
+    return;
+  }
+  if (ui.view_continuous == VIEW_MODE_HORIZONTAL)
+    adj = gtk_layout_get_hadjustment(GTK_LAYOUT(canvas));
+  else adj = gtk_layout_get_vadjustment(GTK_LAYOUT(canvas));
+  top = adj->value/ui.zoom;
+  bottom = (adj->value + adj->page_size) / ui.zoom;
+  *first = page_at_position(top);
+  pg = journal_page(*first);
+  if (ui.view_continuous == VIEW_MODE_HORIZONTAL ? (pg->hoffset + pg->width <= top)
+                                                 : (pg->voffset + pg->height <= top))
+    (*first)++; // top is in the gap after this page
+  *last = page_at_position(bottom);
+}
+
 gboolean is_visible(struct Page *pg)
 {
   GtkAdjustment *adj;
@@ -919,23 +967,193 @@ gboolean is_visible(struct Page *pg)
   return FALSE;
 }
 
-void rescale_bg_pixmaps(void)
+/* after a zoom change, switch strokes to the matching level of detail */
+
+void rescale_stroke_items(void)
+{
+  GList *pagelist, *layerlist, *itemlist;
+  struct Item *item;
+  
+  for (pagelist = journal.pages; pagelist!=NULL; pagelist = pagelist->next)
+    for (layerlist = ((struct Page *)pagelist->data)->layers; layerlist!=NULL; layerlist = layerlist->next)
+      for (itemlist = ((struct Layer *)layerlist->data)->items; itemlist!=NULL; itemlist = itemlist->next) {
+        item = (struct Item *)itemlist->data;
+        if (item->type == ITEM_STROKE && item->canvas_item != NULL)
+          xo_stroke_show_lod(item, ui.zoom);
+      }
+}
+
+/* zoom in/out with a preview: the window is first covered with a scaled
+   copy of what it showed, then once the zoom steps stop coming, the canvas
+   is rescaled. The pages on screen are refreshed at once, the others
+   (fonts, levels of detail) one at a time when the main loop is idle. */
+
+static guint zoom_preview_id = 0;
+static guint zoom_refine_id = 0;
+static int zoom_refine_pageno;
+static GHashTable *zoom_refine_done = NULL; // the pages already rescaled
+static double zoom_preview_base, zoom_preview_target;
+static GdkPixbuf *zoom_preview_snapshot = NULL;
+
+static void rescale_page_items(struct Page *pg)
+{
+  GList *layerlist, *itemlist;
+  struct Item *item;
+
+  for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next)
+    for (itemlist = ((struct Layer *)layerlist->data)->items; itemlist!=NULL; itemlist = itemlist->next) {
+      item = (struct Item *)itemlist->data;
+      if (item->type == ITEM_STROKE && item->canvas_item != NULL)
+        xo_stroke_show_lod(item, ui.zoom);
+      else update_text_item_displayfont(item);
+    }
+}
+
+static gboolean zoom_refine_cb(gpointer data)
+{
+  struct Page *pg;
+
+  do {
+    pg = journal_page(zoom_refine_pageno++);
+    if (pg == NULL) {
+      g_hash_table_destroy(zoom_refine_done);
+      zoom_refine_done = NULL;
+      zoom_refine_id = 0;
+      return FALSE;
+    }
+  } while (g_hash_table_lookup(zoom_refine_done, pg) != NULL);
+  rescale_page_items(pg);
+  return TRUE;
+}
+
+static void zoom_preview_draw(void)
+{
+  GdkPixbuf *dest;
+  GdkColor *color;
+  double f, ox, oy;
+  int w, h, x0, y0, x1, y1;
+
+  w = gdk_pixbuf_get_width(zoom_preview_snapshot);
+  h = gdk_pixbuf_get_height(zoom_preview_snapshot);
+  dest = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, w, h);
+  color = &(GTK_WIDGET(canvas)->style->bg[GTK_STATE_NORMAL]);
+  gdk_pixbuf_fill(dest, ((color->red & 0xff00) << 16) | ((color->green & 0xff00) << 8) |
+                        (color->blue & 0xff00) | 0xff);
+
+  // the canvas keeps the center of the window in place as it zooms
+  f = zoom_preview_target/zoom_preview_base;
+  ox = w*(1-f)/2; oy = h*(1-f)/2;
+  x0 = MAX(0, (int)ceil(ox)); x1 = MIN(w, (int)floor(ox + w*f));
+  y0 = MAX(0, (int)ceil(oy)); y1 = MIN(h, (int)floor(oy + h*f));
+  if (x1 > x0 && y1 > y0)
+    gdk_pixbuf_scale(zoom_preview_snapshot, dest, x0, y0, x1-x0, y1-y0, ox, oy, f, f,
+                     GDK_INTERP_BILINEAR);
+  gdk_draw_pixbuf(GTK_LAYOUT(canvas)->bin_window, NULL, dest, 0, 0,
+                  (int)gtk_layout_get_hadjustment(GTK_LAYOUT(canvas))->value,
+                  (int)gtk_layout_get_vadjustment(GTK_LAYOUT(canvas))->value,
+                  w, h, GDK_RGB_DITHER_NONE, 0, 0);
+  g_object_unref(dest);
+  gdk_flush();
+}
+
+static void zoom_preview_apply(void)
 {
   GList *pglist;
   struct Page *pg;
+
+  g_object_unref(zoom_preview_snapshot);
+  zoom_preview_snapshot = NULL;
+  zoom_preview_id = 0;
+  if (ui.zoom != zoom_preview_base) return; // zoomed some other way in the meantime
+
+  ui.zoom = zoom_preview_target;
+  gnome_canvas_set_pixels_per_unit(canvas, ui.zoom);
+  /* remember which pages were done here: what is visible changes before
+     the idle refinement gets to the others */
+  if (zoom_refine_done != NULL) g_hash_table_destroy(zoom_refine_done);
+  zoom_refine_done = g_hash_table_new(g_direct_hash, g_direct_equal);
+  for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next) {
+    pg = (struct Page *)pglist->data;
+    if (is_visible(pg) || pg == ui.cur_page) {
+      rescale_page_items(pg);
+      g_hash_table_insert(zoom_refine_done, pg, pg);
+    }
+  }
+  rescale_bg_pixmaps();
+  rescale_images();
+  zoom_refine_pageno = 0;
+  if (zoom_refine_id == 0) zoom_refine_id = g_idle_add(zoom_refine_cb, NULL);
+}
+
+static gboolean zoom_preview_cb(gpointer data)
+{
+  zoom_preview_apply();
+  return FALSE;
+}
+
+void zoom_with_preview(double factor)
+{
+  GdkWindow *window;
+  double zoom;
+
+  zoom = (zoom_preview_id != 0) ? zoom_preview_target : ui.zoom;
+  if (factor > 1 && zoom > MAX_ZOOM) return;
+  if (factor < 1 && zoom < MIN_ZOOM) return;
+  zoom *= factor;
+
+  window = GTK_LAYOUT(canvas)->bin_window;
+  if (zoom_preview_id == 0 && ui.zoom_preview && window != NULL) // take a picture of the window
+    zoom_preview_snapshot = gdk_pixbuf_get_from_drawable(NULL, window, NULL,
+         (int)gtk_layout_get_hadjustment(GTK_LAYOUT(canvas))->value,
+         (int)gtk_layout_get_vadjustment(GTK_LAYOUT(canvas))->value,
+         0, 0, GTK_WIDGET(canvas)->allocation.width, GTK_WIDGET(canvas)->allocation.height);
+  if (zoom_preview_snapshot == NULL) { // no preview: rescale everything now
+    ui.zoom = zoom;
+    gnome_canvas_set_pixels_per_unit(canvas, ui.zoom);
+    rescale_text_items();
+    rescale_stroke_items();
+    rescale_bg_pixmaps();
+    rescale_images();
+    return;
+  }
+
+  if (zoom_preview_id == 0) zoom_preview_base = ui.zoom;
+  else g_source_remove(zoom_preview_id);
+  zoom_preview_target = zoom;
+  zoom_preview_draw();
+  zoom_preview_id = g_timeout_add(ZOOM_PREVIEW_DELAY, zoom_preview_cb, NULL);
+}
+
+void flush_zoom_preview(void)
+{
+  if (zoom_preview_id == 0) return;
+  g_source_remove(zoom_preview_id);
+  zoom_preview_apply();
+}
+
+void rescale_bg_pixmaps(void)
+{
+  struct Page *pg;
   GdkPixbuf *pix;
   gboolean is_well_scaled;
   gdouble zoom_to_request;
+  int n, first, last;
   
-  for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next) {
-    pg = (struct Page *)pglist->data;
-    // in progressive mode we scale only visible pages
+  // in progressive mode we scale only visible pages
+  if (ui.progressive_bg) get_visible_pages(&first, &last);
+  else { first = 0; last = journal.npages-1; }
+  for (n = first; n <= last; n++) {
+    pg = journal_page(n);
     if (ui.progressive_bg && !is_visible(pg)) continue;
 
     if (pg->bg->type == BG_PIXMAP && pg->bg->canvas_item!=NULL) {
       g_object_get(G_OBJECT(pg->bg->canvas_item), "pixbuf", &pix, NULL);
-      if (pix!=pg->bg->pixbuf)
+      if (pix!=NULL) g_object_unref(pix); // only compared, not kept
+      if (pix!=pg->bg->pixbuf) {
         gnome_canvas_item_set(pg->bg->canvas_item, "pixbuf", pg->bg->pixbuf, NULL);
+        xo_canvas_cache_invalidate_page(pg);
+        xo_view_invalidate_page(pg);
+      }
       pg->bg->pixbuf_scale = 0;
     }
     if (pg->bg->type == BG_PDF) { 
@@ -944,12 +1162,15 @@ void rescale_bg_pixmaps(void)
                      && fabs(pg->bg->pixel_height - pg->height*ui.zoom) < 2.);
       if (pg->bg->canvas_item != NULL && !is_well_scaled) {
         g_object_get(pg->bg->canvas_item, "width-in-pixels", &is_well_scaled, NULL);
-        if (is_well_scaled)
+        if (is_well_scaled) {
           gnome_canvas_item_set(pg->bg->canvas_item,
             "width", pg->width, "height", pg->height, 
             "width-in-pixels", FALSE, "height-in-pixels", FALSE, 
             "width-set", TRUE, "height-set", TRUE, 
             NULL);
+          xo_canvas_cache_invalidate_page(pg);
+          xo_view_invalidate_page(pg);
+        }
       }
       // request an asynchronous update to a better pixmap if needed
       zoom_to_request = MIN(ui.zoom, MAX_SAFE_RENDER_DPI/72.0);
@@ -960,6 +1181,24 @@ void rescale_bg_pixmaps(void)
   }
 }
 
+/* while scrolling, the adjustments may change several times per frame:
+   look at the pages coming into view only once, just before the redraw */
+
+static guint rescale_bg_idle_id = 0;
+
+static gboolean rescale_bg_idle_cb(gpointer data)
+{
+  rescale_bg_idle_id = 0;
+  rescale_bg_pixmaps();
+  return FALSE;
+}
+
+void schedule_rescale_bg_pixmaps(void)
+{
+  if (rescale_bg_idle_id == 0)
+    rescale_bg_idle_id = g_idle_add_full(G_PRIORITY_HIGH_IDLE + 5, rescale_bg_idle_cb, NULL, NULL);
+}
+
 gboolean have_intersect(struct BBox *a, struct BBox *b)
 {
   return (MAX(a->top, b->top) <= MIN(a->bottom, b->bottom)) &&
@@ -1496,15 +1735,18 @@ void do_switch_page(int pg, gboolean rescroll, gboolean refresh_all)
   GList *list;
   
   ui.pageno = pg;
+  xo_canvas_cache_reset();
   /* re-show all the layers of the old page */
   if (ui.cur_page != NULL)
     for (i=0, list = ui.cur_page->layers; list!=NULL; i++, list = list->next) {
       layer = (struct Layer *)list->data;
-      if (layer->group!=NULL)
-        gnome_canvas_item_show(GNOME_CANVAS_ITEM(layer->group));
+      if (layer->group == NULL) continue;
+      if (!(GTK_OBJECT_FLAGS(layer->group) & GNOME_CANVAS_ITEM_VISIBLE))
+        xo_view_invalidate_page(ui.cur_page);
+      gnome_canvas_item_show(GNOME_CANVAS_ITEM(layer->group));
     }
   
-  ui.cur_page = g_list_nth_data(journal.pages, ui.pageno);
+  ui.cur_page = journal_page(ui.pageno);
   ui.layerno = ui.cur_page->nlayers-1;
   ui.cur_layer = (struct Layer *)(g_list_last(ui.cur_page->layers)->data);
   update_page_stuff();
@@ -1533,44 +1775,34 @@ void update_page_stuff(void)
   GList *pglist;
   GtkSpinButton *spin;
   struct Page *pg;
-  double vertpos, maxwidth, horizpos, maxheight;
+  PageSlot *slot;
+  double pos, maxsize;
+  gboolean horizontal, relayout, moved;
 
   // move the page groups to their rightful locations or hide them
-  if (ui.view_continuous == VIEW_MODE_CONTINUOUS) {
-    vertpos = 0.; 
-    maxwidth = 0.;
-    for (i=0, pglist = journal.pages; pglist!=NULL; i++, pglist = pglist->next) {
-      pg = (struct Page *)pglist->data;
-      if (pg->group!=NULL) {
-        pg->hoffset = 0.; pg->voffset = vertpos;
-        gnome_canvas_item_set(GNOME_CANVAS_ITEM(pg->group), 
-            "x", pg->hoffset, "y", pg->voffset, NULL);
-        gnome_canvas_item_show(GNOME_CANVAS_ITEM(pg->group));
-      }
-      vertpos += pg->height + VIEW_CONTINUOUS_SKIP;
-      if (pg->width > maxwidth) maxwidth = pg->width;
-    }
-    vertpos -= VIEW_CONTINUOUS_SKIP;
-    gnome_canvas_set_scroll_region(canvas, 0, 0, maxwidth, vertpos);
-  } 
-  else if (ui.view_continuous == VIEW_MODE_HORIZONTAL) {
-    horizpos = 0.; 
-    maxheight = 0.;
-    for (i=0, pglist = journal.pages; pglist!=NULL; i++, pglist = pglist->next) {
-      pg = (struct Page *)pglist->data;
-      if (pg->group!=NULL) {
-        pg->hoffset = horizpos; pg->voffset = 0.;
-        gnome_canvas_item_set(GNOME_CANVAS_ITEM(pg->group), 
-            "x", pg->hoffset, "y", pg->voffset, NULL);
-        gnome_canvas_item_show(GNOME_CANVAS_ITEM(pg->group));
-      }
-      horizpos += pg->width + VIEW_CONTINUOUS_SKIP;
-      if (pg->height > maxheight) maxheight = pg->height;
-    }
-    horizpos -= VIEW_CONTINUOUS_SKIP;
-    gnome_canvas_set_scroll_region(canvas, 0, 0, horizpos, maxheight);
+  if (ui.view_continuous != VIEW_MODE_ONE_PAGE) {
+    horizontal = (ui.view_continuous == VIEW_MODE_HORIZONTAL);
+    journal_page(0); // bring the index and the page offsets up to date
+    relayout = (page_index_mode != ui.view_continuous);
+    page_index_mode = ui.view_continuous;
+    if (relayout) page_index_unplaced = 0;
+    // only the pages from the first changed one on may have moved
+    moved = FALSE;
+    for (i=page_index_unplaced; i<journal.npages; i++)
+      if (place_page_group(&g_array_index(journal.page_index, PageSlot, i), relayout))
+        moved = TRUE;
+    page_index_unplaced = PAGE_INDEX_CLEAN;
+    if (moved) xo_view_invalidate();
+    slot = &g_array_index(journal.page_index, PageSlot, journal.npages-1);
+    pg = slot->page;
+    pos = horizontal ? pg->hoffset + pg->width : pg->voffset + pg->height;
+    maxsize = slot->maxsize;
+    if (horizontal) gnome_canvas_set_scroll_region(canvas, 0, 0, pos, maxsize);
+    else gnome_canvas_set_scroll_region(canvas, 0, 0, maxsize, pos);
   } 
   else { // VIEW_MODE_ONE_PAGE
+    page_index_mode = VIEW_MODE_ONE_PAGE; // the groups must all be placed again
+    page_index_offsets_mode = VIEW_MODE_ONE_PAGE; // and the offsets recomputed
     for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next) {
       pg = (struct Page *)pglist->data;
       if (pg == ui.cur_page && pg->group!=NULL) {
@@ -1583,6 +1815,7 @@ void update_page_stuff(void)
       }
     }
     gnome_canvas_set_scroll_region(canvas, 0, 0, ui.cur_page->width, ui.cur_page->height);
+    xo_view_invalidate(); // maybe another page
   }
 
   // update the page / layer info at bottom of screen
@@ -2063,6 +2296,7 @@ int get_resize_sides(double * pt) {
 void reset_selection(void)
 {
   if (ui.selection == NULL) return;
+  xo_selection_preview_end(0., 0.); // in case we're interrupted while dragging
   if (ui.selection->canvas_item != NULL) 
     gtk_object_destroy(GTK_OBJECT(ui.selection->canvas_item));
   g_list_free(ui.selection->items);
@@ -2076,17 +2310,112 @@ void reset_selection(void)
   update_cursor();
 }
 
+/* Item depths for selection moves: 'depths' lists, for each moved item, the
+   item just below it in its layer (NULL if at the bottom). Looking items up
+   through a hash table (item pointers are stable ids) keeps moves, undo and
+   redo linear in the size of the layer, even for large selections. */
+
+GList *xo_layer_item_depths(struct Layer *l, GList *itemlist)
+{
+  GHashTable *below;
+  GList *list, *depths;
+  gpointer prev;
+
+  below = g_hash_table_new(g_direct_hash, g_direct_equal);
+  prev = NULL;
+  for (list = l->items; list!=NULL; list = list->next) {
+    g_hash_table_insert(below, list->data, prev);
+    prev = list->data;
+  }
+  depths = NULL;
+  for (list = itemlist; list!=NULL; list = list->next)
+    depths = g_list_prepend(depths, g_hash_table_lookup(below, list->data));
+  g_hash_table_destroy(below);
+  return g_list_reverse(depths);
+}
+
+static void layer_remove_items(struct Layer *l, GList *itemlist)
+{
+  GHashTable *gone;
+  GList *list, *next;
+
+  gone = g_hash_table_new(g_direct_hash, g_direct_equal);
+  for (list = itemlist; list!=NULL; list = list->next)
+    g_hash_table_insert(gone, list->data, list->data);
+  for (list = l->items; list!=NULL; list = next) {
+    next = list->next;
+    if (g_hash_table_lookup(gone, list->data) != NULL)
+      l->items = g_list_delete_link(l->items, list);
+  }
+  l->nitems -= g_hash_table_size(gone);
+  g_hash_table_destroy(gone);
+}
+
+/* insert each item just above the one recorded in depths; since items
+   come in stacking order, an item may sit above one inserted before it */
+
+static void layer_insert_items_at_depths(struct Layer *l, GList *itemlist, GList *depths)
+{
+  GHashTable *above, *placed;
+  GList *list, *dep, *newlist;
+  gpointer cur, next;
+
+  above = g_hash_table_new(g_direct_hash, g_direct_equal);
+  placed = g_hash_table_new(g_direct_hash, g_direct_equal);
+  for (list = itemlist, dep = depths; list!=NULL; list = list->next) {
+    if (dep != NULL) {
+      if (g_hash_table_lookup(above, dep->data) == NULL)
+        g_hash_table_insert(above, dep->data, list->data);
+      dep = dep->next;
+    }
+  }
+
+  // rebuild the list (backwards), emitting after each item the chain of
+  // inserted items that go above it; leftovers go on top, as before
+  newlist = NULL;
+  list = l->items;
+  cur = NULL;
+  while (TRUE) {
+    while ((next = g_hash_table_lookup(above, cur)) != NULL &&
+           g_hash_table_lookup(placed, next) == NULL) {
+      newlist = g_list_prepend(newlist, next);
+      g_hash_table_insert(placed, next, next);
+      cur = next;
+    }
+    if (list == NULL) break;
+    cur = list->data;
+    newlist = g_list_prepend(newlist, cur);
+    list = list->next;
+  }
+  for (list = itemlist; list!=NULL; list = list->next) {
+    if (g_hash_table_lookup(placed, list->data) != NULL) continue;
+    newlist = g_list_prepend(newlist, list->data);
+    g_hash_table_insert(placed, list->data, list->data);
+    cur = list->data;
+    while ((next = g_hash_table_lookup(above, cur)) != NULL &&
+           g_hash_table_lookup(placed, next) == NULL) {
+      newlist = g_list_prepend(newlist, next);
+      g_hash_table_insert(placed, next, next);
+      cur = next;
+    }
+  }
+  g_list_free(l->items);
+  l->items = g_list_reverse(newlist);
+  l->nitems += g_hash_table_size(placed);
+  g_hash_table_destroy(above);
+  g_hash_table_destroy(placed);
+}
+
 void move_journal_items_by(GList *itemlist, double dx, double dy,
                               struct Layer *l1, struct Layer *l2, GList *depths)
 {
   struct Item *item;
-  GnomeCanvasItem *refitem;
-  GList *link;
+  GList *list;
   int i;
   double *pt;
   
-  while (itemlist!=NULL) {
-    item = (struct Item *)itemlist->data;
+  for (list = itemlist; list!=NULL; list = list->next) {
+    item = (struct Item *)list->data;
     if (item->type == ITEM_STROKE)
       for (pt=item->path->coords, i=0; i<item->path->num_points; i++, pt+=2)
         { pt[0] += dx; pt[1] += dy; }
@@ -2097,32 +2426,17 @@ void move_journal_items_by(GList *itemlist, double dx, double dy,
       item->bbox.top += dy;
       item->bbox.bottom += dy;
     }
-    if (l1 != l2) {
-      // find out where to insert
-      if (depths != NULL) {
-        if (depths->data == NULL) link = l2->items;
-        else {
-          link = g_list_find(l2->items, depths->data);
-          if (link != NULL) link = link->next;
-        }
-      } else link = NULL;
-      l2->items = g_list_insert_before(l2->items, link, item);
-      l2->nitems++;
-      l1->items = g_list_remove(l1->items, item);
-      l1->nitems--;
-    }
-    if (depths != NULL) { // also raise/lower the canvas items
-      if (item->canvas_item!=NULL) {
-        if (depths->data == NULL) link = NULL;
-        else link = g_list_find(l2->items, depths->data);
-        if (link != NULL) refitem = ((struct Item *)(link->data))->canvas_item;
-        else refitem = NULL;
-        lower_canvas_item_to(l2->group, item->canvas_item, refitem);
-      }
-      depths = depths->next;
+  }
+  if (l1 != l2) {
+    layer_remove_items(l1, itemlist);
+    if (depths != NULL) layer_insert_items_at_depths(l2, itemlist, depths);
+    else {
+      l2->items = g_list_concat(l2->items, g_list_copy(itemlist));
+      l2->nitems += g_list_length(itemlist);
     }
-    itemlist = itemlist->next;
   }
+  if (depths != NULL) // also put the canvas items back at their depths
+    xo_layer_restack_canvas_items(l2);
 }
 
 void resize_journal_items_by(GList *itemlist, double scaling_x, double scaling_y,
@@ -2199,6 +2513,155 @@ void resize_journal_items_by(GList *itemlist, double scaling_x, double scaling_y
   }
 }
 
+/* Live preview of selection moves and resizes: the selected canvas items
+   are reparented into one temporary group, so that each motion event only
+   updates that group's affine. The geometry is baked into the items once,
+   at pen-up (see xo_selection_preview_end). */
+
+void xo_selection_preview_start(gboolean with_box)
+{
+  GList *list;
+  struct Item *item;
+
+  GList *moving;
+
+  ui.selection->preview_group = (GnomeCanvasGroup *) gnome_canvas_item_new(
+      ui.selection->layer->group, gnome_canvas_group_get_type(), NULL);
+  moving = NULL;
+  for (list = ui.selection->items; list!=NULL; list = list->next) {
+    item = (struct Item *)list->data;
+    if (item->canvas_item!=NULL)
+      moving = g_list_prepend(moving, item->canvas_item);
+  }
+  if (with_box)
+    moving = g_list_prepend(moving, ui.selection->canvas_item);
+  moving = g_list_reverse(moving);
+  xo_canvas_items_reparent(moving, ui.selection->preview_group);
+  g_list_free(moving);
+}
+
+/* put the previewed items back into the layer group that now holds the
+   preview, translated by (dx,dy); the stacking order is that of the
+   selection, use xo_layer_restack_canvas_items() to restore it if needed */
+
+void xo_selection_preview_end(double dx, double dy)
+{
+  GnomeCanvasGroup *group, *parent;
+  GList *children, *list;
+
+  group = ui.selection->preview_group;
+  if (group == NULL) return;
+  parent = GNOME_CANVAS_GROUP(GNOME_CANVAS_ITEM(group)->parent);
+  children = g_list_copy(group->item_list);
+  xo_canvas_items_reparent(children, parent);
+  if (dx!=0. || dy!=0.)
+    for (list = children; list!=NULL; list = list->next)
+      gnome_canvas_item_move(GNOME_CANVAS_ITEM(list->data), dx, dy);
+  g_list_free(children);
+  gtk_object_destroy(GTK_OBJECT(group));
+  ui.selection->preview_group = NULL;
+}
+
+/* reorder a layer's canvas items to match l->items, in a single pass;
+   other children of the layer group (e.g. the selection box) stay on top */
+
+void xo_layer_restack_canvas_items(struct Layer *l)
+{
+  GnomeCanvasGroup *g;
+  GHashTable *ours;
+  GList *list, *stacked, *others;
+  struct Item *item;
+
+  g = l->group;
+  if (g == NULL) return;
+  ours = g_hash_table_new(g_direct_hash, g_direct_equal);
+  stacked = NULL;
+  for (list = l->items; list!=NULL; list = list->next) {
+    item = (struct Item *)list->data;
+    if (item->canvas_item!=NULL && item->canvas_item->parent == GNOME_CANVAS_ITEM(g)) {
+      g_hash_table_insert(ours, item->canvas_item, item->canvas_item);
+      stacked = g_list_prepend(stacked, item->canvas_item);
+    }
+  }
+  others = NULL;
+  for (list = g->item_list; list!=NULL; list = list->next)
+    if (g_hash_table_lookup(ours, list->data) == NULL)
+      others = g_list_prepend(others, list->data);
+  g_hash_table_destroy(ours);
+
+  g_list_free(g->item_list);
+  g->item_list = g_list_concat(g_list_reverse(stacked), g_list_reverse(others));
+  g->item_list_end = g_list_last(g->item_list);
+  // force a redraw of the group
+  gnome_canvas_item_move(GNOME_CANVAS_ITEM(g), 0., 0.);
+}
+
+/* move canvas items into another group of the same canvas, on top of it
+   and in the given order. gnome_canvas_item_reparent() searches the old
+   group's item_list for each item; here each group left is walked once. */
+
+void xo_canvas_items_reparent(GList *items, GnomeCanvasGroup *dest)
+{
+  GHashTable *moving, *sources;
+  GList *list, *sourcelist, *node, *next;
+  GnomeCanvasItem *item;
+  GnomeCanvasGroup *g;
+  guint state;
+
+  state = GTK_OBJECT_FLAGS(dest) & (GNOME_CANVAS_ITEM_REALIZED|GNOME_CANVAS_ITEM_MAPPED);
+  moving = g_hash_table_new(g_direct_hash, g_direct_equal);
+  sources = g_hash_table_new(g_direct_hash, g_direct_equal);
+  sourcelist = NULL;
+  for (list = items; list!=NULL; list = list->next) {
+    item = GNOME_CANVAS_ITEM(list->data);
+    if (item->parent == NULL || g_hash_table_lookup(moving, item)!=NULL) continue;
+    // an item that must be mapped or realized on the way takes the slow path
+    if ((GTK_OBJECT_FLAGS(item->parent) & (GNOME_CANVAS_ITEM_REALIZED|GNOME_CANVAS_ITEM_MAPPED)) != state) {
+      gnome_canvas_item_reparent(item, dest);
+      continue;
+    }
+    g_hash_table_insert(moving, item, item);
+    if (g_hash_table_lookup(sources, item->parent) == NULL) {
+      g_hash_table_insert(sources, item->parent, item->parent);
+      sourcelist = g_list_prepend(sourcelist, item->parent);
+    }
+  }
+
+  // unlink the items from the groups they leave (the refs they hold move along)
+  for (list = sourcelist; list!=NULL; list = list->next) {
+    g = GNOME_CANVAS_GROUP(list->data);
+    for (node = g->item_list; node!=NULL; node = next) {
+      next = node->next;
+      if (g_hash_table_lookup(moving, node->data) == NULL) continue;
+      item = GNOME_CANVAS_ITEM(node->data);
+      if (GTK_OBJECT_FLAGS(item) & GNOME_CANVAS_ITEM_VISIBLE)
+        gnome_canvas_request_redraw(item->canvas, item->x1, item->y1, item->x2 + 1, item->y2 + 1);
+      g->item_list = g_list_delete_link(g->item_list, node);
+    }
+    g->item_list_end = g_list_last(g->item_list);
+  }
+
+  for (list = items; list!=NULL; list = list->next) {
+    item = GNOME_CANVAS_ITEM(list->data);
+    if (g_hash_table_lookup(moving, item) == NULL) continue;
+    g_hash_table_remove(moving, item); // an item listed twice goes in once
+    item->parent = GNOME_CANVAS_ITEM(dest);
+    if (dest->item_list == NULL)
+      dest->item_list = dest->item_list_end = g_list_append(NULL, item);
+    else
+      dest->item_list_end = g_list_append(dest->item_list_end, item)->next;
+    // recompute the bounds under the new group's affine, and redraw
+    gnome_canvas_item_request_update(item);
+  }
+  /* an item already waiting for an update doesn't pass the request on
+     to its (new) ancestors: flag them ourselves */
+  gnome_canvas_item_request_update(GNOME_CANVAS_ITEM(dest));
+
+  g_list_free(sourcelist);
+  g_hash_table_destroy(sources);
+  g_hash_table_destroy(moving);
+}
+
 // Switch between button mappings
 
 /* NOTE ABOUT BUTTON MAPPINGS: ui.cur_mapping is 0 except while a canvas
@@ -2727,6 +3190,8 @@ xo_layer_active_set(gint layerIndex)
   }
 
   ui.in_update_page_stuff = TRUE;
+  xo_canvas_cache_reset();
+  xo_view_invalidate_page(ui.cur_page);
 
   // show layers below
 
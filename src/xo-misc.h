@@ -48,11 +48,17 @@ void update_item_bbox(struct Item *item);
 void make_page_clipbox(struct Page *pg);
 void make_canvas_items(void);
 void make_canvas_item_one(GnomeCanvasGroup *group, struct Item *item);
-void make_canvas_stroke_disc(struct Item *item, double * pt, double * w);
-void make_canvas_stroke_trapeze(struct Item *item, double * pt, double * w);
 void update_canvas_bg(struct Page *pg);
+struct Page *journal_page(int n);
+void invalidate_page_index(int pageno);
+int page_at_position(double pos);
+void get_visible_pages(int *first, int *last);
 gboolean is_visible(struct Page *pg);
 void rescale_bg_pixmaps(void);
+void schedule_rescale_bg_pixmaps(void);
+void zoom_with_preview(double factor);
+void flush_zoom_preview(void);
+void rescale_stroke_items(void);
 
 gboolean have_intersect(struct BBox *a, struct BBox *b);
 void lower_canvas_item_to(GnomeCanvasGroup *g, GnomeCanvasItem *item, GnomeCanvasItem *after);
@@ -106,10 +112,15 @@ int get_resize_sides(double * pt);
 // selection / clipboard stuff
 
 void reset_selection(void);
+GList *xo_layer_item_depths(struct Layer *l, GList *itemlist);
 void move_journal_items_by(GList *itemlist, double dx, double dy,
                            struct Layer *l1, struct Layer *l2, GList *depths);
 void resize_journal_items_by(GList *itemlist, double scaling_x, double scaling_y,
                              double offset_x, double offset_y);
+void xo_selection_preview_start(gboolean with_box);
+void xo_selection_preview_end(double dx, double dy);
+void xo_layer_restack_canvas_items(struct Layer *l);
+void xo_canvas_items_reparent(GList *items, GnomeCanvasGroup *dest);
 
 
 // switch between mappings
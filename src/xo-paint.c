@@ -24,8 +24,11 @@
 
 #include "xournal.h"
 #include "xo-callbacks.h"
+#include "xo-intl.h"
 #include "xo-misc.h"
 #include "xo-paint.h"
+#include "xo-canvas-ink.h"
+#include "xo-stroke.h"
 
 /************** drawing nice cursors *********/
 
@@ -212,6 +215,134 @@ void subdivide_cur_path(void)
   }
 }
 
+/* Pen-tip prediction: the ink trails the pen by at least one event and
+   one repaint, so optionally draw a provisional tail from the last sample
+   to where the pen should be ui.predict_horizon ms later, extrapolating
+   from the velocity (and pressure trend) of the last few samples. The tail
+   is replaced every time real samples arrive, and removed at pen-up. */
+
+#define PREDICT_SAMPLES 4     // recent samples used to estimate the velocity
+#define PREDICT_MAX_AGE 60    // ignore samples older than this (in millisec)
+
+static struct { double x, y, w; guint32 t; } predict_samples[PREDICT_SAMPLES];
+static int predict_nsamples = 0;
+static GnomeCanvasItem *predict_tail = NULL;
+/* measurement mode: lag of the ink tip behind the pen, with and without
+   the tail, against the ink as last drawn (the tail is only redrawn once
+   per batch of motion events) */
+static struct { double x, y, tipx, tipy; guint32 t; gboolean valid; } predict_drawn;
+static double predict_lag_plain, predict_lag_predicted;
+static int predict_nlag;
+
+static gboolean predict_velocity(double *v)
+{
+  int first, last = predict_nsamples-1;
+  double dt;
+
+  if (predict_nsamples < 2) return FALSE;
+  for (first = 0; first < last; first++)
+    if (predict_samples[last].t - predict_samples[first].t <= PREDICT_MAX_AGE) break;
+  if (first == last) return FALSE;
+  dt = predict_samples[last].t - predict_samples[first].t;
+  if (dt <= 0) return FALSE;
+  v[0] = (predict_samples[last].x - predict_samples[first].x)/dt;
+  v[1] = (predict_samples[last].y - predict_samples[first].y)/dt;
+  v[2] = (predict_samples[last].w - predict_samples[first].w)/dt;
+  return TRUE;
+}
+
+static void predict_record(double *pt, double width, guint32 time)
+{
+  double dt, dist;
+
+  if (ui.predict_measure && predict_drawn.valid) {
+    /* while the pen moved here, the screen showed the ink ending at the
+       last sample of the previous batch, and the tail ending at its tip;
+       the distance still to cover is converted to time at the pen's speed */
+    dt = time - predict_drawn.t;
+    dist = hypot(pt[0]-predict_drawn.x, pt[1]-predict_drawn.y);
+    if (dt > 0 && dist > 0) {
+      predict_lag_plain += dt;
+      predict_lag_predicted += hypot(pt[0]-predict_drawn.tipx, pt[1]-predict_drawn.tipy)*dt/dist;
+      predict_nlag++;
+    }
+  }
+  if (predict_nsamples == PREDICT_SAMPLES) {
+    g_memmove(predict_samples, predict_samples+1, (PREDICT_SAMPLES-1)*sizeof(predict_samples[0]));
+    predict_nsamples--;
+  }
+  predict_samples[predict_nsamples].x = pt[0];
+  predict_samples[predict_nsamples].y = pt[1];
+  predict_samples[predict_nsamples].w = width;
+  predict_samples[predict_nsamples].t = time;
+  predict_nsamples++;
+}
+
+void update_stroke_prediction(void)
+{
+  double v[3], w, maxw;
+  GnomeCanvasPoints *seg;
+
+  if (ui.predict_horizon <= 0 || ui.cur_item_type != ITEM_STROKE ||
+      ui.cur_item == NULL || ui.cur_brush->ruler) return;
+  if (predict_nsamples > 0) {
+    predict_drawn.x = predict_drawn.tipx = predict_samples[predict_nsamples-1].x;
+    predict_drawn.y = predict_drawn.tipy = predict_samples[predict_nsamples-1].y;
+    predict_drawn.t = predict_samples[predict_nsamples-1].t;
+    predict_drawn.valid = TRUE;
+  }
+  if (!predict_velocity(v)) {
+    if (predict_tail != NULL) gnome_canvas_item_hide(predict_tail);
+    return;
+  }
+  seg = gnome_canvas_points_new(2);
+  seg->coords[0] = predict_samples[predict_nsamples-1].x;
+  seg->coords[1] = predict_samples[predict_nsamples-1].y;
+  seg->coords[2] = seg->coords[0] + v[0]*ui.predict_horizon;
+  seg->coords[3] = seg->coords[1] + v[1]*ui.predict_horizon;
+  w = predict_samples[predict_nsamples-1].w;
+  if (ui.cur_item->brush.variable_width) {
+    maxw = ui.cur_item->brush.thickness*ui.width_maximum_multiplier;
+    w += v[2]*ui.predict_horizon;
+    if (w < 0) w = 0;
+    if (w > maxw) w = maxw;
+  }
+  if (predict_tail == NULL)
+    predict_tail = gnome_canvas_item_new(ui.cur_layer->group,
+      gnome_canvas_line_get_type(),
+      "cap-style", GDK_CAP_ROUND, "join-style", GDK_JOIN_ROUND,
+      "fill-color-rgba", ui.cur_item->brush.color_rgba, NULL);
+  gnome_canvas_item_set(predict_tail, "points", seg, "width-units", w, NULL);
+  gnome_canvas_item_show(predict_tail);
+  predict_drawn.tipx = seg->coords[2];
+  predict_drawn.tipy = seg->coords[3];
+  gnome_canvas_points_free(seg);
+}
+
+static void end_stroke_prediction(void)
+{
+  GtkStatusbar *statusbar;
+  gchar *msg;
+
+  if (predict_tail != NULL) {
+    gtk_object_destroy(GTK_OBJECT(predict_tail));
+    predict_tail = NULL;
+  }
+  if (ui.predict_measure && predict_nlag > 0) {
+    statusbar = GTK_STATUSBAR(GET_COMPONENT("statusbar"));
+    msg = g_strdup_printf(_("Pen prediction (%d ms): ink lag %.1f ms -> %.1f ms over %d samples"),
+      ui.predict_horizon, predict_lag_plain/predict_nlag,
+      predict_lag_predicted/predict_nlag, predict_nlag);
+    gtk_statusbar_pop(statusbar, gtk_statusbar_get_context_id(statusbar, "predict"));
+    gtk_statusbar_push(statusbar, gtk_statusbar_get_context_id(statusbar, "predict"), msg);
+    g_free(msg);
+  }
+  predict_drawn.valid = FALSE;
+  predict_nsamples = 0;
+  predict_lag_plain = predict_lag_predicted = 0.;
+  predict_nlag = 0;
+}
+
 void create_new_stroke(GdkEvent *event)
 {
   ui.cur_item_type = ITEM_STROKE;
@@ -232,15 +363,20 @@ void create_new_stroke(GdkEvent *event)
     ui.cur_item->brush.variable_width = FALSE;
   } else {
     double current_width;
-    ui.cur_item->canvas_item = gnome_canvas_item_new(
-      ui.cur_layer->group, gnome_canvas_group_get_type(), NULL);
 
     if (ui.cur_item->brush.variable_width) {
       realloc_cur_widths(1);
       current_width = ui.cur_item->brush.thickness*get_pressure_multiplier(event);
       ui.cur_widths[0] = current_width;
-      make_canvas_stroke_disc(ui.cur_item, ui.cur_path.coords, ui.cur_widths);
     } else current_width = ui.cur_item->brush.thickness;
+    // a single item that grows as the stroke gets drawn
+    ui.cur_item->canvas_item = xo_canvas_ink_new(ui.cur_layer->group,
+      ui.cur_item->brush.color_rgba, ui.cur_item->brush.variable_width,
+      ui.cur_item->brush.thickness);
+    xo_canvas_ink_add_point(XO_CANVAS_INK(ui.cur_item->canvas_item),
+      ui.cur_path.coords[0], ui.cur_path.coords[1], current_width);
+    predict_nsamples = 0;
+    predict_record(ui.cur_path.coords, current_width, gdk_event_get_time(event));
   }
 }
 
@@ -278,40 +414,20 @@ void continue_stroke(GdkEvent *event)
     ui.cur_path.num_points++;
   }
   
-  /* note: we're using a piece of the cur_path array. This is ok because
-     upon creation the line just copies the contents of the GnomeCanvasPoints
-     into an internal structure */
-
-  if (ui.cur_item->brush.variable_width) {
-    if (ui.cur_widths[ui.cur_path.num_points-1] < ui.cur_widths[ui.cur_path.num_points-2] * LINE_WIDTH_PRECISION &&
-        ui.cur_widths[ui.cur_path.num_points-2] < ui.cur_widths[ui.cur_path.num_points-1] * LINE_WIDTH_PRECISION) {
-      GnomeCanvasPoints seg;
-      seg.coords = pt; 
-      seg.num_points = 2;
-      seg.ref_count = 1;
-      gnome_canvas_item_new((GnomeCanvasGroup *)ui.cur_item->canvas_item,
-         gnome_canvas_line_get_type(), "points", &seg,
-         "cap-style", GDK_CAP_ROUND, "join-style", GDK_JOIN_ROUND,
-         "fill-color-rgba", ui.cur_item->brush.color_rgba,
-         "width-units", (ui.cur_widths[ui.cur_path.num_points-2] + ui.cur_widths[ui.cur_path.num_points-1]) / 2, NULL);      
-    } else {
-      make_canvas_stroke_trapeze(ui.cur_item, pt, ui.cur_widths+ui.cur_path.num_points-2);
-      make_canvas_stroke_disc(ui.cur_item, pt + 2, ui.cur_widths+ui.cur_path.num_points-1);
-   }
-  } else {
+  if (ui.cur_brush->ruler) {
+    /* note: we're using a piece of the cur_path array. This is ok because
+       upon creation the line just copies the contents of the GnomeCanvasPoints
+       into an internal structure */
     GnomeCanvasPoints seg;
     seg.coords = pt; 
     seg.num_points = 2;
     seg.ref_count = 1;
-    if (ui.cur_brush->ruler) {
-      gnome_canvas_item_set(ui.cur_item->canvas_item, "points", &seg, NULL);
-    } else {
-      gnome_canvas_item_new((GnomeCanvasGroup *)ui.cur_item->canvas_item,
-         gnome_canvas_line_get_type(), "points", &seg,
-         "cap-style", GDK_CAP_ROUND, "join-style", GDK_JOIN_ROUND,
-         "fill-color-rgba", ui.cur_item->brush.color_rgba,
-         "width-units", current_width, NULL);      
-    }
+    gnome_canvas_item_set(ui.cur_item->canvas_item, "points", &seg, NULL);
+  }
+  else { // only the new piece gets rendered and redrawn
+    xo_canvas_ink_add_point(XO_CANVAS_INK(ui.cur_item->canvas_item),
+      pt[2], pt[3], current_width);
+    predict_record(pt+2, current_width, gdk_event_get_time(event));
   }
 }
 
@@ -319,14 +435,60 @@ void abort_stroke(void)
 {
   if (ui.cur_item_type != ITEM_STROKE || ui.cur_item == NULL) return;
   ui.cur_path.num_points = 0;
+  end_stroke_prediction();
   gtk_object_destroy(GTK_OBJECT(ui.cur_item->canvas_item));
   g_free(ui.cur_item);
   ui.cur_item = NULL;
   ui.cur_item_type = ITEM_NONE;
 }
 
+/* Optional storage simplification at pen-up: drop the points (and widths)
+   the stroke can do without, keeping it within ui.simplify_tolerance of
+   the original. Simplified strokes aren't subdivided again afterwards
+   (the eraser splits long segments as needed), so what's left is what
+   gets stored; show the compression obtained so far. */
+
+static gboolean simplify_cur_path(void)
+{
+  gdouble *widths;
+  int *index, count, i, n = ui.cur_path.num_points;
+
+  if (ui.simplify_tolerance <= 0. || n <= 2) return FALSE;
+  widths = ui.cur_item->brush.variable_width ? ui.cur_widths : NULL;
+  index = xo_stroke_simplify(ui.cur_path.coords, widths, n, ui.simplify_tolerance, &count);
+  for (i=0; i<count; i++) { // in place, since index[i] >= i
+    ui.cur_path.coords[2*i] = ui.cur_path.coords[2*index[i]];
+    ui.cur_path.coords[2*i+1] = ui.cur_path.coords[2*index[i]+1];
+    if (widths != NULL) widths[i] = widths[index[i]];
+  }
+  ui.cur_path.num_points = count;
+  g_free(index);
+  return TRUE;
+}
+
+static void show_simplify_stats(int n)
+{
+  static long points_in = 0, points_out = 0;
+  GtkStatusbar *statusbar;
+  gchar *msg;
+  int count = ui.cur_path.num_points; // as stored
+
+  points_in += n;
+  points_out += count;
+  statusbar = GTK_STATUSBAR(GET_COMPONENT("statusbar"));
+  msg = g_strdup_printf(_("Stroke simplification: %d -> %d points; %ld -> %ld so far (%.1f:1)"),
+                        n, count, points_in, points_out, (double)points_in/points_out);
+  gtk_statusbar_pop(statusbar, gtk_statusbar_get_context_id(statusbar, "simplify"));
+  gtk_statusbar_push(statusbar, gtk_statusbar_get_context_id(statusbar, "simplify"), msg);
+  g_free(msg);
+}
+
 void finalize_stroke(void)
 {
+  gboolean simplified;
+  int n;
+
+  end_stroke_prediction();
   if (ui.cur_path.num_points == 1) { // GnomeCanvas doesn't like num_points=1
     ui.cur_path.coords[2] = ui.cur_path.coords[0]+0.1;
     ui.cur_path.coords[3] = ui.cur_path.coords[1];
@@ -334,8 +496,11 @@ void finalize_stroke(void)
     ui.cur_item->brush.variable_width = FALSE;
   }
   
-  if (!ui.cur_item->brush.variable_width)
+  n = ui.cur_path.num_points;
+  simplified = simplify_cur_path();
+  if (!ui.cur_item->brush.variable_width && !simplified)
     subdivide_cur_path(); // split the segment so eraser will work
+  if (simplified) show_simplify_stats(n);
 
   ui.cur_item->path = gnome_canvas_points_new(ui.cur_path.num_points);
   g_memmove(ui.cur_item->path->coords, ui.cur_path.coords, 
@@ -347,12 +512,10 @@ void finalize_stroke(void)
   update_item_bbox(ui.cur_item);
   ui.cur_path.num_points = 0;
 
-  if (!ui.cur_item->brush.variable_width) {
-    // destroy the entire group of temporary line segments
-    gtk_object_destroy(GTK_OBJECT(ui.cur_item->canvas_item));
-    // make a new line item to replace it
-    make_canvas_item_one(ui.cur_layer->group, ui.cur_item);
-  }
+  // destroy the in-progress ink item
+  gtk_object_destroy(GTK_OBJECT(ui.cur_item->canvas_item));
+  // make a new line (or stroke outline) item to replace it
+  make_canvas_item_one(ui.cur_layer->group, ui.cur_item);
 
   // add undo information
   prepare_new_undo();
@@ -369,6 +532,50 @@ void finalize_stroke(void)
 
 /************** eraser tool *************/
 
+/* the eraser looks for points of the stroke inside its circle: where a
+   segment crosses the circle with both ends outside (as the long segments
+   of simplified strokes do), add the point of the segment closest to the
+   center. The shape of the stroke doesn't change. */
+
+static void split_stroke_segments(struct Item *item, double x, double y, double radius)
+{
+  GnomeCanvasPoints *path;
+  gdouble *widths;
+  double *pt, *t, dx, dy;
+  int i, j, n, k;
+
+  n = item->path->num_points;
+  t = g_new(double, n);
+  for (i=0, k=0, pt=item->path->coords; i<n-1; i++, pt+=2) {
+    t[i] = -1.;
+    dx = pt[2]-pt[0]; dy = pt[3]-pt[1];
+    if (dx == 0. && dy == 0.) continue;
+    if (hypot(pt[0]-x, pt[1]-y) <= radius || hypot(pt[2]-x, pt[3]-y) <= radius) continue;
+    t[i] = ((x-pt[0])*dx + (y-pt[1])*dy)/(dx*dx+dy*dy);
+    if (t[i] <= 0. || t[i] >= 1. ||
+        hypot(pt[0]+t[i]*dx-x, pt[1]+t[i]*dy-y) > radius) t[i] = -1.;
+    else k++;
+  }
+  if (k == 0) { g_free(t); return; }
+
+  path = gnome_canvas_points_new(n+k);
+  widths = item->brush.variable_width ? g_new(gdouble, n+k) : NULL;
+  for (i=0, j=0, pt=item->path->coords; i<n; i++, j++, pt+=2) {
+    path->coords[2*j] = pt[0];
+    path->coords[2*j+1] = pt[1];
+    if (widths != NULL) widths[j] = item->widths[i];
+    if (i == n-1 || t[i] < 0.) continue;
+    j++;
+    path->coords[2*j] = pt[0] + t[i]*(pt[2]-pt[0]);
+    path->coords[2*j+1] = pt[1] + t[i]*(pt[3]-pt[1]);
+    if (widths != NULL) widths[j] = item->widths[i] + t[i]*(item->widths[i+1]-item->widths[i]);
+  }
+  g_free(t);
+  gnome_canvas_points_free(item->path);
+  item->path = path;
+  if (widths != NULL) { g_free(item->widths); item->widths = widths; }
+}
+
 void erase_stroke_portions(struct Item *item, double x, double y, double radius,
                    gboolean whole_strokes, struct UndoErasureData *erasure)
 {
@@ -377,9 +584,9 @@ void erase_stroke_portions(struct Item *item, double x, double y, double radius,
   struct Item *newhead, *newtail;
   gboolean need_recalc = FALSE;
 
+  split_stroke_segments(item, x, y, radius);
   for (i=0, pt=item->path->coords; i<item->path->num_points; i++, pt+=2) {
     if (hypot(pt[0]-x, pt[1]-y) <= radius) { // found an intersection
-      // FIXME: need to test if line SEGMENT hits the circle
       // hide the canvas item, and create erasure data if needed
       if (erasure == NULL) {
         item->type = ITEM_TEMP_STROKE;
@@ -539,23 +746,38 @@ gboolean do_hand_scrollto(gpointer data)
 }
 
 
+/* kinetic scrolling: one step per display frame. The step follows the
+   time actually elapsed, so that a late frame doesn't slow the flick down,
+   and the newly exposed strip is painted right away; the rest of the
+   window is moved by the scroll, not redrawn. */
+
+static guint scroll_timeout_id = 0;
+static GTimer *scroll_timer = NULL;
+
 gboolean do_continue_scrolling(gpointer data)
 {
   int cx, cy, ncx, ncy;
-  double speed, factor;
+  double speed, factor, dt;
   
+  dt = 1000*g_timer_elapsed(scroll_timer, NULL);
+  g_timer_start(scroll_timer);
+  dt = CLAMP(dt, 1., SCROLL_MAX_FRAMETIME);
   gnome_canvas_get_scroll_offsets(canvas, &cx, &cy);
-  gnome_canvas_scroll_to(canvas, cx + ui.hand_speed_x * SCROLL_FRAMETIME, cy + ui.hand_speed_y * SCROLL_FRAMETIME);
+  gnome_canvas_scroll_to(canvas, cx + ui.hand_speed_x * dt, cy + ui.hand_speed_y * dt);
   gnome_canvas_get_scroll_offsets(canvas, &ncx, &ncy);
+  gdk_window_process_updates(GTK_LAYOUT(canvas)->bin_window, TRUE);
   
   /* Hit a border? */
   if (ncx == cx) ui.hand_speed_x = 0;
   if (ncy == cy) ui.hand_speed_y = 0;
     
   speed = sqrt(ui.hand_speed_x * ui.hand_speed_x + ui.hand_speed_y * ui.hand_speed_y);
-  if (speed < SCROLL_SLOWDOWN)
+  factor = SCROLL_SLOWDOWN * dt / SCROLL_FRAMETIME;
+  if (speed < factor) {
+    scroll_timeout_id = 0;
     return FALSE;
-  factor = (speed - SCROLL_SLOWDOWN) / speed;
+  }
+  factor = (speed - factor) / speed;
   ui.hand_speed_x *= factor;
   ui.hand_speed_y *= factor;
     
@@ -609,7 +831,12 @@ void do_hand(GdkEvent *event)
 }
 
 void finalize_hand(void) {
-  g_timeout_add(SCROLL_FRAMETIME, do_continue_scrolling, NULL);
+  if (scroll_timeout_id != 0) return; // already coasting: the new speed is picked up
+  if (scroll_timer == NULL) scroll_timer = g_timer_new();
+  g_timer_start(scroll_timer);
+  // just ahead of the canvas redraw, so each step is painted in the same frame
+  scroll_timeout_id = g_timeout_add_full(GDK_PRIORITY_REDRAW - 1, SCROLL_FRAMETIME,
+                                         do_continue_scrolling, NULL, NULL);
 }
 
 void stop_scrolling(void) {
@@ -22,6 +22,7 @@ void create_new_stroke(GdkEvent *event);
 void continue_stroke(GdkEvent *event);
 void finalize_stroke(void);
 void abort_stroke(void);
+void update_stroke_prediction(void);
 void subdivide_cur_path(void);
 
 void do_eraser(GdkEvent *event, double radius, gboolean whole_strokes);
@@ -21,11 +21,15 @@
 
 #include <gtk/gtk.h>
 #include <glib/gstdio.h>
+#include <sys/stat.h>
 #include <libgnomecanvas/libgnomecanvas.h>
 #include <zlib.h>
 #include <string.h>
 #include <math.h>
 #include <locale.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
 #include <pango/pango.h>
 #include <pango/pangofc-font.h>
 #include <pango/pangoft2.h>
@@ -44,6 +48,7 @@
 #include "xo-paint.h"
 #include "xo-print.h"
 #include "xo-file.h"
+#include "xo-stroke.h"
 
 #define RGBA_RED(rgba) (((rgba>>24)&0xff)/255.0)
 #define RGBA_GREEN(rgba) (((rgba>>16)&0xff)/255.0)
@@ -463,6 +468,9 @@ int pdf_getpageinfo(GString *pdfbuf, struct XrefTable *xref,
       for (i=0; i<obj->num; i++) {
         kid = get_pdfobj(pdfbuf, xref, obj->elts[i]);
         if (kid!=NULL) {
+          // if kid is a page (and not a subtree, which overwrites this)
+          if (obj->elts[i]->type == PDFTYPE_REF && nmax>0)
+            pages->n_obj = obj->elts[i]->intval;
           j = pdf_getpageinfo(pdfbuf, xref, kid, nmax, pages);
           nmax -= j;
           pages += j;
@@ -495,6 +503,7 @@ gboolean pdf_parse_info(GString *pdfbuf, struct PdfInfo *pdfinfo, struct XrefTab
   offs = strtol(p, NULL, 10);
   if (offs <= 0 || offs > pdfbuf->len) return FALSE; // fail
   pdfinfo->startxref = offs;
+  pdfinfo->src = pdfbuf;
   
   pdfinfo->trailerdict = parse_xref_table(pdfbuf, xref, offs);
   if (pdfinfo->trailerdict == NULL) return FALSE; // fail
@@ -533,6 +542,29 @@ void make_xref(struct XrefTable *xref, int nobj, int offset)
   xref->data[nobj] = offset;
 }
 
+/* print_to_pdf() writes its output as it goes: pdfbuf only holds what
+   hasn't been written to pdf_file yet, and pdf_written counts what has.
+   Offsets into the output are taken with pdf_offset(). */
+
+static FILE *pdf_file = NULL;
+static long pdf_written = 0;
+static gboolean pdf_write_failed;
+
+int pdf_offset(GString *pdfbuf)
+{
+  return (int)(pdf_written + pdfbuf->len);
+}
+
+void pdf_flush(GString *pdfbuf, gboolean always)
+{
+  if (pdf_file == NULL) return;
+  if (!always && pdfbuf->len < PDF_FLUSH_SIZE) return;
+  if (fwrite(pdfbuf->str, 1, pdfbuf->len, pdf_file) < pdfbuf->len)
+    pdf_write_failed = TRUE;
+  pdf_written += pdfbuf->len;
+  g_string_truncate(pdfbuf, 0);
+}
+
 // a wrapper for deflate
 
 GString *do_deflate(char *in, int len)
@@ -594,6 +626,65 @@ GString *make_pdfprefix(struct PdfPageDesc *pgdesc, double width, double height)
   return str;
 }
 
+/* the inverse of the transformation in make_pdfprefix(): it takes the
+   page as xournal sees it back to the coordinates of the original page,
+   for drawing on the original page object (in an incremental update) */
+
+static void pdf_concat_matrix(double *m, double a, double b, double c, double d,
+                              double e, double f)
+{
+  double n[6];
+
+  // m becomes (a b c d e f) followed by m, as with the "cm" operator
+  n[0] = a*m[0] + b*m[2];  n[1] = a*m[1] + b*m[3];
+  n[2] = c*m[0] + d*m[2];  n[3] = c*m[1] + d*m[3];
+  n[4] = e*m[0] + f*m[2] + m[4];  n[5] = e*m[1] + f*m[3] + m[5];
+  memcpy(m, n, 6*sizeof(double));
+}
+
+GString *make_pdfinverse(struct PdfPageDesc *pgdesc, double width, double height)
+{
+  GString *str;
+  double m[6] = {1, 0, 0, 1, 0, 0};
+  double v[4], t, det;
+  int i;
+
+  if (pgdesc->rotate == 90) {
+    pdf_concat_matrix(m, 0, -1, 1, 0, 0, height);
+    t = height; height = width; width = t;
+  }
+  if (pgdesc->rotate == 270) {
+    pdf_concat_matrix(m, 0, 1, -1, 0, width, 0);
+    t = height; height = width; width = t;
+  }
+  if (pgdesc->rotate == 180)
+    pdf_concat_matrix(m, -1, 0, 0, -1, width, height);
+  if (pgdesc->mediabox!=NULL && pgdesc->mediabox->type == PDFTYPE_ARRAY &&
+      pgdesc->mediabox->num == 4) {
+    for (i=0; i<4; i++) {
+      if (pgdesc->mediabox->elts[i]->type == PDFTYPE_INT)
+        v[i] = pgdesc->mediabox->elts[i]->intval;
+      else if (pgdesc->mediabox->elts[i]->type == PDFTYPE_REAL)
+        v[i] = pgdesc->mediabox->elts[i]->realval;
+      else break;
+    }
+    if (i==4) {
+      if (v[0]>v[2]) { t = v[0]; v[0] = v[2]; v[2] = t; }
+      if (v[1]>v[3]) { t = v[1]; v[1] = v[3]; v[3] = t; }
+      if (v[2]-v[0] >= 1. && v[3]-v[1] >= 1.)
+        pdf_concat_matrix(m, width/(v[2]-v[0]), 0, 0, height/(v[3]-v[1]),
+                          -v[0]*width/(v[2]-v[0]), -v[1]*height/(v[3]-v[1]));
+    }
+  }
+
+  det = m[0]*m[3] - m[1]*m[2];
+  str = g_string_new("");
+  g_string_printf(str, "%.6f %.6f %.6f %.6f %.4f %.4f cm ",
+    m[3]/det, -m[1]/det, -m[2]/det, m[0]/det,
+    (m[2]*m[5]-m[3]*m[4])/det, (m[1]*m[4]-m[0]*m[5])/det);
+  return str;
+}
+
 // add an entry to a subentry of a directory
 
 struct PdfObj *mk_pdfname(char *name)
@@ -617,6 +708,32 @@ struct PdfObj *mk_pdfref(int num)
   return obj;
 }
 
+void add_array_entry(struct PdfObj *array, struct PdfObj *entry)
+{
+  array->num++;
+  array->elts = g_realloc(array->elts, array->num*sizeof(struct PdfObj*));
+  array->elts[array->num-1] = entry;
+}
+
+// replace or add an entry of a dictionary (which takes entry over)
+
+void set_dict_entry(struct PdfObj *dict, char *name, struct PdfObj *entry)
+{
+  int i;
+
+  for (i=0; i<dict->num; i++)
+    if (!strcmp(dict->names[i], name)) {
+      free_pdfobj(dict->elts[i]);
+      dict->elts[i] = entry;
+      return;
+    }
+  dict->num++;
+  dict->elts = g_realloc(dict->elts, dict->num*sizeof(struct PdfObj*));
+  dict->names = g_realloc(dict->names, dict->num*sizeof(char *));
+  dict->names[dict->num-1] = g_strdup(name);
+  dict->elts[dict->num-1] = entry;
+}
+
 gboolean iseq_obj(struct PdfObj *a, struct PdfObj *b)
 {
   if (a==NULL || b==NULL) return (a==b);
@@ -726,6 +843,219 @@ void pdf_draw_solid_background(struct Page *pg, GString *str)
       RULING_LEFTMARGIN, RULING_LEFTMARGIN, pg->height);
 }
 
+// a hash of the pixels of a pixbuf (not of the padding of its rows)
+
+guint pixbuf_content_hash(GdkPixbuf *pixbuf)
+{
+  guchar *p, *end;
+  guint hash;
+  int y, height, rowlen;
+
+  height = gdk_pixbuf_get_height(pixbuf);
+  rowlen = gdk_pixbuf_get_width(pixbuf)*gdk_pixbuf_get_n_channels(pixbuf);
+  hash = 2166136261u ^ (guint)(rowlen*31 + height);
+  for (y=0; y<height; y++) {
+    p = gdk_pixbuf_get_pixels(pixbuf) + y*gdk_pixbuf_get_rowstride(pixbuf);
+    for (end = p+rowlen; p<end; p++)
+      hash = (hash ^ *p) * 16777619u; // FNV-1a
+  }
+  return hash;
+}
+
+gboolean pixbuf_same_content(GdkPixbuf *a, GdkPixbuf *b)
+{
+  int y, height, rowlen;
+
+  if (gdk_pixbuf_get_width(a) != gdk_pixbuf_get_width(b) ||
+      gdk_pixbuf_get_height(a) != gdk_pixbuf_get_height(b) ||
+      gdk_pixbuf_get_n_channels(a) != gdk_pixbuf_get_n_channels(b) ||
+      gdk_pixbuf_get_has_alpha(a) != gdk_pixbuf_get_has_alpha(b))
+    return FALSE;
+  height = gdk_pixbuf_get_height(a);
+  rowlen = gdk_pixbuf_get_width(a)*gdk_pixbuf_get_n_channels(a);
+  for (y=0; y<height; y++)
+    if (memcmp(gdk_pixbuf_get_pixels(a) + y*gdk_pixbuf_get_rowstride(a),
+               gdk_pixbuf_get_pixels(b) + y*gdk_pixbuf_get_rowstride(b), rowlen))
+      return FALSE;
+  return TRUE;
+}
+
+/* an image of the list that is this pixbuf, or has the same pixels.
+   If there is none, *hash is the hash of the pixbuf. */
+
+struct PdfImage *find_pdfimage(GList *images, GdkPixbuf *pixbuf, guint *hash)
+{
+  GList *list;
+  struct PdfImage *image;
+
+  for (list = images; list!=NULL; list = list->next)
+    if (((struct PdfImage *)list->data)->pixbuf == pixbuf) return list->data;
+  *hash = pixbuf_content_hash(pixbuf);
+  for (list = images; list!=NULL; list = list->next) {
+    image = (struct PdfImage *)list->data;
+    if (image->hash == *hash && pixbuf_same_content(image->pixbuf, pixbuf)) return image;
+  }
+  return NULL;
+}
+
+/* images embedded as they were encoded, rather than by deflating their
+   pixels again: JPEG data as a DCTDecode stream, and PNG data (8-bit gray
+   or RGB, not interlaced, without transparency) as its zlib stream with
+   the PNG predictors. Anything else is left to the pixels. */
+
+#define PNG_U32(p) (((guint32)(p)[0]<<24) | ((guint32)(p)[1]<<16) | \
+                    ((guint32)(p)[2]<<8) | (guint32)(p)[3])
+
+gboolean png_image_size(const guchar *data, gsize len, int *width, int *height)
+{
+  if (len < 33 || memcmp(data, "\211PNG\r\n\032\n", 8) || memcmp(data+12, "IHDR", 4))
+    return FALSE;
+  *width = PNG_U32(data+16);
+  *height = PNG_U32(data+20);
+  return TRUE;
+}
+
+// the image data of a PNG that can be embedded as is, or NULL
+
+GString *png_image_data(const guchar *data, gsize len, int *width, int *height, int *colors)
+{
+  const guchar *p, *end;
+  guint32 chunklen;
+  GString *idat;
+
+  if (!png_image_size(data, len, width, height)) return NULL;
+  if (data[24] != 8 || (data[25] != 0 && data[25] != 2) || data[26] || data[27] || data[28])
+    return NULL; // bit depth, color type, compression, filter, interlace
+  *colors = (data[25] == 2) ? 3 : 1;
+  idat = g_string_new("");
+  p = data+8; end = data+len;
+  while (end-p >= 12) {
+    chunklen = PNG_U32(p);
+    if (chunklen > (gsize)(end-p)-12) break;
+    if (!memcmp(p+4, "tRNS", 4)) break;
+    if (!memcmp(p+4, "IDAT", 4)) g_string_append_len(idat, (const char *)p+8, chunklen);
+    if (!memcmp(p+4, "IEND", 4)) {
+      if (idat->len > 0) return idat;
+      break;
+    }
+    p += chunklen+12;
+  }
+  g_string_free(idat, TRUE);
+  return NULL;
+}
+
+// the size of a JPEG that can be embedded as is (8-bit gray or YCbCr, Huffman coded)
+
+gboolean jpeg_image_size(const guchar *data, gsize len, int *width, int *height, int *colors)
+{
+  gsize i, seglen;
+  guchar marker;
+
+  if (len < 4 || data[0] != 0xff || data[1] != 0xd8) return FALSE;
+  i = 2;
+  while (i+4 <= len) {
+    if (data[i] != 0xff) return FALSE;
+    marker = data[i+1];
+    if (marker == 0xff) { i++; continue; } // fill byte
+    if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd8)) { i+=2; continue; }
+    if (marker == 0xd9 || marker == 0xda) return FALSE; // no frame header
+    seglen = (data[i+2]<<8) | data[i+3];
+    if (seglen < 2 || i+2+seglen > len) return FALSE;
+    if (marker >= 0xc0 && marker <= 0xc2) {
+      if (seglen < 8 || data[i+4] != 8) return FALSE;
+      *height = (data[i+5]<<8) | data[i+6];
+      *width = (data[i+7]<<8) | data[i+8];
+      *colors = data[i+9];
+      return (*colors == 1 || *colors == 3);
+    }
+    if (marker >= 0xc3 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+      return FALSE; // lossless or arithmetic coding
+    i += 2+seglen;
+  }
+  return FALSE;
+}
+
+/* write the data as the image object n_obj, if it can be embedded as is
+   and has the size of the pixbuf it was loaded into */
+
+gboolean pdf_draw_encoded_image(const char *data, gsize len, int width, int height,
+                                int n_obj, struct XrefTable *xref, GString *pdfbuf)
+{
+  GString *idat;
+  int w, h, colors;
+
+  if (data == NULL) return FALSE;
+  if (jpeg_image_size((const guchar *)data, len, &w, &h, &colors)) {
+    if (w != width || h != height) return FALSE;
+    xref->data[n_obj] = pdf_offset(pdfbuf);
+    g_string_append_printf(pdfbuf,
+      "%d 0 obj\n<< /Length %zu /Filter /DCTDecode /Type /XObject "
+      "/Subtype /Image /Width %d /Height %d /ColorSpace /%s "
+      "/BitsPerComponent 8 >> stream\n",
+      n_obj, len, w, h, (colors == 3) ? "DeviceRGB" : "DeviceGray");
+    g_string_append_len(pdfbuf, data, len);
+  }
+  else {
+    idat = png_image_data((const guchar *)data, len, &w, &h, &colors);
+    if (idat == NULL) return FALSE;
+    if (w != width || h != height) { g_string_free(idat, TRUE); return FALSE; }
+    xref->data[n_obj] = pdf_offset(pdfbuf);
+    g_string_append_printf(pdfbuf,
+      "%d 0 obj\n<< /Length %zu /Filter /FlateDecode /DecodeParms << /Predictor 15 "
+      "/Colors %d /BitsPerComponent 8 /Columns %d >> /Type /XObject "
+      "/Subtype /Image /Width %d /Height %d /ColorSpace /%s "
+      "/BitsPerComponent 8 >> stream\n",
+      n_obj, idat->len, colors, w, w, h, (colors == 3) ? "DeviceRGB" : "DeviceGray");
+    g_string_append_len(pdfbuf, idat->str, idat->len);
+    g_string_free(idat, TRUE);
+  }
+  g_string_append(pdfbuf, "endstream\nendobj\n");
+  return TRUE;
+}
+
+/* the file a bitmap background was loaded from, if it can still be read
+   and hasn't changed since (else the pixbuf is all we can trust) */
+
+gboolean read_bg_source(struct Background *bg, gchar **data, gsize *len)
+{
+  gchar *filename;
+  struct stat st;
+  gboolean ok;
+
+  if (bg->type != BG_PIXMAP || bg->filename == NULL || bg->filename->s == NULL)
+    return FALSE;
+  if (bg->file_domain == DOMAIN_ABSOLUTE) filename = g_strdup(bg->filename->s);
+  else if (bg->file_domain == DOMAIN_ATTACH && ui.filename != NULL)
+    filename = g_strdup_printf("%s.%s", ui.filename, bg->filename->s);
+  else return FALSE;
+  ok = bg->file_size >= 0 && g_stat(filename, &st) == 0 &&
+       st.st_size == bg->file_size && st.st_mtime == bg->file_mtime &&
+       g_file_get_contents(filename, data, len, NULL);
+  g_free(filename);
+  if (ok && (gint64)*len != bg->file_size) { // changed while we looked
+    g_free(*data);
+    ok = FALSE;
+  }
+  return ok;
+}
+
+/* the bitmap backgrounds already written in this export, so that pages
+   with the same bitmap share its object */
+
+static GList *pdf_backgrounds = NULL;
+
+void pdf_free_backgrounds(void)
+{
+  GList *list;
+
+  for (list = pdf_backgrounds; list!=NULL; list = list->next)
+    g_free(list->data);
+  g_list_free(pdf_backgrounds);
+  pdf_backgrounds = NULL;
+}
+
+// returns the object of the bitmap; pdfbuf gets it, unless it was written already
+
 int pdf_draw_bitmap_background(struct Page *pg, GString *str, 
                                 struct XrefTable *xref, GString *pdfbuf)
 {
@@ -733,9 +1063,14 @@ int pdf_draw_bitmap_background(struct Page *pg, GString *str,
   GdkPixbuf *pix;
   GString *zpix;
   PopplerPage *pdfpage;
+  struct PdfImage *bgimage;
   char *buf, *p1, *p2;
-  int height, width, stride, x, y, chan;
+  gchar *data;
+  gsize len;
+  gboolean done;
+  int height, width, stride, x, y, chan, n_obj;
   double pgheight, pgwidth;
+  guint hash;
   
   if (pg->bg->type == BG_PDF) {
     if (!bgpdf.document) return -1;
@@ -763,30 +1098,50 @@ int pdf_draw_bitmap_background(struct Page *pg, GString *str,
 
   g_string_append_printf(str, "q %.2f 0 0 %.2f 0 %.2f cm /ImBg Do Q ",
     pg->width, -pg->height, pg->height);
+  if (pg->bg->type == BG_PIXMAP) {
+    bgimage = find_pdfimage(pdf_backgrounds, pix, &hash);
+    if (bgimage != NULL) { g_object_unref(pix); return bgimage->n_obj; }
+  }
+  make_xref(xref, xref->last+1, 0); // will give it a value later
+  n_obj = xref->last;
+  if (read_bg_source(pg->bg, &data, &len)) {
+    done = pdf_draw_encoded_image(data, len, width, height, n_obj, xref, pdfbuf);
+    g_free(data);
+  }
+  else done = FALSE;
   
-  p2 = buf = (char *)g_malloc(3*width*height);
-  for (y=0; y<height; y++) {
-    p1 = (char *)gdk_pixbuf_get_pixels(pix)+stride*y;
-    for (x=0; x<width; x++) {
-      *(p2++)=*(p1++); *(p2++)=*(p1++); *(p2++)=*(p1++);
-      if (chan==4) p1++;
+  if (!done) {
+    p2 = buf = (char *)g_malloc(3*width*height);
+    for (y=0; y<height; y++) {
+      p1 = (char *)gdk_pixbuf_get_pixels(pix)+stride*y;
+      for (x=0; x<width; x++) {
+        *(p2++)=*(p1++); *(p2++)=*(p1++); *(p2++)=*(p1++);
+        if (chan==4) p1++;
+      }
     }
+    zpix = do_deflate(buf, 3*width*height);
+    g_free(buf);
+
+    xref->data[n_obj] = pdf_offset(pdfbuf);
+    g_string_append_printf(pdfbuf, 
+      "%d 0 obj\n<< /Length %zu /Filter /FlateDecode /Type /Xobject "
+      "/Subtype /Image /Width %d /Height %d /ColorSpace /DeviceRGB "
+      "/BitsPerComponent 8 >> stream\n",
+      n_obj, zpix->len, width, height);
+    g_string_append_len(pdfbuf, zpix->str, zpix->len);
+    g_string_free(zpix, TRUE);
+    g_string_append(pdfbuf, "endstream\nendobj\n");
   }
-  zpix = do_deflate(buf, 3*width*height);
-  g_free(buf);
   g_object_unref(pix);
-
-  make_xref(xref, xref->last+1, pdfbuf->len);
-  g_string_append_printf(pdfbuf, 
-    "%d 0 obj\n<< /Length %zu /Filter /FlateDecode /Type /Xobject "
-    "/Subtype /Image /Width %d /Height %d /ColorSpace /DeviceRGB "
-    "/BitsPerComponent 8 >> stream\n",
-    xref->last, zpix->len, width, height);
-  g_string_append_len(pdfbuf, zpix->str, zpix->len);
-  g_string_free(zpix, TRUE);
-  g_string_append(pdfbuf, "endstream\nendobj\n");
  
-  return xref->last;
+  if (pg->bg->type == BG_PIXMAP) {
+    bgimage = g_new0(struct PdfImage, 1);
+    bgimage->n_obj = n_obj;
+    bgimage->pixbuf = pg->bg->pixbuf;
+    bgimage->hash = hash;
+    pdf_backgrounds = g_list_append(pdf_backgrounds, bgimage);
+  }
+  return n_obj;
 }
 
 gboolean pdf_draw_image(PdfImage *image, struct XrefTable *xref, GString *pdfbuf)
@@ -807,6 +1162,9 @@ gboolean pdf_draw_image(PdfImage *image, struct XrefTable *xref, GString *pdfbuf
   if (!((chan==3 && !image->has_alpha) || (chan==4 && image->has_alpha))) {
     return FALSE;
   }
+  if (!image->has_alpha && pdf_draw_encoded_image(image->png, image->png_len,
+                                  width, height, image->n_obj, xref, pdfbuf))
+    return TRUE;
 
   p2 = buf = (char *)g_malloc(3*width*height);
   for (y=0; y<height; y++) {
@@ -819,7 +1177,7 @@ gboolean pdf_draw_image(PdfImage *image, struct XrefTable *xref, GString *pdfbuf
   zpix = do_deflate(buf, 3*width*height);
   g_free(buf);
 
-  xref->data[image->n_obj] = pdfbuf->len;
+  xref->data[image->n_obj] = pdf_offset(pdfbuf);
   g_string_append_printf(pdfbuf, 
     "%d 0 obj\n<< /Length %d /Filter /FlateDecode /Type /Xobject "
     "/Subtype /Image /Width %d /Height %d /ColorSpace /DeviceRGB "
@@ -848,7 +1206,7 @@ gboolean pdf_draw_image(PdfImage *image, struct XrefTable *xref, GString *pdfbuf
     zpix = do_deflate(buf, width*height);
     g_free(buf);
     
-    xref->data[image->n_obj_smask] = pdfbuf->len;
+    xref->data[image->n_obj_smask] = pdf_offset(pdfbuf);
     g_string_append_printf(pdfbuf, 
       "%d 0 obj\n<< /Length %d /Filter /FlateDecode /Type /Xobject "
       "/Subtype /Image /Width %d /Height %d /ColorSpace /DeviceGray "
@@ -926,19 +1284,193 @@ struct PdfFont *new_pdffont(struct XrefTable *xref, GList **fonts,
 #define T1_SEGMENT_1_END "currentfile eexec"
 #define T1_SEGMENT_3_END "cleartomark"
 
-void embed_pdffont(GString *pdfbuf, struct XrefTable *xref, struct PdfFont *font)
+// the font program of a Type 1 font file, as segments 1 and 2 (or NULL)
+
+GString *read_type1_program(char *filename, guint32 *plen1, guint32 *plen2)
 {
-  // this code inspired by libgnomeprint
   gboolean fallback, is_binary;
-  guchar encoding[256];
-  gushort glyphs[256];
-  int i, j, num;
   guint32 len1, len2;
-  guint32 tt_len;
   gsize t1_len;
-  TrueTypeFont *ttfnt;
   char *seg1, *seg2;
   char *fontdata, *p;
+  GString *program;
+  int i, j;
+
+  fallback = FALSE;
+  program = NULL;
+  if (g_file_get_contents(filename, &fontdata, &t1_len, NULL) && t1_len>=8) {
+    if (fontdata[0]==(char)0x80 && fontdata[1]==(char)0x01) {
+      is_binary = TRUE;
+      len1 = pfb_get_length((unsigned char *)fontdata+2);
+      if (fontdata[len1+6]!=(char)0x80 || fontdata[len1+7]!=(char)0x02) fallback = TRUE;
+      else {
+        len2 = pfb_get_length((unsigned char *)fontdata+len1+8);
+        if (fontdata[len1+len2+12]!=(char)0x80 || fontdata[len1+len2+13]!=(char)0x01)
+          fallback = TRUE;
+      }
+    }
+    else if (!strncmp(fontdata, "%!PS", 4)) {
+      is_binary = FALSE;
+      p = strstr(fontdata, T1_SEGMENT_1_END) + strlen(T1_SEGMENT_1_END);
+      if (p==NULL) fallback = TRUE;
+      else {
+        if (*p=='\n' || *p=='\r') p++;
+        if (*p=='\n' || *p=='\r') p++;
+        len1 = p-fontdata;
+        p = g_strrstr_len(fontdata, t1_len, T1_SEGMENT_3_END);
+        if (p==NULL) fallback = TRUE;
+        else {
+          // rewind 512 zeros
+          i = 512; p--;
+          while (i>0 && p!=fontdata && (*p=='0' || *p=='\r' || *p=='\n')) {
+            if (*p=='0') i--;
+            p--;
+          }
+          while (p!=fontdata && (*p=='\r' || *p=='\n')) p--;
+          p++;
+          if (i>0) fallback = TRUE;
+          else len2 = p-fontdata-len1;
+        }
+      }
+    }
+    else fallback = TRUE;
+    if (!fallback) {
+      if (is_binary) {
+        seg1 = fontdata+6;
+        seg2 = fontdata + len1 + 12;
+      } else {
+        seg1 = fontdata;
+        seg2 = g_malloc(len2/2);
+        j=0;
+        p = fontdata+len1;
+        while (p+1 < fontdata+len1+len2) {
+          if (*p==' '||*p=='\t'||*p=='\n'||*p=='\r') { p++; continue; }
+          if (p[0]>'9') { p[0]|=0x20; p[0]-=39; }
+          if (p[1]>'9') { p[1]|=0x20; p[1]-=39; }
+          seg2[j++] = ((p[0]-'0')<<4) + (p[1]-'0');
+          p+=2;
+        }
+        len2 = j;
+      }
+      program = g_string_new_len(seg1, len1);
+      g_string_append_len(program, seg2, len2);
+      *plen1 = len1;
+      *plen2 = len2;
+      if (!is_binary) g_free(seg2);
+    }
+    g_free(fontdata);
+  }
+  return program;
+}
+
+/* fonts stay loaded from one export to the next: the parsed TrueType
+   files and the subsets made from them, and the programs of Type 1 fonts.
+   The entry of a font file is dropped when the file changes. */
+
+typedef struct CachedFontFile {
+  time_t mtime;
+  off_t size;
+  TrueTypeFont *ttfnt; // once parsed
+  GHashTable *subsets; // the glyphs and their codes -> a TrueType subset
+  GString *t1_program; // once read
+  guint32 t1_len1, t1_len2;
+} CachedFontFile;
+
+#define FONT_SUBSET_CACHE_SIZE 64 // per font file
+
+static GHashTable *font_files = NULL; // file name -> CachedFontFile
+
+static void free_cached_font_file(gpointer data)
+{
+  CachedFontFile *cf = (CachedFontFile *)data;
+
+  if (cf->ttfnt != NULL) CloseTTFont(cf->ttfnt);
+  g_hash_table_destroy(cf->subsets);
+  if (cf->t1_program != NULL) g_string_free(cf->t1_program, TRUE);
+  g_free(cf);
+}
+
+static void free_font_subset(gpointer data)
+{
+  g_string_free((GString *)data, TRUE);
+}
+
+CachedFontFile *get_cached_font_file(char *filename)
+{
+  CachedFontFile *cf;
+  struct stat st;
+
+  if (g_stat(filename, &st) != 0) return NULL;
+  if (font_files == NULL)
+    font_files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_cached_font_file);
+  cf = (CachedFontFile *)g_hash_table_lookup(font_files, filename);
+  if (cf != NULL && cf->mtime == st.st_mtime && cf->size == st.st_size) return cf;
+  cf = g_new0(CachedFontFile, 1);
+  cf->mtime = st.st_mtime;
+  cf->size = st.st_size;
+  cf->subsets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_font_subset);
+  g_hash_table_replace(font_files, g_strdup(filename), cf);
+  return cf;
+}
+
+// a subset of a TrueType font with the given glyphs and their codes (or NULL)
+
+GString *cached_truetype_subset(char *filename, gushort *glyphs, guchar *encoding, int num)
+{
+  CachedFontFile *cf;
+  GString *key, *subset;
+  guint8 *fontdata;
+  guint32 tt_len;
+  int i;
+
+  cf = get_cached_font_file(filename);
+  if (cf == NULL) return NULL;
+  key = g_string_new("");
+  for (i=0; i<num; i++)
+    g_string_append_printf(key, "%x:%x ", glyphs[i], encoding[i]);
+  subset = (GString *)g_hash_table_lookup(cf->subsets, key->str);
+  if (subset != NULL) { g_string_free(key, TRUE); return subset; }
+
+  if (cf->ttfnt == NULL && OpenTTFont(filename, 0, &cf->ttfnt) != SF_OK) {
+    cf->ttfnt = NULL;
+    g_string_free(key, TRUE);
+    return NULL;
+  }
+  if (CreateTTFromTTGlyphs_tomemory(cf->ttfnt, &fontdata, &tt_len, glyphs, encoding, num, 
+                   0, NULL, TTCF_AutoName | TTCF_IncludeOS2) != SF_OK) {
+    g_string_free(key, TRUE);
+    return NULL;
+  }
+  subset = g_string_new_len((char *)fontdata, tt_len);
+  g_free(fontdata);
+  if (g_hash_table_size(cf->subsets) >= FONT_SUBSET_CACHE_SIZE)
+    g_hash_table_remove_all(cf->subsets);
+  g_hash_table_insert(cf->subsets, g_string_free(key, FALSE), subset);
+  return subset;
+}
+
+GString *cached_type1_program(char *filename, guint32 *len1, guint32 *len2)
+{
+  CachedFontFile *cf;
+
+  cf = get_cached_font_file(filename);
+  if (cf == NULL) return NULL;
+  if (cf->t1_program == NULL)
+    cf->t1_program = read_type1_program(filename, &cf->t1_len1, &cf->t1_len2);
+  *len1 = cf->t1_len1;
+  *len2 = cf->t1_len2;
+  return cf->t1_program;
+}
+
+void embed_pdffont(GString *pdfbuf, struct XrefTable *xref, struct PdfFont *font)
+{
+  // this code inspired by libgnomeprint
+  gboolean fallback;
+  guchar encoding[256];
+  gushort glyphs[256];
+  int i, num;
+  guint32 len1, len2;
+  GString *fontprog;
   char prefix[8];
   int nobj_fontprog, nobj_descr, lastchar;
   
@@ -955,96 +1487,35 @@ void embed_pdffont(GString *pdfbuf, struct XrefTable *xref, struct PdfFont *font
         num++;
       }
     font->num_glyphs_used = num-1;
-    if (OpenTTFont(font->filename, 0, &ttfnt) == SF_OK) {
-      if (CreateTTFromTTGlyphs_tomemory(ttfnt, (guint8**)&fontdata, &tt_len, glyphs, encoding, num, 
-                   0, NULL, TTCF_AutoName | TTCF_IncludeOS2) == SF_OK) {
-        make_xref(xref, xref->last+1, pdfbuf->len);
-        nobj_fontprog = xref->last;
-        g_string_append_printf(pdfbuf, 
-          "%d 0 obj\n<< /Length %u /Length1 %u >> stream\n",
-          nobj_fontprog, tt_len, tt_len);
-        g_string_append_len(pdfbuf, fontdata, tt_len);
-        g_string_append(pdfbuf, "endstream\nendobj\n");
-        g_free(fontdata);
-      }
-      else fallback = TRUE;
-      CloseTTFont(ttfnt);
-    } 
+    fontprog = cached_truetype_subset(font->filename, glyphs, encoding, num);
+    if (fontprog != NULL) {
+      make_xref(xref, xref->last+1, pdf_offset(pdfbuf));
+      nobj_fontprog = xref->last;
+      g_string_append_printf(pdfbuf, 
+        "%d 0 obj\n<< /Length %u /Length1 %u >> stream\n",
+        nobj_fontprog, (guint32)fontprog->len, (guint32)fontprog->len);
+      g_string_append_len(pdfbuf, fontprog->str, fontprog->len);
+      g_string_append(pdfbuf, "endstream\nendobj\n");
+    }
     else fallback = TRUE;
   } else {
   // embed the font file: Type1 case
-    if (g_file_get_contents(font->filename, &fontdata, &t1_len, NULL) && t1_len>=8) {
-      if (fontdata[0]==(char)0x80 && fontdata[1]==(char)0x01) {
-        is_binary = TRUE;
-        len1 = pfb_get_length((unsigned char *)fontdata+2);
-        if (fontdata[len1+6]!=(char)0x80 || fontdata[len1+7]!=(char)0x02) fallback = TRUE;
-        else {
-          len2 = pfb_get_length((unsigned char *)fontdata+len1+8);
-          if (fontdata[len1+len2+12]!=(char)0x80 || fontdata[len1+len2+13]!=(char)0x01)
-            fallback = TRUE;
-        }
-      }
-      else if (!strncmp(fontdata, "%!PS", 4)) {
-        is_binary = FALSE;
-        p = strstr(fontdata, T1_SEGMENT_1_END) + strlen(T1_SEGMENT_1_END);
-        if (p==NULL) fallback = TRUE;
-        else {
-          if (*p=='\n' || *p=='\r') p++;
-          if (*p=='\n' || *p=='\r') p++;
-          len1 = p-fontdata;
-          p = g_strrstr_len(fontdata, t1_len, T1_SEGMENT_3_END);
-          if (p==NULL) fallback = TRUE;
-          else {
-            // rewind 512 zeros
-            i = 512; p--;
-            while (i>0 && p!=fontdata && (*p=='0' || *p=='\r' || *p=='\n')) {
-              if (*p=='0') i--;
-              p--;
-            }
-            while (p!=fontdata && (*p=='\r' || *p=='\n')) p--;
-            p++;
-            if (i>0) fallback = TRUE;
-            else len2 = p-fontdata-len1;
-          }
-        }
-      }
-      else fallback = TRUE;
-      if (!fallback) {
-        if (is_binary) {
-          seg1 = fontdata+6;
-          seg2 = fontdata + len1 + 12;
-        } else {
-          seg1 = fontdata;
-          seg2 = g_malloc(len2/2);
-          j=0;
-          p = fontdata+len1;
-          while (p+1 < fontdata+len1+len2) {
-            if (*p==' '||*p=='\t'||*p=='\n'||*p=='\r') { p++; continue; }
-            if (p[0]>'9') { p[0]|=0x20; p[0]-=39; }
-            if (p[1]>'9') { p[1]|=0x20; p[1]-=39; }
-            seg2[j++] = ((p[0]-'0')<<4) + (p[1]-'0');
-            p+=2;
-          }
-          len2 = j;
-        }
-        make_xref(xref, xref->last+1, pdfbuf->len);
-        nobj_fontprog = xref->last;
-        g_string_append_printf(pdfbuf, 
-          "%d 0 obj\n<< /Length %u /Length1 %u /Length2 %u /Length3 0 >> stream\n",
-          nobj_fontprog, len1+len2, len1, len2);
-        g_string_append_len(pdfbuf, seg1, len1);
-        g_string_append_len(pdfbuf, seg2, len2);
-        g_string_append(pdfbuf, "endstream\nendobj\n");
-        if (!is_binary) g_free(seg2);
-      }
-      g_free(fontdata);
+    fontprog = cached_type1_program(font->filename, &len1, &len2);
+    if (fontprog != NULL) {
+      make_xref(xref, xref->last+1, pdf_offset(pdfbuf));
+      nobj_fontprog = xref->last;
+      g_string_append_printf(pdfbuf, 
+        "%d 0 obj\n<< /Length %u /Length1 %u /Length2 %u /Length3 0 >> stream\n",
+        nobj_fontprog, len1+len2, len1, len2);
+      g_string_append_len(pdfbuf, fontprog->str, fontprog->len);
+      g_string_append(pdfbuf, "endstream\nendobj\n");
     }
     else fallback = TRUE;
   }
   
   // next, the font descriptor
   if (!fallback) {
-    make_xref(xref, xref->last+1, pdfbuf->len);
+    make_xref(xref, xref->last+1, pdf_offset(pdfbuf));
     nobj_descr = xref->last;
     g_string_append_printf(pdfbuf,
       "%d 0 obj\n<< /Type /FontDescriptor /FontName /%s /Flags %d "
@@ -1062,7 +1533,7 @@ void embed_pdffont(GString *pdfbuf, struct XrefTable *xref, struct PdfFont *font
      in TrueType case, encoding lists the used charcodes by index,
                        glyphs   list the used glyph no's by index
                        font->glyphmap maps charcodes to indices        */
-  xref->data[font->n_obj] = pdfbuf->len;
+  xref->data[font->n_obj] = pdf_offset(pdfbuf);
   if (font->is_truetype) lastchar = encoding[font->num_glyphs_used];
   else lastchar = font->num_glyphs_used;
   if (fallback) {
@@ -1102,12 +1573,18 @@ void embed_pdffont(GString *pdfbuf, struct XrefTable *xref, struct PdfFont *font
 
 // Pdf images
 
-struct PdfImage *new_pdfimage(struct XrefTable *xref, GList **images, GdkPixbuf *pixbuf)
+// images are written once, however many times they appear
+
+struct PdfImage *new_pdfimage(struct XrefTable *xref, GList **images, GdkPixbuf *pixbuf,
+                              gchar *png, gsize png_len)
 {
-  GList *list;
   struct PdfImage *image;
+  guint hash;
   
+  image = find_pdfimage(*images, pixbuf, &hash);
+  if (image != NULL) return image;
   image = g_malloc(sizeof(struct PdfImage));
+  image->hash = hash;
   *images = g_list_append(*images, image);
   image->n_obj = xref->last+1;
   make_xref(xref, xref->last+1, 0); // will give it a value later
@@ -1117,102 +1594,318 @@ struct PdfImage *new_pdfimage(struct XrefTable *xref, GList **images, GdkPixbuf
     make_xref(xref, xref->last+1, 0); // will give it a value later
   }
   image->pixbuf = pixbuf;
+  image->png = png;
+  image->png_len = png_len;
 
   return image;
 }
 
-// draw a page's graphics
+// the cache of text layouts
 
-void pdf_draw_page(struct Page *pg, GString *str, gboolean *use_hiliter, 
-                   struct XrefTable *xref, GList **pdffonts, GList **pdfimages, GList *end_layer)
+void layout_cache_init(LayoutCache *cache, PangoContext *context)
+{
+  cache->context = g_object_ref(context);
+  cache->layouts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_object_unref);
+}
+
+PangoLayout *layout_cache_get(LayoutCache *cache, struct Item *item)
 {
-  GList *layerlist, *itemlist, *tmplist;
-  struct Layer *l;
-  struct Item *item;
-  guint old_rgba, old_text_rgba;
-  double old_thickness;
-  double *pt;
-  int i, j;
   PangoFontDescription *font_desc;
-  PangoContext *context;
   PangoLayout *layout;
-  PangoLayoutIter *iter;
-  PangoRectangle logical_rect;
-  PangoLayoutRun *run;
-  PangoFcFont *fcfont;
-  PangoFontMap *fontmap;
-  FcPattern *pattern;
-  int baseline, advance;
-  int glyph_no, glyph_page, current_page;
-  char *filename;
-  char tmpstr[200];
-  int font_id;
-  FT_Face ftface;
-  struct PdfFont *cur_font;
-  struct PdfImage *cur_image;
-  gboolean in_string;
-  
-  old_rgba = old_text_rgba = 0x12345678;    // not any values we use, so we'll reset them
-  old_thickness = 0.0;
-  for (tmplist = *pdffonts; tmplist!=NULL; tmplist = tmplist->next) {
-    cur_font = (struct PdfFont *)tmplist->data;
-    cur_font->used_in_this_page = FALSE;
-  }
-  for (tmplist = *pdfimages; tmplist!=NULL; tmplist = tmplist->next) {
-    cur_image = (struct PdfImage *)tmplist->data;
-    cur_image->used_in_this_page = FALSE;
-  }
+  char *key;
+
+  key = g_strdup_printf("%s\n%g\n%s", item->font_name, item->font_size, item->text);
+  layout = (PangoLayout *)g_hash_table_lookup(cache->layouts, key);
+  if (layout != NULL) { g_free(key); return layout; }
+  if (g_hash_table_size(cache->layouts) >= LAYOUT_CACHE_SIZE)
+    g_hash_table_remove_all(cache->layouts);
+
+  layout = pango_layout_new(cache->context);
+  font_desc = pango_font_description_from_string(item->font_name);
+  if (item->font_size)
+    pango_font_description_set_absolute_size(font_desc,
+      item->font_size*PANGO_SCALE);
+  pango_layout_set_font_description(layout, font_desc);
+  pango_font_description_free(font_desc);
+  pango_layout_set_text(layout, item->text, -1);
+  g_hash_table_insert(cache->layouts, key, layout);
+  return layout;
+}
 
-  for (layerlist = pg->layers; layerlist!=end_layer; layerlist = layerlist->next) {
-    l = (struct Layer *)layerlist->data;
-    for (itemlist = l->items; itemlist!=NULL; itemlist = itemlist->next) {
+void layout_cache_clear(LayoutCache *cache)
+{
+  if (cache->context == NULL) return;
+  g_hash_table_destroy(cache->layouts);
+  g_object_unref(cache->context);
+  cache->context = NULL;
+  cache->layouts = NULL;
+}
+
+/* the text of an export to PDF is laid out with one font map, and the
+   advances of the glyphs are looked up once per font file */
+
+static LayoutCache pdf_layouts = {NULL, NULL};
+static GHashTable *pdf_advances = NULL; // "file:index" -> (glyph -> advance)
+
+void pdf_text_begin(void)
+{
+  PangoFontMap *fontmap;
+  PangoContext *context;
+
+  fontmap = pango_ft2_font_map_new();
+  pango_ft2_font_map_set_resolution(PANGO_FT2_FONT_MAP (fontmap), 72, 72);
+  context = pango_context_new();
+  pango_context_set_font_map(context, fontmap);
+  layout_cache_init(&pdf_layouts, context);
+  g_object_unref(fontmap);
+  g_object_unref(context);
+  pdf_advances = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                       (GDestroyNotify)g_hash_table_destroy);
+}
+
+void pdf_text_end(void)
+{
+  layout_cache_clear(&pdf_layouts);
+  g_hash_table_destroy(pdf_advances);
+  pdf_advances = NULL;
+}
+
+GHashTable *pdf_face_advances(char *filename, int font_id)
+{
+  GHashTable *advances;
+  char *key;
+
+  key = g_strdup_printf("%s:%d", filename, font_id);
+  advances = (GHashTable *)g_hash_table_lookup(pdf_advances, key);
+  if (advances != NULL) { g_free(key); return advances; }
+  advances = g_hash_table_new(g_direct_hash, g_direct_equal);
+  g_hash_table_insert(pdf_advances, key, advances);
+  return advances;
+}
+
+// the advance of a glyph, in font units
+
+int pdf_glyph_advance(GHashTable *advances, FT_Face ftface, int glyph_no)
+{
+  gpointer value;
+
+  if (g_hash_table_lookup_extended(advances, GINT_TO_POINTER(glyph_no), NULL, &value))
+    return GPOINTER_TO_INT(value);
+  FT_Load_Glyph(ftface, glyph_no, FT_LOAD_NO_SCALE | FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP | FT_LOAD_IGNORE_TRANSFORM);
+  g_hash_table_insert(advances, GINT_TO_POINTER(glyph_no),
+                      GINT_TO_POINTER((int)ftface->glyph->metrics.horiAdvance));
+  return (int)ftface->glyph->metrics.horiAdvance;
+}
+
+/* content streams are mostly numbers: they are written rounded to 2
+   decimals like %.2f, but without a leading 0 or trailing zeros, and
+   without printf.
+   pdf_optimize_streams can be turned off to compare (--benchmark-pdf). */
+
+static gboolean pdf_optimize_streams = TRUE;
+
+void pdf_append_num(GString *str, double x)
+{
+  char buf[32], *p;
+  gint64 n;
+  int frac;
+
+  if (!pdf_optimize_streams) { g_string_append_printf(str, "%.2f ", x); return; }
+  if (!(fabs(x) < 1e15)) x = 0.; // not a number we can write
+  n = (gint64)floor(fabs(x)*100 + 0.5);
+  p = buf+sizeof(buf);
+  *(--p) = ' ';
+  if (n == 0) *(--p) = '0';
+  frac = (int)(n%100); n /= 100;
+  if (frac != 0) {
+    if (frac%10 != 0) *(--p) = '0' + frac%10;
+    *(--p) = '0' + frac/10;
+    *(--p) = '.';
+  }
+  while (n > 0) { *(--p) = '0' + (int)(n%10); n /= 10; }
+  if (x < 0 && p[0] != '0') *(--p) = '-';
+  g_string_append_len(str, p, buf+sizeof(buf)-p);
+}
+
+void pdf_append_color(GString *str, guint rgba, const char *op)
+{
+  pdf_append_num(str, ((rgba>>24)&0xff)/255.0);
+  pdf_append_num(str, ((rgba>>16)&0xff)/255.0);
+  pdf_append_num(str, ((rgba>>8)&0xff)/255.0);
+  g_string_append(str, op);
+}
+
+/* the path of a stroke, without the operator that paints it: it depends
+   on nothing else, so workers can draw it */
+
+void pdf_draw_stroke_path(struct Item *item, GString *str)
+{
+  GnomeCanvasPathDef *def;
+  ArtBpath *bp;
+  double *pt;
+  int i;
+
+  pt = item->path->coords;
+  if (!item->brush.variable_width) {
+    pdf_append_num(str, pt[0]); pdf_append_num(str, pt[1]);
+    g_string_append(str, "m ");
+    for (i=1, pt+=2; i<item->path->num_points; i++, pt+=2) {
+      pdf_append_num(str, pt[0]); pdf_append_num(str, pt[1]);
+      g_string_append(str, "l ");
+    }
+  } else { // its outline, filled as on the canvas
+    def = xo_stroke_outline(item->path, item->widths);
+    for (bp = gnome_canvas_path_def_bpath(def); bp->code != ART_END; bp++) {
+      if (bp->code == ART_CURVETO) {
+        pdf_append_num(str, bp->x1); pdf_append_num(str, bp->y1);
+        pdf_append_num(str, bp->x2); pdf_append_num(str, bp->y2);
+      }
+      pdf_append_num(str, bp->x3); pdf_append_num(str, bp->y3);
+      if (bp->code == ART_MOVETO || bp->code == ART_MOVETO_OPEN) g_string_append(str, "m ");
+      else if (bp->code == ART_LINETO) g_string_append(str, "l ");
+      else g_string_append(str, "c ");
+    }
+    gnome_canvas_path_def_unref(def);
+  }
+}
+
+/* move what str holds into a new segment of a content stream, followed
+   by the path of stroke if not NULL */
+
+void pdf_add_segment(GArray *segments, GString *str, struct Item *stroke)
+{
+  PdfSegment seg;
+
+  if (str->len > 0) {
+    seg.text = g_string_new_len(str->str, str->len);
+    seg.stroke = NULL;
+    g_array_append_val(segments, seg);
+    g_string_truncate(str, 0);
+  }
+  if (stroke != NULL) {
+    seg.text = NULL;
+    seg.stroke = stroke;
+    g_array_append_val(segments, seg);
+  }
+}
+
+// paint the path of the strokes so far, if it isn't yet
+
+void pdf_end_paint(GString *str, char *paint)
+{
+  if (*paint == 0) return;
+  g_string_append_c(str, *paint);
+  g_string_append_c(str, '\n');
+  *paint = 0;
+}
+
+/* draw the graphics of a page's layers, up to end_layer. If segments isn't
+   NULL, the paths of the strokes are left out of str, which is cut into
+   segments around them instead */
+
+void pdf_draw_page(struct Page *pg, GString *str, gboolean *use_hiliter, 
+                   struct XrefTable *xref, GList **pdffonts, GList **pdfimages,
+                   GList *layers, GList *end_layer, GArray *segments)
+{
+  GList *layerlist, *itemlist, *tmplist;
+  struct Layer *l;
+  struct Item *item;
+  guint old_rgba, old_fill_rgba;
+  double old_thickness;
+  double *pt;
+  int i, j;
+  PangoLayout *layout;
+  PangoLayoutIter *iter;
+  PangoRectangle logical_rect;
+  PangoLayoutRun *run;
+  PangoFcFont *fcfont;
+  FcPattern *pattern;
+  int baseline, advance;
+  int glyph_no, glyph_page, current_page;
+  char *filename;
+  char tmpstr[200];
+  int font_id;
+  FT_Face ftface;
+  GHashTable *advances;
+  struct PdfFont *cur_font;
+  struct PdfImage *cur_image;
+  gboolean in_string, translucent, same_style, in_hiliter;
+  guint hi_rgba, hi_fill_rgba;
+  double hi_thickness;
+  char op, paint;
+  
+  old_rgba = old_fill_rgba = 0x12345678;    // not any values we use, so we'll reset them
+  old_thickness = 0.0;
+  paint = 0; // the operator for the path of the strokes so far, if not painted yet
+  in_hiliter = FALSE;
+  hi_rgba = hi_fill_rgba = 0; hi_thickness = 0.0;
+  for (tmplist = *pdffonts; tmplist!=NULL; tmplist = tmplist->next) {
+    cur_font = (struct PdfFont *)tmplist->data;
+    cur_font->used_in_this_page = FALSE;
+  }
+  for (tmplist = *pdfimages; tmplist!=NULL; tmplist = tmplist->next) {
+    cur_image = (struct PdfImage *)tmplist->data;
+    cur_image->used_in_this_page = FALSE;
+  }
+
+  for (layerlist = layers; layerlist!=end_layer; layerlist = layerlist->next) {
+    l = (struct Layer *)layerlist->data;
+    for (itemlist = l->items; itemlist!=NULL; itemlist = itemlist->next) {
       item = (struct Item *)itemlist->data;
       if (item->type == ITEM_STROKE) {
-        if ((item->brush.color_rgba & ~0xff) != old_rgba)
-          g_string_append_printf(str, "%.2f %.2f %.2f RG ",
-            RGBA_RGB(item->brush.color_rgba));
-        if (item->brush.thickness != old_thickness)
-          g_string_append_printf(str, "%.2f w ", item->brush.thickness);
-        if ((item->brush.color_rgba & 0xf0) != 0xf0) { // transparent
-          g_string_append(str, "q /XoHi gs ");
-          *use_hiliter = TRUE;
-        }
-        old_rgba = item->brush.color_rgba & ~0xff;
-        old_thickness = item->brush.thickness;
-        pt = item->path->coords;
-        if (!item->brush.variable_width) {
-          g_string_append_printf(str, "%.2f %.2f m ", pt[0], pt[1]);
-          for (i=1, pt+=2; i<item->path->num_points; i++, pt+=2)
-            g_string_append_printf(str, "%.2f %.2f l ", pt[0], pt[1]);
-          g_string_append_printf(str,"S\n");
-          old_thickness = item->brush.thickness;
-        } else {
-          for (i=0; i<item->path->num_points-1; i++, pt+=2)
-            g_string_append_printf(str, "%.2f w %.2f %.2f m %.2f %.2f l S\n", 
-               item->widths[i], pt[0], pt[1], pt[2], pt[3]);
-          old_thickness = 0.0;
+        translucent = ((item->brush.color_rgba & 0xf0) != 0xf0);
+        op = item->brush.variable_width ? 'f' : 'S';
+        same_style = (paint == op && !translucent && (op == 'f' ?
+            (item->brush.color_rgba & ~0xff) == old_fill_rgba :
+            ((item->brush.color_rgba & ~0xff) == old_rgba &&
+             item->brush.thickness == old_thickness)));
+        /* an opaque stroke that looks like the previous one goes into the
+           same path; strokes of the hiliter keep their own paint operator
+           (their overlaps show), but share one graphics state */
+        if (!same_style) {
+          pdf_end_paint(str, &paint);
+          if (in_hiliter && (!translucent || !pdf_optimize_streams)) {
+            g_string_append(str, "Q ");
+            in_hiliter = FALSE;
+            old_rgba = hi_rgba; old_fill_rgba = hi_fill_rgba; old_thickness = hi_thickness;
+          }
+          if (translucent && !in_hiliter) {
+            g_string_append(str, "q /XoHi gs ");
+            *use_hiliter = in_hiliter = TRUE;
+            hi_rgba = old_rgba; hi_fill_rgba = old_fill_rgba; hi_thickness = old_thickness;
+          }
+          if (op == 'f') {
+            if ((item->brush.color_rgba & ~0xff) != old_fill_rgba)
+              pdf_append_color(str, item->brush.color_rgba, "rg ");
+            old_fill_rgba = item->brush.color_rgba & ~0xff;
+          } else {
+            if ((item->brush.color_rgba & ~0xff) != old_rgba)
+              pdf_append_color(str, item->brush.color_rgba, "RG ");
+            old_rgba = item->brush.color_rgba & ~0xff;
+            if (item->brush.thickness != old_thickness) {
+              pdf_append_num(str, item->brush.thickness);
+              g_string_append(str, "w ");
+            }
+            old_thickness = item->brush.thickness;
+          }
+          paint = op;
         }
-        if ((item->brush.color_rgba & 0xf0) != 0xf0) // undo transparent
-          g_string_append(str, "Q ");
+        if (segments != NULL) pdf_add_segment(segments, str, item); // leave it to a worker
+        else pdf_draw_stroke_path(item, str);
+        if (translucent || !pdf_optimize_streams) pdf_end_paint(str, &paint);
+        continue;
       }
-      else if (item->type == ITEM_TEXT) {
-        if ((item->brush.color_rgba & ~0xff) != old_text_rgba)
-          g_string_append_printf(str, "%.2f %.2f %.2f rg ",
-            RGBA_RGB(item->brush.color_rgba));
-        old_text_rgba = item->brush.color_rgba & ~0xff;
-        fontmap = pango_ft2_font_map_new();
-        pango_ft2_font_map_set_resolution(PANGO_FT2_FONT_MAP (fontmap), 72, 72);
-        context = pango_context_new();
-        pango_context_set_font_map(context, fontmap);
-        layout = pango_layout_new(context);
-        g_object_unref(fontmap);
-        g_object_unref(context);
-        font_desc = pango_font_description_from_string(item->font_name);
-        pango_font_description_set_absolute_size(font_desc,
-          item->font_size*PANGO_SCALE);
-        pango_layout_set_font_description(layout, font_desc);
-        pango_font_description_free(font_desc);
-        pango_layout_set_text(layout, item->text, -1);
+      pdf_end_paint(str, &paint);
+      if (in_hiliter) {
+        g_string_append(str, "Q ");
+        in_hiliter = FALSE;
+        old_rgba = hi_rgba; old_fill_rgba = hi_fill_rgba; old_thickness = hi_thickness;
+      }
+      if (item->type == ITEM_TEXT) {
+        if ((item->brush.color_rgba & ~0xff) != old_fill_rgba)
+          pdf_append_color(str, item->brush.color_rgba, "rg ");
+        old_fill_rgba = item->brush.color_rgba & ~0xff;
+        layout = layout_cache_get(&pdf_layouts, item);
         // this code inspired by the code in libgnomeprint
         iter = pango_layout_get_iter(layout);
         do {
@@ -1227,12 +1920,16 @@ void pdf_draw_page(struct Page *pg, GString *str, gboolean *use_hiliter,
               FcPatternGetInteger(pattern, FC_INDEX, 0, &font_id) != FcResultMatch)
                 continue;
           ftface = pango_fc_font_lock_face(fcfont);
+          advances = pdf_face_advances(filename, font_id);
           current_page = -1;
           cur_font = NULL;
-          g_string_append_printf(str, "BT %.2f 0 0 %.2f %.2f %.2f Tm ",
-            item->font_size, -item->font_size,
-            item->bbox.left + (gdouble) logical_rect.x/PANGO_SCALE,
-            item->bbox.top + (gdouble) baseline/PANGO_SCALE);
+          g_string_append(str, "BT ");
+          pdf_append_num(str, item->font_size);
+          g_string_append(str, "0 0 ");
+          pdf_append_num(str, -item->font_size);
+          pdf_append_num(str, item->bbox.left + (gdouble) logical_rect.x/PANGO_SCALE);
+          pdf_append_num(str, item->bbox.top + (gdouble) baseline/PANGO_SCALE);
+          g_string_append(str, "Tm ");
           in_string = FALSE;
           for (i=0; i<run->glyphs->num_glyphs; i++) {
             glyph_no = run->glyphs->glyphs[i].glyph;
@@ -1246,8 +1943,7 @@ void pdf_draw_page(struct Page *pg, GString *str, gboolean *use_hiliter,
               g_string_append_printf(str, "/F%d 1 Tf ", cur_font->n_obj);
             }
             current_page = glyph_page;
-            FT_Load_Glyph(ftface, glyph_no, FT_LOAD_NO_SCALE | FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP | FT_LOAD_IGNORE_TRANSFORM);
-            advance = (int)(ftface->glyph->metrics.horiAdvance * cur_font->ft2ps + 0.5);
+            advance = (int)(pdf_glyph_advance(advances, ftface, glyph_no) * cur_font->ft2ps + 0.5);
             if (!in_string) g_string_append_c(str, '(');
             in_string = TRUE;
             if (cur_font->is_truetype) {
@@ -1279,18 +1975,429 @@ void pdf_draw_page(struct Page *pg, GString *str, gboolean *use_hiliter,
           pango_fc_font_unlock_face(fcfont);
         } while (pango_layout_iter_next_run(iter));
         pango_layout_iter_free(iter);
-        g_object_unref(layout);
       }
       else if  (item->type == ITEM_IMAGE) {
-        cur_image = new_pdfimage(xref, pdfimages, item->image);
+        cur_image = new_pdfimage(xref, pdfimages, item->image,
+                                 item->image_png, item->image_png_len);
 	cur_image->used_in_this_page = TRUE;
-        g_string_append_printf(str, "\nq 1 0 0 1 %.2f %.2f cm %.2f 0 0 %.2f 0 %.2f cm /Im%d Do Q ",
-           item->bbox.left, item->bbox.top, // translation
-           item->bbox.right-item->bbox.left, item->bbox.top-item->bbox.bottom, item->bbox.bottom-item->bbox.top, // scaling
-           cur_image->n_obj);
+        g_string_append(str, "\nq ");  // scaled to the bbox, and flipped
+        pdf_append_num(str, item->bbox.right-item->bbox.left);
+        g_string_append(str, "0 0 ");
+        pdf_append_num(str, item->bbox.top-item->bbox.bottom);
+        pdf_append_num(str, item->bbox.left);
+        pdf_append_num(str, item->bbox.bottom);
+        g_string_append_printf(str, "cm /Im%d Do Q ", cur_image->n_obj);
+      }
+    }
+  }
+  pdf_end_paint(str, &paint);
+  if (in_hiliter) g_string_append(str, "Q ");
+}
+
+// what the page or layer will refer to, as of its drawing
+
+void pdf_note_resources(PdfPageJob *job, GList *pdffonts, GList *pdfimages)
+{
+  GList *list;
+
+  job->has_images = (pdfimages != NULL);
+  for (list = pdffonts; list!=NULL; list = list->next)
+    if (((struct PdfFont *)list->data)->used_in_this_page)
+      job->fonts = g_list_append(job->fonts, list->data);
+  for (list = pdfimages; list!=NULL; list = list->next)
+    if (((struct PdfImage *)list->data)->used_in_this_page)
+      job->images = g_list_append(job->images, list->data);
+}
+
+/* prepare a layer of a page as a form XObject, drawn once and shown again
+   by the pages of all the layers above it */
+
+PdfPageJob *pdf_prepare_layer(struct Page *pg, GList *layerlist, struct XrefTable *xref,
+                              GList **pdffonts, GList **pdfimages)
+{
+  PdfPageJob *job;
+  GString *str;
+
+  job = g_new0(PdfPageJob, 1);
+  job->pg = pg;
+  job->is_form = TRUE;
+  job->n_obj_prefix = job->n_obj_bgpix = -1;
+  job->objs = g_string_new("");
+  job->segments = g_array_new(FALSE, FALSE, sizeof(PdfSegment));
+
+  str = g_string_new("");
+  pdf_draw_page(pg, str, &job->use_hiliter, xref, pdffonts, pdfimages,
+                layerlist, layerlist->next, job->segments);
+  pdf_add_segment(job->segments, str, NULL);
+  g_string_free(str, TRUE);
+  make_xref(xref, xref->last+1, 0);
+  job->n_obj_stream = xref->last;
+  pdf_note_resources(job, *pdffonts, *pdfimages);
+  return job;
+}
+
+/* prepare the content stream of a page, numbering the objects it needs.
+   If forms isn't NULL, the page shows these layer forms instead of drawing
+   its layers. If update is set, it goes on the original page object of
+   the PDF file */
+
+PdfPageJob *pdf_prepare_page(struct Page *pg, GArray *forms, int n_page, gboolean annot,
+                             gboolean update, struct PdfInfo *pdfinfo, struct XrefTable *xref,
+                             GList **pdffonts, GList **pdfimages)
+{
+  PdfPageJob *job;
+  GString *pgstrm, *tmpstr;
+  struct PdfPageDesc *pgdesc;
+  guint i;
+
+  job = g_new0(PdfPageJob, 1);
+  job->pg = pg;
+  job->n_page = n_page;
+  job->n_obj_prefix = job->n_obj_bgpix = -1;
+  job->objs = g_string_new("");
+  job->segments = g_array_new(FALSE, FALSE, sizeof(PdfSegment));
+
+  // draw the background and page into pgstrm
+  pgstrm = g_string_new("");
+  g_string_printf(pgstrm, "q 1 0 0 -1 0 %.2f cm 1 J 1 j ", pg->height);
+  if (pg->bg->type == BG_SOLID)
+    pdf_draw_solid_background(pg, pgstrm);
+  else if (pg->bg->type == BG_PDF && annot && update) {
+    pgdesc = pdfinfo->pages+(pg->bg->file_page_seq-1);
+    tmpstr = make_pdfinverse(pgdesc, pg->width, pg->height);
+    g_string_prepend(pgstrm, tmpstr->str);
+    g_string_free(tmpstr, TRUE);
+    if (pgdesc->contents!=NULL) { // only protect ourselves from unbalanced q/Q
+      make_xref(xref, xref->last+1, 0);
+      job->n_obj_prefix = xref->last;
+      g_string_append_printf(job->objs,
+        "%d 0 obj\n<< /Length 6 >> stream\nq q q \nendstream\nendobj\n",
+        job->n_obj_prefix);
+      g_string_prepend(pgstrm, "Q Q Q ");
+    }
+  }
+  else if (pg->bg->type == BG_PDF && annot &&
+           pdfinfo->pages[pg->bg->file_page_seq-1].contents!=NULL) {
+    make_xref(xref, xref->last+1, 0);
+    job->n_obj_prefix = xref->last;
+    tmpstr = make_pdfprefix(pdfinfo->pages+(pg->bg->file_page_seq-1),
+                            pg->width, pg->height);
+    g_string_append_printf(job->objs,
+      "%d 0 obj\n<< /Length %zu >> stream\n%s\nendstream\nendobj\n",
+      job->n_obj_prefix, tmpstr->len, tmpstr->str);
+    g_string_free(tmpstr, TRUE);
+    g_string_prepend(pgstrm, "Q Q Q ");
+  }
+  else if (pg->bg->type == BG_PIXMAP || pg->bg->type == BG_PDF)
+    job->n_obj_bgpix = pdf_draw_bitmap_background(pg, pgstrm, xref, job->objs);
+  // draw the page contents
+  job->use_hiliter = FALSE;
+  if (forms != NULL) {
+    job->forms = g_array_sized_new(FALSE, FALSE, sizeof(int), forms->len);
+    g_array_append_vals(job->forms, forms->data, forms->len);
+    for (i=0; i<forms->len; i++)
+      g_string_append_printf(pgstrm, "/Ly%d Do ", g_array_index(forms, int, i));
+  }
+  else pdf_draw_page(pg, pgstrm, &job->use_hiliter, xref, pdffonts, pdfimages,
+                     pg->layers, NULL, job->segments);
+  g_string_append_printf(pgstrm, "Q\n");
+  pdf_add_segment(job->segments, pgstrm, NULL);
+  g_string_free(pgstrm, TRUE);
+  make_xref(xref, xref->last+1, 0);
+  job->n_obj_stream = xref->last;
+  if (forms == NULL) pdf_note_resources(job, *pdffonts, *pdfimages);
+  else job->has_images = (*pdfimages != NULL);
+  return job;
+}
+
+// in a worker thread: draw the strokes of a page and deflate its content
+
+void pdf_finish_page_stream(gpointer data, gpointer user_data)
+{
+  PdfPageJob *job = (PdfPageJob *)data;
+  PdfSegment *seg;
+  GString *str;
+  guint i;
+
+  str = g_string_new("");
+  for (i=0; i<job->segments->len; i++) {
+    seg = &g_array_index(job->segments, PdfSegment, i);
+    if (seg->text != NULL) g_string_append_len(str, seg->text->str, seg->text->len);
+    else pdf_draw_stroke_path(seg->stroke, str);
+  }
+  job->zstream = do_deflate(str->str, str->len);
+  g_string_free(str, TRUE);
+}
+
+int pdf_worker_count(void)
+{
+#if GLIB_CHECK_VERSION(2, 36, 0)
+  return g_get_num_processors();
+#elif !defined(WIN32)
+  return MAX(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+#else
+  return 1;
+#endif
+}
+
+// the resources of a prepared page or layer, added to obj (a dictionary, or NULL)
+
+struct PdfObj *pdf_job_resources(PdfPageJob *job, struct PdfObj *obj, struct PdfInfo *pdfinfo,
+                                 struct XrefTable *xref, int n_obj_hiliter)
+{
+  struct PdfFont *font;
+  struct PdfImage *image;
+  GList *list;
+  char *tmpbuf;
+  guint i;
+
+  if (obj==NULL) {
+    obj = g_malloc(sizeof(struct PdfObj));
+    obj->type = PDFTYPE_DICT;
+    obj->num = 0;
+    obj->elts = NULL;
+    obj->names = NULL;
+  }
+  add_dict_subentry(pdfinfo->src, xref,
+      obj, "/ProcSet", PDFTYPE_ARRAY, NULL, mk_pdfname("/PDF"));
+  if (job->n_obj_bgpix>0 || job->has_images)
+    add_dict_subentry(pdfinfo->src, xref,
+      obj, "/ProcSet", PDFTYPE_ARRAY, NULL, mk_pdfname("/ImageC"));
+  if (job->use_hiliter)
+    add_dict_subentry(pdfinfo->src, xref,
+      obj, "/ExtGState", PDFTYPE_DICT, "/XoHi", mk_pdfref(n_obj_hiliter));
+  if (job->n_obj_bgpix>0)
+    add_dict_subentry(pdfinfo->src, xref,
+      obj, "/XObject", PDFTYPE_DICT, "/ImBg", mk_pdfref(job->n_obj_bgpix));
+  for (list=job->fonts; list!=NULL; list = list->next) {
+    font = (struct PdfFont *)list->data;
+    add_dict_subentry(pdfinfo->src, xref,
+      obj, "/ProcSet", PDFTYPE_ARRAY, NULL, mk_pdfname("/Text"));
+    tmpbuf = g_strdup_printf("/F%d", font->n_obj);
+    add_dict_subentry(pdfinfo->src, xref,
+      obj, "/Font", PDFTYPE_DICT, tmpbuf, mk_pdfref(font->n_obj));
+    g_free(tmpbuf);
+  }
+  for (list=job->images; list!=NULL; list = list->next) {
+    image = (struct PdfImage *)list->data;
+    tmpbuf = g_strdup_printf("/Im%d", image->n_obj);
+    add_dict_subentry(pdfinfo->src, xref,
+      obj, "/XObject", PDFTYPE_DICT, tmpbuf, mk_pdfref(image->n_obj));
+    g_free(tmpbuf);
+  }
+  for (i=0; job->forms!=NULL && i<job->forms->len; i++) {
+    tmpbuf = g_strdup_printf("/Ly%d", g_array_index(job->forms, int, i));
+    add_dict_subentry(pdfinfo->src, xref,
+      obj, "/XObject", PDFTYPE_DICT, tmpbuf, mk_pdfref(g_array_index(job->forms, int, i)));
+    g_free(tmpbuf);
+  }
+  return obj;
+}
+
+/* write out a prepared page: its streams, then its page object. If
+   n_obj_pages_offs is 0, this is an incremental update of the PDF file
+   being annotated, and its page object is replaced by a modified copy */
+
+void pdf_write_page(PdfPageJob *job, GString *pdfbuf, struct XrefTable *xref,
+                    struct PdfInfo *pdfinfo, int n_obj_parent, int n_obj_pages_offs,
+                    int n_obj_hiliter)
+{
+  struct Page *pg = job->pg;
+  struct PdfPageDesc *pgdesc;
+  struct PdfObj *obj, *page, *contents, *orig;
+  int i, n_obj_page;
+
+  if (job->is_form) { // a layer, which only has its stream
+    obj = pdf_job_resources(job, NULL, pdfinfo, xref, n_obj_hiliter);
+    xref->data[job->n_obj_stream] = pdf_offset(pdfbuf);
+    g_string_append_printf(pdfbuf,
+      "%d 0 obj\n<< /Type /XObject /Subtype /Form /BBox [0 0 %.2f %.2f] /Resources ",
+      job->n_obj_stream, pg->width, pg->height);
+    show_pdfobj(obj, pdfbuf);
+    free_pdfobj(obj);
+    g_string_append_printf(pdfbuf, " /Length %zu /Filter /FlateDecode >> stream\n",
+      job->zstream->len);
+    g_string_append_len(pdfbuf, job->zstream->str, job->zstream->len);
+    g_string_append(pdfbuf, "endstream\nendobj\n");
+    pdf_flush(pdfbuf, FALSE);
+    return;
+  }
+
+  // the background object, now that we know where it goes
+  if (job->objs->len > 0) { // not if it's a bitmap that an earlier page wrote
+    xref->data[(job->n_obj_prefix>0) ? job->n_obj_prefix : job->n_obj_bgpix] = pdf_offset(pdfbuf);
+    g_string_append_len(pdfbuf, job->objs->str, job->objs->len);
+  }
+
+  xref->data[job->n_obj_stream] = pdf_offset(pdfbuf);
+  g_string_append_printf(pdfbuf,
+    "%d 0 obj\n<< /Length %zu /Filter /FlateDecode>> stream\n",
+    job->n_obj_stream, job->zstream->len);
+  g_string_append_len(pdfbuf, job->zstream->str, job->zstream->len);
+  g_string_append(pdfbuf, "endstream\nendobj\n");
+
+  // the resources of the page object
+
+  if (job->n_obj_prefix>0 || n_obj_pages_offs == 0)
+    obj = dup_pdfobj(pdfinfo->pages[pg->bg->file_page_seq-1].resources);
+  else obj = NULL;
+  if (obj!=NULL && obj->type!=PDFTYPE_DICT)
+    { free_pdfobj(obj); obj=NULL; }
+  obj = pdf_job_resources(job, obj, pdfinfo, xref, n_obj_hiliter);
+
+  // an incremental update: a copy of the page object, with our content added
+
+  if (n_obj_pages_offs == 0) {
+    pgdesc = pdfinfo->pages + (pg->bg->file_page_seq-1);
+    n_obj_page = pgdesc->n_obj;
+    contents = mk_pdfref(n_obj_page);
+    page = get_pdfobj(pdfinfo->src, xref, contents); // before its offset changes
+    free_pdfobj(contents);
+    if (page == NULL || page->type != PDFTYPE_DICT) { // can't happen, checked beforehand
+      free_pdfobj(page);
+      page = g_malloc(sizeof(struct PdfObj));
+      page->type = PDFTYPE_DICT;
+      page->num = 0;
+      page->elts = NULL;
+      page->names = NULL;
+    }
+    contents = g_malloc(sizeof(struct PdfObj));
+    contents->type = PDFTYPE_ARRAY;
+    contents->num = 0;
+    contents->elts = NULL;
+    if (job->n_obj_prefix>0) {
+      add_array_entry(contents, mk_pdfref(job->n_obj_prefix));
+      orig = get_pdfobj(pdfinfo->src, xref, pgdesc->contents);
+      if (orig != NULL && orig->type == PDFTYPE_ARRAY)
+        for (i=0; i<orig->num; i++) {
+          add_array_entry(contents, orig->elts[i]);
+          orig->elts[i] = NULL;
+        }
+      else add_array_entry(contents, dup_pdfobj(pgdesc->contents));
+      free_pdfobj(orig);
+    }
+    add_array_entry(contents, mk_pdfref(job->n_obj_stream));
+    set_dict_entry(page, "/Contents", contents);
+    set_dict_entry(page, "/Resources", obj);
+    make_xref(xref, n_obj_page, pdf_offset(pdfbuf));
+    g_string_append_printf(pdfbuf, "%d 0 obj\n", n_obj_page);
+    show_pdfobj(page, pdfbuf);
+    g_string_append(pdfbuf, " endobj\n");
+    free_pdfobj(page);
+    pdf_flush(pdfbuf, FALSE);
+    return;
+  }
+
+  // or else a new page object
+
+  make_xref(xref, n_obj_pages_offs+job->n_page, pdf_offset(pdfbuf));
+  g_string_append_printf(pdfbuf,
+    "%d 0 obj\n<< /Type /Page /Parent %d 0 R /MediaBox [0 0 %.2f %.2f] ",
+    n_obj_pages_offs+job->n_page, n_obj_parent, pg->width, pg->height);
+  if (job->n_obj_prefix>0) {
+    contents = get_pdfobj(pdfinfo->src, xref, pdfinfo->pages[pg->bg->file_page_seq-1].contents);
+    if (contents->type != PDFTYPE_ARRAY) {
+      free_pdfobj(contents);
+      contents = dup_pdfobj(pdfinfo->pages[pg->bg->file_page_seq-1].contents);
+    }
+    g_string_append_printf(pdfbuf, "/Contents [%d 0 R ", job->n_obj_prefix);
+    if (contents->type == PDFTYPE_REF)
+      g_string_append_printf(pdfbuf, "%d %d R ", contents->intval, contents->num);
+    if (contents->type == PDFTYPE_ARRAY) {
+      for (i=0; i<contents->num; i++) {
+        show_pdfobj(contents->elts[i], pdfbuf);
+        g_string_append_c(pdfbuf, ' ');
       }
     }
+    free_pdfobj(contents);
+    g_string_append_printf(pdfbuf, "%d 0 R] ", job->n_obj_stream);
+  }
+  else g_string_append_printf(pdfbuf, "/Contents %d 0 R ", job->n_obj_stream);
+  g_string_append(pdfbuf, "/Resources ");
+  show_pdfobj(obj, pdfbuf);
+  free_pdfobj(obj);
+  g_string_append(pdfbuf, " >> endobj\n");
+  pdf_flush(pdfbuf, FALSE);
+}
+
+void pdf_free_page_job(PdfPageJob *job)
+{
+  guint i;
+
+  for (i=0; i<job->segments->len; i++)
+    if (g_array_index(job->segments, PdfSegment, i).text != NULL)
+      g_string_free(g_array_index(job->segments, PdfSegment, i).text, TRUE);
+  g_array_free(job->segments, TRUE);
+  g_string_free(job->objs, TRUE);
+  if (job->zstream != NULL) g_string_free(job->zstream, TRUE);
+  g_list_free(job->fonts);
+  g_list_free(job->images);
+  if (job->forms != NULL) g_array_free(job->forms, TRUE);
+  g_free(job);
+}
+
+/* finish the content streams of a batch of prepared pages on a thread
+   pool, then write the pages out in order and empty the batch. The output
+   is the same as doing it all in order on this thread. */
+
+void pdf_write_pages(GPtrArray *jobs, GString *pdfbuf, struct XrefTable *xref,
+                     struct PdfInfo *pdfinfo, int n_obj_parent, int n_obj_pages_offs,
+                     int n_obj_hiliter)
+{
+  GThreadPool *pool;
+  guint i;
+
+  pool = NULL;
+  if (g_thread_supported() && jobs->len > 1 && pdf_worker_count() > 1)
+    pool = g_thread_pool_new(pdf_finish_page_stream, NULL,
+                             MIN(pdf_worker_count(), (int)jobs->len), TRUE, NULL);
+  for (i=0; i<jobs->len; i++) {
+    if (pool != NULL) g_thread_pool_push(pool, g_ptr_array_index(jobs, i), NULL);
+    else pdf_finish_page_stream(g_ptr_array_index(jobs, i), NULL);
   }
+  if (pool != NULL) g_thread_pool_free(pool, FALSE, TRUE); // wait for them all
+
+  for (i=0; i<jobs->len; i++) {
+    pdf_write_page((PdfPageJob *)g_ptr_array_index(jobs, i), pdfbuf, xref, pdfinfo,
+                   n_obj_parent, n_obj_pages_offs, n_obj_hiliter);
+    pdf_free_page_job((PdfPageJob *)g_ptr_array_index(jobs, i));
+  }
+  g_ptr_array_set_size(jobs, 0);
+}
+
+/* can the export be an incremental update of the PDF file, which only
+   adds our content to its pages? Only if the journal is that file, page
+   for page */
+
+gboolean pdf_can_update(struct PdfInfo *pdfinfo)
+{
+  GList *pglist;
+  GHashTable *seen;
+  struct Page *pg;
+  struct PdfObj *root;
+  gboolean ok;
+  int i;
+
+  root = get_dict_entry(pdfinfo->trailerdict, "/Root");
+  if (ui.exportpdf_layers || journal.npages != pdfinfo->npages ||
+      root == NULL || root->type != PDFTYPE_REF) return FALSE;
+  seen = g_hash_table_new(g_direct_hash, g_direct_equal); // page objects
+  ok = TRUE;
+  for (pglist = journal.pages, i=0; pglist!=NULL && ok; pglist = pglist->next, i++) {
+    pg = (struct Page *)pglist->data;
+    if (pg->bg->type != BG_PDF || pg->bg->file_page_seq != i+1 ||
+        pdfinfo->pages[i].n_obj <= 0 ||
+        g_hash_table_lookup(seen, GINT_TO_POINTER(pdfinfo->pages[i].n_obj)) != NULL)
+      ok = FALSE;
+    else g_hash_table_insert(seen, GINT_TO_POINTER(pdfinfo->pages[i].n_obj), pg);
+  }
+  g_hash_table_destroy(seen);
+  return ok;
+}
+
+static gint compare_ints(gconstpointer a, gconstpointer b)
+{
+  return *(const int *)a - *(const int *)b;
 }
 
 // main printing function
@@ -1300,32 +2407,38 @@ void pdf_draw_page(struct Page *pg, GString *str, gboolean *use_hiliter,
     1 the page tree
     2 the GS for the hiliters
     3 ... the page objects
+   except in an incremental update, where n_obj_catalog is the GS for the
+   hiliters, followed by the content streams; the catalog and page objects
+   of the original file are changed in place.
 */
 
 gboolean print_to_pdf(char *filename)
 {
   FILE *f;
-  GString *pdfbuf, *pgstrm, *zpgstrm, *tmpstr;
-  int n_obj_catalog, n_obj_pages_offs, n_page, n_obj_bgpix, n_obj_prefix;
+  GString *pdfbuf, srcbuf;
+  int n_obj_catalog, n_obj_pages_offs, n_obj_hiliter, n_page;
   int i, startxref;
   struct XrefTable xref;
   GList *pglist;
   struct Page *pg;
-  gboolean annot, uses_pdf;
-  gboolean use_hiliter;
+  gboolean annot, uses_pdf, update;
   struct PdfInfo pdfinfo;
-  struct PdfObj *obj;
+  struct PdfObj *root, *obj;
+  GArray *updated;
   GList *pdffonts, *pdfimages, *list;
   struct PdfFont *font;
   struct PdfImage *image;
-  char *tmpbuf;
-  GList *last_layer;
+  GList *layerlist;
+  GArray *forms;
+  PdfPageJob *form;
+  GPtrArray *jobs;
   
   f = g_fopen(filename, "wb");
   if (f == NULL) return FALSE;
   setlocale(LC_NUMERIC, "C");
   annot = FALSE;
   xref.data = NULL;
+  pdfinfo.src = NULL;
   uses_pdf = FALSE;
   pdffonts = NULL;
   pdfimages = NULL;
@@ -1339,14 +2452,12 @@ gboolean print_to_pdf(char *filename)
   
   if (uses_pdf && bgpdf.status != STATUS_NOT_INIT && 
       bgpdf.file_contents!=NULL && !strncmp(bgpdf.file_contents, "%PDF-1.", 7)) {
-    // parse the existing PDF file
-    pdfbuf = g_string_new_len(bgpdf.file_contents, bgpdf.file_length);
-    if (pdfbuf->str[7]<'4') pdfbuf->str[7] = '4'; // upgrade to 1.4
-    annot = pdf_parse_info(pdfbuf, &pdfinfo, &xref);
-    if (!annot) {
-      g_string_free(pdfbuf, TRUE);
-      if (xref.data != NULL) g_free(xref.data);
-    }
+    // parse the existing PDF file, where it is: srcbuf isn't a copy
+    srcbuf.str = bgpdf.file_contents;
+    srcbuf.len = bgpdf.file_length;
+    srcbuf.allocated_len = bgpdf.file_length+1;
+    annot = pdf_parse_info(&srcbuf, &pdfinfo, &xref);
+    if (!annot && xref.data != NULL) g_free(xref.data);
   }
 
   if (uses_pdf && !annot) { // couldn't parse the PDF: fall back to cairo?
@@ -1355,157 +2466,109 @@ gboolean print_to_pdf(char *filename)
     return FALSE;
   }
 
-  if (!annot) {
+  update = annot && ui.exportpdf_incremental && pdf_can_update(&pdfinfo);
+  pdf_file = f;
+  pdf_written = 0;
+  pdf_write_failed = FALSE;
+  if (annot) {
+    // copy the existing PDF file unchanged, except for an upgrade to 1.4
+    // (which an incremental update declares in the catalog instead)
+    pdfbuf = g_string_new_len(bgpdf.file_contents, 8);
+    if (pdfbuf->str[7]<'4' && !update) pdfbuf->str[7] = '4';
+    pdf_flush(pdfbuf, TRUE);
+    if (fwrite(bgpdf.file_contents+8, 1, bgpdf.file_length-8, f) < bgpdf.file_length-8)
+      pdf_write_failed = TRUE;
+    pdf_written = bgpdf.file_length;
+  }
+  else {
     pdfbuf = g_string_new("%PDF-1.4\n%\370\357\365\362\n");
     xref.n_alloc = xref.last = 0;
     xref.data = NULL;
   }
     
-  // catalog and page tree
-  n_obj_catalog = xref.last+1;
-  n_obj_pages_offs = xref.last+4;
-  make_xref(&xref, n_obj_catalog, pdfbuf->len);
-  g_string_append_printf(pdfbuf, 
-    "%d 0 obj\n<< /Type /Catalog /Pages %d 0 R >> endobj\n",
-     n_obj_catalog, n_obj_catalog+1);
-  make_xref(&xref, n_obj_catalog+1, pdfbuf->len);
-  g_string_append_printf(pdfbuf,
-    "%d 0 obj\n<< /Type /Pages /Kids [", n_obj_catalog+1);
-  for (i=0;i<n_page;i++)
-    g_string_append_printf(pdfbuf, "%d 0 R ", n_obj_pages_offs+i);
-  g_string_append_printf(pdfbuf, "] /Count %d >> endobj\n", n_page);
-  make_xref(&xref, n_obj_catalog+2, pdfbuf->len);
-  g_string_append_printf(pdfbuf, 
-    "%d 0 obj\n<< /Type /ExtGState /CA %.2f >> endobj\n",
-     n_obj_catalog+2, ui.hiliter_opacity);
-  xref.last = n_obj_pages_offs + n_page-1;
+  updated = g_array_new(FALSE, FALSE, sizeof(int)); // objects of the file we change
+  root = NULL;
+  if (update) {
+    n_obj_catalog = n_obj_hiliter = xref.last+1;
+    n_obj_pages_offs = 0;
+    make_xref(&xref, n_obj_hiliter, pdf_offset(pdfbuf));
+    g_string_append_printf(pdfbuf, 
+      "%d 0 obj\n<< /Type /ExtGState /CA %.2f /ca %.2f >> endobj\n",
+       n_obj_hiliter, ui.hiliter_opacity, ui.hiliter_opacity);
+    root = get_dict_entry(pdfinfo.trailerdict, "/Root");
+    obj = get_pdfobj(pdfinfo.src, &xref, root);
+    if (bgpdf.file_contents[7]<'4' && obj!=NULL && obj->type == PDFTYPE_DICT) {
+      set_dict_entry(obj, "/Version", mk_pdfname("/1.4"));
+      make_xref(&xref, root->intval, pdf_offset(pdfbuf));
+      g_array_append_val(updated, root->intval);
+      g_string_append_printf(pdfbuf, "%d 0 obj\n", root->intval);
+      show_pdfobj(obj, pdfbuf);
+      g_string_append(pdfbuf, " endobj\n");
+    }
+    free_pdfobj(obj);
+    for (i=0; i<pdfinfo.npages; i++)
+      g_array_append_val(updated, pdfinfo.pages[i].n_obj);
+  }
+  else { // catalog and page tree
+    n_obj_catalog = xref.last+1;
+    n_obj_pages_offs = xref.last+4;
+    make_xref(&xref, n_obj_catalog, pdf_offset(pdfbuf));
+    g_string_append_printf(pdfbuf, 
+      "%d 0 obj\n<< /Type /Catalog /Pages %d 0 R >> endobj\n",
+       n_obj_catalog, n_obj_catalog+1);
+    make_xref(&xref, n_obj_catalog+1, pdf_offset(pdfbuf));
+    g_string_append_printf(pdfbuf,
+      "%d 0 obj\n<< /Type /Pages /Kids [", n_obj_catalog+1);
+    for (i=0;i<n_page;i++)
+      g_string_append_printf(pdfbuf, "%d 0 R ", n_obj_pages_offs+i);
+    g_string_append_printf(pdfbuf, "] /Count %d >> endobj\n", n_page);
+    make_xref(&xref, n_obj_catalog+2, pdf_offset(pdfbuf));
+    g_string_append_printf(pdfbuf, 
+      "%d 0 obj\n<< /Type /ExtGState /CA %.2f /ca %.2f >> endobj\n",
+       n_obj_catalog+2, ui.hiliter_opacity, ui.hiliter_opacity);
+    n_obj_hiliter = n_obj_catalog+2;
+    xref.last = n_obj_pages_offs + n_page-1;
+  }
   
+  pdf_text_begin();
+  jobs = g_ptr_array_new();
+  forms = g_array_new(FALSE, FALSE, sizeof(int));
   for (pglist = journal.pages, n_page = 0; pglist!=NULL;
        pglist = pglist->next) {
     pg = (struct Page *)pglist->data;
-    if (ui.exportpdf_layers) last_layer = pg->layers; else last_layer = NULL;
-  do {
-    if (last_layer!=NULL) last_layer = last_layer->next;
-    // draw the background and page into pgstrm
-    pgstrm = g_string_new("");
-    g_string_printf(pgstrm, "q 1 0 0 -1 0 %.2f cm 1 J 1 j ", pg->height);
-    n_obj_bgpix = -1;
-    n_obj_prefix = -1;
-    if (pg->bg->type == BG_SOLID)
-      pdf_draw_solid_background(pg, pgstrm);
-    else if (pg->bg->type == BG_PDF && annot && 
-             pdfinfo.pages[pg->bg->file_page_seq-1].contents!=NULL) {
-      make_xref(&xref, xref.last+1, pdfbuf->len);
-      n_obj_prefix = xref.last;
-      tmpstr = make_pdfprefix(pdfinfo.pages+(pg->bg->file_page_seq-1),
-                              pg->width, pg->height);
-      g_string_append_printf(pdfbuf,
-        "%d 0 obj\n<< /Length %zu >> stream\n%s\nendstream\nendobj\n",
-        n_obj_prefix, tmpstr->len, tmpstr->str);
-      g_string_free(tmpstr, TRUE);
-      g_string_prepend(pgstrm, "Q Q Q ");
+    if (!ui.exportpdf_layers || pg->layers == NULL) {
+      g_ptr_array_add(jobs, pdf_prepare_page(pg, NULL, n_page++, annot, update,
+                                             &pdfinfo, &xref, &pdffonts, &pdfimages));
+      if (jobs->len >= PDF_EXPORT_BATCH)
+        pdf_write_pages(jobs, pdfbuf, &xref, &pdfinfo, n_obj_catalog+1, n_obj_pages_offs,
+                        n_obj_hiliter);
+      continue;
     }
-    else if (pg->bg->type == BG_PIXMAP || pg->bg->type == BG_PDF)
-      n_obj_bgpix = pdf_draw_bitmap_background(pg, pgstrm, &xref, pdfbuf);
-    // draw the page contents
-    use_hiliter = FALSE;
-    pdf_draw_page(pg, pgstrm, &use_hiliter, &xref, &pdffonts, &pdfimages, last_layer);
-    g_string_append_printf(pgstrm, "Q\n");
-    
-    // deflate pgstrm and write it
-    zpgstrm = do_deflate(pgstrm->str, pgstrm->len);
-    g_string_free(pgstrm, TRUE);
-    
-    make_xref(&xref, xref.last+1, pdfbuf->len);
-    g_string_append_printf(pdfbuf, 
-      "%d 0 obj\n<< /Length %zu /Filter /FlateDecode>> stream\n",
-      xref.last, zpgstrm->len);
-    g_string_append_len(pdfbuf, zpgstrm->str, zpgstrm->len);
-    g_string_free(zpgstrm, TRUE);
-    g_string_append(pdfbuf, "endstream\nendobj\n");
-    
-    // write the page object
-    
-    make_xref(&xref, n_obj_pages_offs+n_page, pdfbuf->len);
-    g_string_append_printf(pdfbuf, 
-      "%d 0 obj\n<< /Type /Page /Parent %d 0 R /MediaBox [0 0 %.2f %.2f] ",
-      n_obj_pages_offs+n_page, n_obj_catalog+1, pg->width, pg->height);
-    if (n_obj_prefix>0) {
-      obj = get_pdfobj(pdfbuf, &xref, pdfinfo.pages[pg->bg->file_page_seq-1].contents);
-      if (obj->type != PDFTYPE_ARRAY) {
-        free_pdfobj(obj);
-        obj = dup_pdfobj(pdfinfo.pages[pg->bg->file_page_seq-1].contents);
-      }
-      g_string_append_printf(pdfbuf, "/Contents [%d 0 R ", n_obj_prefix);
-      if (obj->type == PDFTYPE_REF) 
-        g_string_append_printf(pdfbuf, "%d %d R ", obj->intval, obj->num);
-      if (obj->type == PDFTYPE_ARRAY) {
-        for (i=0; i<obj->num; i++) {
-          show_pdfobj(obj->elts[i], pdfbuf);
-          g_string_append_c(pdfbuf, ' ');
-        }
-      }
-      free_pdfobj(obj);
-      g_string_append_printf(pdfbuf, "%d 0 R] ", xref.last);
-    }
-    else g_string_append_printf(pdfbuf, "/Contents %d 0 R ", xref.last);
-    g_string_append(pdfbuf, "/Resources ");
-
-    if (n_obj_prefix>0)
-      obj = dup_pdfobj(pdfinfo.pages[pg->bg->file_page_seq-1].resources);
-    else obj = NULL;
-    if (obj!=NULL && obj->type!=PDFTYPE_DICT)
-      { free_pdfobj(obj); obj=NULL; }
-    if (obj==NULL) {
-      obj = g_malloc(sizeof(struct PdfObj));
-      obj->type = PDFTYPE_DICT;
-      obj->num = 0;
-      obj->elts = NULL;
-      obj->names = NULL;
-    }
-    add_dict_subentry(pdfbuf, &xref,
-        obj, "/ProcSet", PDFTYPE_ARRAY, NULL, mk_pdfname("/PDF"));
-    if (n_obj_bgpix>0 || pdfimages!=NULL)
-      add_dict_subentry(pdfbuf, &xref,
-        obj, "/ProcSet", PDFTYPE_ARRAY, NULL, mk_pdfname("/ImageC"));
-    if (use_hiliter)
-      add_dict_subentry(pdfbuf, &xref,
-        obj, "/ExtGState", PDFTYPE_DICT, "/XoHi", mk_pdfref(n_obj_catalog+2));
-    if (n_obj_bgpix>0)
-      add_dict_subentry(pdfbuf, &xref,
-        obj, "/XObject", PDFTYPE_DICT, "/ImBg", mk_pdfref(n_obj_bgpix));
-    for (list=pdffonts; list!=NULL; list = list->next) {
-      font = (struct PdfFont *)list->data;
-      if (font->used_in_this_page) {
-        add_dict_subentry(pdfbuf, &xref,
-          obj, "/ProcSet", PDFTYPE_ARRAY, NULL, mk_pdfname("/Text"));
-        tmpbuf = g_strdup_printf("/F%d", font->n_obj);
-        add_dict_subentry(pdfbuf, &xref,
-          obj, "/Font", PDFTYPE_DICT, tmpbuf, mk_pdfref(font->n_obj));
-        g_free(tmpbuf);
-      }
-    }
-    for (list=pdfimages; list!=NULL; list = list->next) {
-      image = (struct PdfImage *)list->data;
-      if (image->used_in_this_page) {
-        tmpbuf = g_strdup_printf("/Im%d", image->n_obj);
-        add_dict_subentry(pdfbuf, &xref,
-          obj, "/XObject", PDFTYPE_DICT, tmpbuf, mk_pdfref(image->n_obj));
-        g_free(tmpbuf);
-      }
+    // one page per layer, each showing the forms of the layers up to it
+    g_array_set_size(forms, 0);
+    for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next) {
+      form = pdf_prepare_layer(pg, layerlist, &xref, &pdffonts, &pdfimages);
+      g_ptr_array_add(jobs, form);
+      g_array_append_val(forms, form->n_obj_stream);
+      g_ptr_array_add(jobs, pdf_prepare_page(pg, forms, n_page++, annot, update,
+                                             &pdfinfo, &xref, &pdffonts, &pdfimages));
+      if (jobs->len >= PDF_EXPORT_BATCH)
+        pdf_write_pages(jobs, pdfbuf, &xref, &pdfinfo, n_obj_catalog+1, n_obj_pages_offs,
+                        n_obj_hiliter);
     }
-    show_pdfobj(obj, pdfbuf);
-    free_pdfobj(obj);
-    g_string_append(pdfbuf, " >> endobj\n");
-    n_page++;
-  }
-  while (last_layer!=NULL);
   }
+  g_array_free(forms, TRUE);
+  pdf_write_pages(jobs, pdfbuf, &xref, &pdfinfo, n_obj_catalog+1, n_obj_pages_offs,
+                  n_obj_hiliter);
+  g_ptr_array_free(jobs, TRUE);
+  pdf_text_end();
+  pdf_free_backgrounds();
   
   // after the pages, we insert fonts and images
   for (list = pdffonts; list!=NULL; list = list->next) {
     font = (struct PdfFont *)list->data;
     embed_pdffont(pdfbuf, &xref, font);
+    pdf_flush(pdfbuf, FALSE);
     g_free(font->filename);
     g_free(font->fontname);
     g_free(font);
@@ -1514,22 +2577,49 @@ gboolean print_to_pdf(char *filename)
   for (list = pdfimages; list!=NULL; list = list->next) {
     image = (struct PdfImage *)list->data;
     if (!pdf_draw_image(image, &xref, pdfbuf)) {
+      g_array_free(updated, TRUE);
+      pdf_file = NULL;
+      fclose(f);
+      setlocale(LC_NUMERIC, "");
       return FALSE;
     }
+    pdf_flush(pdfbuf, FALSE);
     g_free(image);
   }
   g_list_free(pdfimages);
   
   // PDF trailer
-  startxref = pdfbuf->len;
+  startxref = pdf_offset(pdfbuf);
+  if (update) {
+    g_string_append(pdfbuf, "xref\n");
+    g_array_sort(updated, compare_ints);
+    for (i=0; i<(int)updated->len; i++)
+      g_string_append_printf(pdfbuf, "%d 1\n%010d 00000 n \n",
+        g_array_index(updated, int, i), xref.data[g_array_index(updated, int, i)]);
+  }
+  g_array_free(updated, TRUE);
   if (annot) g_string_append_printf(pdfbuf,
-        "xref\n%d %d\n", n_obj_catalog, xref.last-n_obj_catalog+1);
+        "%s%d %d\n", update ? "" : "xref\n", n_obj_catalog, xref.last-n_obj_catalog+1);
   else g_string_append_printf(pdfbuf, 
         "xref\n0 %d\n0000000000 65535 f \n", xref.last+1);
   for (i=n_obj_catalog; i<=xref.last; i++)
     g_string_append_printf(pdfbuf, "%010d 00000 n \n", xref.data[i]);
-  g_string_append_printf(pdfbuf, 
-    "trailer\n<< /Size %d /Root %d 0 R ", xref.last+1, n_obj_catalog);
+  g_string_append_printf(pdfbuf, "trailer\n<< /Size %d /Root ", xref.last+1);
+  if (update) show_pdfobj(root, pdfbuf);
+  else g_string_append_printf(pdfbuf, "%d 0 R", n_obj_catalog);
+  g_string_append_c(pdfbuf, ' ');
+  if (update) {
+    if ((obj = get_dict_entry(pdfinfo.trailerdict, "/Info")) != NULL) {
+      g_string_append(pdfbuf, "/Info ");
+      show_pdfobj(obj, pdfbuf);
+      g_string_append_c(pdfbuf, ' ');
+    }
+    if ((obj = get_dict_entry(pdfinfo.trailerdict, "/ID")) != NULL) {
+      g_string_append(pdfbuf, "/ID ");
+      show_pdfobj(obj, pdfbuf);
+      g_string_append_c(pdfbuf, ' ');
+    }
+  }
   if (annot) {
     g_string_append_printf(pdfbuf, "/Prev %d ", pdfinfo.startxref);
     // keeping encryption info somehow doesn't work.
@@ -1557,20 +2647,110 @@ gboolean print_to_pdf(char *filename)
   }
   
   setlocale(LC_NUMERIC, "");
-  if (fwrite(pdfbuf->str, 1, pdfbuf->len, f) < pdfbuf->len) {
-    fclose(f);
-    g_string_free(pdfbuf, TRUE);
-    return FALSE;
-  }
-  fclose(f);
+  pdf_flush(pdfbuf, TRUE);
+  pdf_file = NULL;
   g_string_free(pdfbuf, TRUE);
-  return TRUE;
+  if (fclose(f) != 0) pdf_write_failed = TRUE;
+  return !pdf_write_failed;
+}
+
+/* --benchmark-pdf: the size of the content streams of the journal, and
+   the time it takes to draw them, without and with the optimizer. An
+   untimed pass first warms up fontconfig and the fonts for both. */
+
+void pdf_stream_benchmark(int iterations)
+{
+  GList *pglist, *pdffonts, *pdfimages, *list;
+  struct XrefTable xref;
+  struct PdfFont *font;
+  struct Page *pg;
+  GString *str, *zstr;
+  GTimer *timer;
+  gboolean use_hiliter;
+  double t_draw, t_deflate;
+  long size, zsize;
+  int i, mode;
+
+  setlocale(LC_NUMERIC, "C");
+  timer = g_timer_new();
+  printf("pages: %d, %d drawings of each\n", journal.npages, iterations);
+  for (mode = -1; mode < 2; mode++) { // -1 is the warm-up
+    pdf_optimize_streams = (mode > 0);
+    pdf_text_begin(); // both modes start with cold text caches
+    xref.data = NULL;
+    xref.last = xref.n_alloc = 0;
+    pdffonts = pdfimages = NULL;
+    t_draw = t_deflate = 0.;
+    size = zsize = 0;
+    for (i = 0; i < ((mode < 0) ? 1 : iterations); i++)
+      for (pglist = journal.pages; pglist != NULL; pglist = pglist->next) {
+        pg = (struct Page *)pglist->data;
+        str = g_string_new("");
+        g_timer_start(timer);
+        pdf_draw_page(pg, str, &use_hiliter, &xref, &pdffonts, &pdfimages,
+                      pg->layers, NULL, NULL);
+        t_draw += g_timer_elapsed(timer, NULL);
+        g_timer_start(timer);
+        zstr = do_deflate(str->str, str->len);
+        t_deflate += g_timer_elapsed(timer, NULL);
+        size += str->len;
+        zsize += zstr->len;
+        g_string_free(str, TRUE);
+        g_string_free(zstr, TRUE);
+      }
+    if (mode >= 0)
+      printf("%s: %ld bytes, %ld deflated; drawing %.3f s, deflating %.3f s\n",
+             mode ? "optimized" : "plain    ", size/iterations, zsize/iterations,
+             t_draw, t_deflate);
+    for (list = pdffonts; list!=NULL; list = list->next) {
+      font = (struct PdfFont *)list->data;
+      for (i = 0; i < 256; i++) g_free(font->glyphpsnames[i]);
+      g_free(font->filename);
+      g_free(font->fontname);
+      g_free(font);
+    }
+    g_list_free(pdffonts);
+    for (list = pdfimages; list!=NULL; list = list->next) g_free(list->data);
+    g_list_free(pdfimages);
+    g_free(xref.data);
+    pdf_text_end();
+  }
+  pdf_optimize_streams = TRUE;
+  g_timer_destroy(timer);
+  setlocale(LC_NUMERIC, "");
 }
 
 /*********** Printing via cairo and gtk-print **********/
 
 // does the same job as update_canvas_bg(), but to a cairo context
 
+/* let cairo embed the encoded data (which it then owns) of the pixbuf
+   that is the current source, where its backend can use it as is */
+
+void set_source_encoded_data(cairo_t *cr, gchar *data, gsize len)
+{
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+  cairo_surface_t *surface;
+  const char *mime_type;
+  int w, h, colors;
+
+  if (data == NULL) return;
+  if (cairo_pattern_get_surface(cairo_get_source(cr), &surface) != CAIRO_STATUS_SUCCESS ||
+      cairo_surface_get_type(surface) != CAIRO_SURFACE_TYPE_IMAGE)
+    { g_free(data); return; }
+  if (jpeg_image_size((const guchar *)data, len, &w, &h, &colors))
+    mime_type = CAIRO_MIME_TYPE_JPEG;
+  else if (png_image_size((const guchar *)data, len, &w, &h))
+    mime_type = CAIRO_MIME_TYPE_PNG;
+  else { g_free(data); return; }
+  if (w != cairo_image_surface_get_width(surface) || h != cairo_image_surface_get_height(surface))
+    { g_free(data); return; }
+  cairo_surface_set_mime_data(surface, mime_type, (unsigned char *)data, len, g_free, data);
+#else
+  g_free(data);
+#endif
+}
+
 void print_background(cairo_t *cr, struct Page *pg)
 {
   double x, y;
@@ -1579,6 +2759,8 @@ void print_background(cairo_t *cr, struct Page *pg)
   PopplerPage *pdfpage;
   cairo_surface_t *cr_pixbuf;
   double pgwidth, pgheight;
+  gchar *data;
+  gsize len;
 
   if (pg->bg->type == BG_SOLID) {
     cairo_set_source_rgb(cr, RGBA_RGB(pg->bg->color_rgba));
@@ -1631,15 +2813,17 @@ void print_background(cairo_t *cr, struct Page *pg)
     cairo_scale(cr, pg->width/gdk_pixbuf_get_width(pg->bg->pixbuf),
                     pg->height/gdk_pixbuf_get_height(pg->bg->pixbuf));
     gdk_cairo_set_source_pixbuf(cr, pg->bg->pixbuf, 0, 0);
+    if (read_bg_source(pg->bg, &data, &len)) set_source_encoded_data(cr, data, len);
     cairo_rectangle(cr, 0, 0, gdk_pixbuf_get_width(pg->bg->pixbuf), gdk_pixbuf_get_height(pg->bg->pixbuf));
     cairo_fill(cr);
     cairo_restore(cr);
   }
 }
 
-void print_page_to_cairo(cairo_t *cr, struct Page *pg, gdouble width, gdouble height, PangoLayout *layout, GList *end_layer)
+// draw the items of the layers up to end_layer
+
+void print_layers_to_cairo(cairo_t *cr, GList *layers, GList *end_layer, LayoutCache *layouts)
 {
-  gdouble scale;
   guint old_rgba;
   double old_thickness;
   GList *layerlist, *itemlist;
@@ -1647,21 +2831,12 @@ void print_page_to_cairo(cairo_t *cr, struct Page *pg, gdouble width, gdouble he
   struct Item *item;
   int i;
   double *pt;
-  PangoFontDescription *font_desc;
-
-  scale = MIN(width/pg->width, height/pg->height);
-  cairo_translate(cr, (width-scale*pg->width)/2, (height-scale*pg->height)/2);
-  cairo_scale(cr, scale, scale);
-  cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
-  cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
-  
-  print_background(cr, pg);
 
   old_rgba = predef_colors_rgba[COLOR_BLACK];
   cairo_set_source_rgb(cr, 0, 0, 0);
   old_thickness = 0.0;
 
-  for (layerlist = pg->layers; layerlist!=end_layer; layerlist = layerlist->next) {
+  for (layerlist = layers; layerlist!=end_layer; layerlist = layerlist->next) {
     l = (struct Layer *)layerlist->data;
     for (itemlist = l->items; itemlist!=NULL; itemlist = itemlist->next) {
       item = (struct Item *)itemlist->data;
@@ -1682,59 +2857,21 @@ void print_page_to_cairo(cairo_t *cr, struct Page *pg, gdouble width, gdouble he
           cairo_stroke(cr);
           old_thickness = item->brush.thickness;
         } else {
-          double wmin, wmax;
-          int j, j0;
-          j0 = 0;
-
-          while (j0 < item->path->num_points - 1) {
-            wmin = wmax = item->widths[j0];
-            j = j0 + 1;
-            while (j < item->path->num_points &&
-                   item->widths[j] < wmin * LINE_WIDTH_PRECISION &&
-                   item->widths[j] * LINE_WIDTH_PRECISION > wmax) {
-              if (item->widths[j] < wmin) wmin = item->widths[j];
-              if (item->widths[j] > wmax) wmax = item->widths[j];
-              j++;
-            }
-
-            if (j0 < j - 1) {
-              /* draw from j0 to j-1 */
-              cairo_set_line_width(cr, (wmin + wmax) / 2);
-              cairo_move_to(cr, pt[2*j0], pt[2*j0+1]);
-              for (i = j0 + 1; i <= j - 1; i++) {
-                cairo_line_to(cr, pt[2*i], pt[2*i+1]);
-              }
-              cairo_stroke(cr);
-              j0 = j - 1;
-            } else { /* j == j0+1; draw trapeze from j0 to j... including the discs */
-              double angle = atan2(pt[2*j+1]-pt[2*j0+1], pt[2*j]-pt[2*j0]);
-              /* The following it not perfect if the two line widths differ a lot... */
-              cairo_new_path(cr);
-              cairo_arc(cr, pt[2*j0], pt[2*j0 + 1], item->widths[j0]/2, angle + M_PI / 2, angle - M_PI / 2);
-              cairo_arc(cr, pt[2*j], pt[2*j + 1], item->widths[j]/2, angle - M_PI / 2, angle + M_PI / 2);
-              cairo_fill(cr);
-              j0 = j;
-            }
-          }
+          xo_stroke_fill_outline(cr, item);
           old_thickness = 0.0;
         }
       }
       if (item->type == ITEM_TEXT) {
-        font_desc = pango_font_description_from_string(item->font_name);
-        if (item->font_size)
-          pango_font_description_set_absolute_size(font_desc,
-            item->font_size*PANGO_SCALE);
-        pango_layout_set_font_description(layout, font_desc);
-        pango_font_description_free(font_desc);
-        pango_layout_set_text(layout, item->text, -1);
         cairo_move_to(cr, item->bbox.left, item->bbox.top);
-        pango_cairo_show_layout(cr, layout);
+        pango_cairo_show_layout(cr, layout_cache_get(layouts, item));
       }
       if (item->type == ITEM_IMAGE) {
         double scalex = (item->bbox.right-item->bbox.left)/gdk_pixbuf_get_width(item->image);
         double scaley = (item->bbox.bottom-item->bbox.top)/gdk_pixbuf_get_height(item->image);
         cairo_scale(cr, scalex, scaley);
         gdk_cairo_set_source_pixbuf(cr,item->image, item->bbox.left/scalex, item->bbox.top/scaley);
+        set_source_encoded_data(cr, g_memdup(item->image_png, item->image_png_len),
+                                item->image_png_len);
         cairo_scale(cr, 1/scalex, 1/scaley);
         cairo_paint(cr);
         old_rgba = predef_colors_rgba[COLOR_BLACK];
@@ -1744,22 +2881,105 @@ void print_page_to_cairo(cairo_t *cr, struct Page *pg, gdouble width, gdouble he
   }
 }
 
+void print_page_to_cairo(cairo_t *cr, struct Page *pg, gdouble width, gdouble height, LayoutCache *layouts, GList *end_layer)
+{
+  gdouble scale;
+
+  scale = MIN(width/pg->width, height/pg->height);
+  cairo_translate(cr, (width-scale*pg->width)/2, (height-scale*pg->height)/2);
+  cairo_scale(cr, scale, scale);
+  cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+  cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+  
+  print_background(cr, pg);
+  print_layers_to_cairo(cr, pg->layers, end_layer, layouts);
+}
+
 #if GTK_CHECK_VERSION(2, 10, 0)
 
+static LayoutCache print_job_layouts = {NULL, NULL}; // for all the pages of a print job
+
 void print_job_render_page(GtkPrintOperation *print, GtkPrintContext *context, gint pageno, gpointer user_data)
 {
   cairo_t *cr;
   gdouble width, height;
   struct Page *pg;
-  PangoLayout *layout;
+  PangoContext *pango_context;
         
   pg = (struct Page *)g_list_nth_data(journal.pages, pageno);
   cr = gtk_print_context_get_cairo_context(context);
   width = gtk_print_context_get_width(context);
   height = gtk_print_context_get_height(context);
-  layout = gtk_print_context_create_pango_layout(context);
-  print_page_to_cairo(cr, pg, width, height, layout, NULL);
-  g_object_unref(layout);
+  if (print_job_layouts.context == NULL) {
+    pango_context = gtk_print_context_create_pango_context(context);
+    layout_cache_init(&print_job_layouts, pango_context);
+    g_object_unref(pango_context);
+  }
+  print_page_to_cairo(cr, pg, width, height, &print_job_layouts, NULL);
+}
+
+void print_job_end(GtkPrintOperation *print, GtkPrintContext *context, gpointer user_data)
+{
+  layout_cache_clear(&print_job_layouts);
+}
+
+#endif
+
+// the layout cache of a cairo export, made with its first context
+
+void cairo_export_layouts(cairo_t *cr, LayoutCache *layouts)
+{
+  PangoLayout *layout;
+
+  if (layouts->context == NULL) { // one context for all the pages
+    layout = pango_cairo_create_layout(cr);
+    layout_cache_init(layouts, pango_layout_get_context(layout));
+    g_object_unref(layout);
+  }
+  else pango_cairo_update_context(cr, layouts->context);
+}
+
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+
+/* one page per layer: each layer is recorded once, and the pages of the
+   layers above it paint the recording again, which the PDF surface writes
+   as a single form XObject */
+
+void print_layers_to_pdf_cairo(cairo_surface_t *surface, struct Page *pg, LayoutCache *layouts)
+{
+  cairo_t *cr;
+  cairo_rectangle_t extents;
+  GPtrArray *recordings;
+  GList *layerlist;
+  guint i;
+
+  extents.x = extents.y = 0;
+  extents.width = pg->width;
+  extents.height = pg->height;
+  recordings = g_ptr_array_new();
+  for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next) {
+    g_ptr_array_add(recordings,
+      cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents));
+    cr = cairo_create(g_ptr_array_index(recordings, recordings->len-1));
+    cairo_export_layouts(cr, layouts);
+    cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+    cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+    print_layers_to_cairo(cr, layerlist, layerlist->next, layouts);
+    cairo_destroy(cr);
+
+    cairo_pdf_surface_set_size(surface, pg->width, pg->height);
+    cr = cairo_create(surface);
+    print_background(cr, pg);
+    for (i=0; i<recordings->len; i++) {
+      cairo_set_source_surface(cr, g_ptr_array_index(recordings, i), 0, 0);
+      cairo_paint(cr);
+    }
+    cairo_destroy(cr);
+    cairo_surface_show_page(surface);
+  }
+  for (i=0; i<recordings->len; i++)
+    cairo_surface_destroy(g_ptr_array_index(recordings, i));
+  g_ptr_array_free(recordings, TRUE);
 }
 
 #endif
@@ -1770,26 +2990,33 @@ gboolean print_to_pdf_cairo(char *filename)
   cairo_surface_t *surface;
   struct Page *pg;
   GList *list;
-  PangoLayout *layout;
+  LayoutCache layouts;
   cairo_status_t retval;
   GList *last_layer;
  
+  layouts.context = NULL;
   surface = cairo_pdf_surface_create(filename, ui.default_page.width, ui.default_page.height);
   for (list = journal.pages; list!=NULL; list = list->next) {
     pg = (struct Page *)list->data;
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+    if (ui.exportpdf_layers && pg->layers != NULL) {
+      print_layers_to_pdf_cairo(surface, pg, &layouts);
+      continue;
+    }
+#endif
     if (ui.exportpdf_layers) last_layer = pg->layers; else last_layer = NULL;
     do {
       if (last_layer!=NULL) last_layer = last_layer->next;
       cairo_pdf_surface_set_size(surface, pg->width, pg->height);
       cr = cairo_create(surface);
-      layout = pango_cairo_create_layout(cr);
-      print_page_to_cairo(cr, pg, pg->width, pg->height, layout, last_layer);
-      g_object_unref(layout);
+      cairo_export_layouts(cr, &layouts);
+      print_page_to_cairo(cr, pg, pg->width, pg->height, &layouts, last_layer);
       cairo_destroy(cr);
       cairo_surface_show_page(surface);
     }
     while (last_layer!=NULL);
   }
+  layout_cache_clear(&layouts);
   cairo_surface_finish(surface);
   retval = cairo_surface_status(surface);
   cairo_surface_destroy(surface);
@@ -22,6 +22,7 @@ typedef struct XrefTable {
 typedef struct PdfPageDesc {
   struct PdfObj *resources, *mediabox, *contents;
   int rotate;
+  int n_obj; // the page object, or 0 if unknown
 } PdfPageDesc;
 
 typedef struct PdfInfo {
@@ -29,6 +30,7 @@ typedef struct PdfInfo {
   struct PdfObj *trailerdict;
   int npages;
   struct PdfPageDesc *pages;
+  GString *src; // the PDF file these come from (not a copy, don't change it)
 } PdfInfo;
 
 typedef struct PdfObj {
@@ -66,9 +68,53 @@ typedef struct PdfImage {
   int n_obj_smask;              /* only if has_alpha */
   GdkPixbuf *pixbuf;
   gboolean used_in_this_page;
+  guint hash; // of the pixels, to find the images that are the same
+  gchar *png;                   /* the PNG it came from, if any (not ours) */
+  gsize png_len;
 } PdfImage;
 
 
+/* print_to_pdf() works on batches of pages: their content streams are
+   prepared in order (this numbers the objects), then the paths of the
+   strokes are drawn and the streams deflated by a pool of threads, then
+   the objects are written in order */
+
+#define PDF_EXPORT_BATCH 64 // pages prepared before they're written
+#define PDF_FLUSH_SIZE 65536 // output kept in memory before it's written to the file
+
+typedef struct PdfSegment {
+  GString *text; // a piece of content stream, or else
+  struct Item *stroke; // the path of a stroke, drawn by a worker
+} PdfSegment;
+
+typedef struct PdfPageJob {
+  struct Page *pg;
+  int n_page; // which page object
+  int n_obj_prefix, n_obj_bgpix; // the object drawn in objs, if any
+  GString *objs; // written before the content stream; xref offsets relative to it
+  GArray *segments; // the content stream, to be put together by a worker
+  GString *zstream; // the deflated content stream
+  int n_obj_stream;
+  gboolean use_hiliter, has_images;
+  GList *fonts, *images; // those used on this page
+  gboolean is_form; // a layer, written as a form XObject instead of a page
+  GArray *forms; // the layer forms that the page shows, if any
+} PdfPageJob;
+
+/* the shaped layouts of text items, keyed by font, size and text, so that
+   text that repeats is only laid out once. They belong to one context. */
+
+#define LAYOUT_CACHE_SIZE 1000 // start over beyond this many layouts
+
+typedef struct LayoutCache {
+  PangoContext *context;
+  GHashTable *layouts;
+} LayoutCache;
+
+void layout_cache_init(LayoutCache *cache, PangoContext *context);
+PangoLayout *layout_cache_get(LayoutCache *cache, struct Item *item);
+void layout_cache_clear(LayoutCache *cache);
+
 #define PDFTYPE_CST 0    // intval: true=1, false=0, null=-1
 #define PDFTYPE_INT 1    // intval
 #define PDFTYPE_REAL 2   // realval
@@ -92,6 +138,11 @@ gboolean pdf_parse_info(GString *pdfbuf, struct PdfInfo *pdfinfo, struct XrefTab
 gboolean print_to_pdf(char *filename);
 gboolean print_to_pdf_cairo(char *filename);
 
+#define BENCHMARK_PDF_ITERATIONS 5 // times each page is drawn by --benchmark-pdf
+
+void pdf_stream_benchmark(int iterations);
+
 #if GTK_CHECK_VERSION(2, 10, 0)
 void print_job_render_page(GtkPrintOperation *print, GtkPrintContext *context, gint pageno, gpointer user_data);
+void print_job_end(GtkPrintOperation *print, GtkPrintContext *context, gpointer user_data);
 #endif
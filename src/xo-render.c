@@ -0,0 +1,376 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <gtk/gtk.h>
+#include <libgnomecanvas/libgnomecanvas.h>
+
+#include "xournal.h"
+#include "xo-misc.h"
+#include "xo-stroke.h"
+#include "xo-canvas-cache.h"
+#include "xo-render.h"
+
+static void render_set_rgba(cairo_t *cr, guint rgba)
+{
+  cairo_set_source_rgba(cr, ((rgba>>24)&0xff)/255.0, ((rgba>>16)&0xff)/255.0,
+                        ((rgba>>8)&0xff)/255.0, (rgba&0xff)/255.0);
+}
+
+/* the background, as the canvas shows it: the ruling is always drawn,
+   and PDF pages come from their bitmap rather than from poppler */
+
+static void render_background(cairo_t *cr, struct Page *pg, struct BBox *dirty)
+{
+  double x, y, t = RULING_THICKNESS/2;
+  GdkPixbuf *pix;
+
+  if (pg->bg->type != BG_SOLID) {
+    pix = pg->bg->pixbuf;
+    if (pix == NULL) return; // PDF page not rendered yet: the canvas shows nothing either
+    cairo_save(cr);
+    cairo_scale(cr, pg->width/gdk_pixbuf_get_width(pix), pg->height/gdk_pixbuf_get_height(pix));
+    gdk_cairo_set_source_pixbuf(cr, pix, 0, 0);
+    cairo_paint(cr);
+    cairo_restore(cr);
+    return;
+  }
+
+  render_set_rgba(cr, pg->bg->color_rgba);
+  cairo_rectangle(cr, 0, 0, pg->width, pg->height);
+  cairo_fill(cr);
+  if (pg->bg->ruling == RULING_NONE) return;
+
+  // same rules as XoCanvasRuling, as filled rectangles (no caps), dirty ones only
+  render_set_rgba(cr, RULING_COLOR);
+  if (pg->bg->ruling == RULING_GRAPH) {
+    for (x = RULING_GRAPHSPACING; x < pg->width-1; x += RULING_GRAPHSPACING)
+      if (x+t > dirty->left && x-t < dirty->right)
+        cairo_rectangle(cr, x-t, 0, 2*t, pg->height);
+    for (y = RULING_GRAPHSPACING; y < pg->height-1; y += RULING_GRAPHSPACING)
+      if (y+t > dirty->top && y-t < dirty->bottom)
+        cairo_rectangle(cr, 0, y-t, pg->width, 2*t);
+    cairo_fill(cr);
+    return;
+  }
+  for (y = RULING_TOPMARGIN; y < pg->height-1; y += RULING_SPACING)
+    if (y+t > dirty->top && y-t < dirty->bottom)
+      cairo_rectangle(cr, 0, y-t, pg->width, 2*t);
+  cairo_fill(cr);
+  if (pg->bg->ruling == RULING_LINED) {
+    render_set_rgba(cr, RULING_MARGIN_COLOR);
+    cairo_rectangle(cr, RULING_LEFTMARGIN-t, 0, 2*t, pg->height);
+    cairo_fill(cr);
+  }
+}
+
+/* the item bbox of strokes is that of their points: widen it by
+   the half-width of the ink before testing it against the dirty area */
+
+static gboolean render_item_is_dirty(struct Item *item, struct BBox *dirty)
+{
+  struct BBox box;
+  double margin;
+  int i;
+
+  box = item->bbox;
+  if (item->type == ITEM_STROKE) {
+    margin = item->brush.thickness;
+    if (item->brush.variable_width)
+      for (i = 0; i < item->path->num_points; i++)
+        margin = MAX(margin, item->widths[i]);
+    box.left -= margin/2; box.right += margin/2;
+    box.top -= margin/2; box.bottom += margin/2;
+  }
+  return have_intersect(&box, dirty);
+}
+
+static void render_item(cairo_t *cr, struct Item *item, PangoLayout *layout)
+{
+  PangoFontDescription *font_desc;
+  double *pt, scalex, scaley;
+  int i;
+
+  if (item->type == ITEM_STROKE) {
+    render_set_rgba(cr, item->brush.color_rgba);
+    if (item->brush.variable_width) { xo_stroke_fill_outline(cr, item); return; }
+    pt = item->path->coords;
+    cairo_set_line_width(cr, item->brush.thickness);
+    cairo_move_to(cr, pt[0], pt[1]);
+    for (i = 1, pt += 2; i < item->path->num_points; i++, pt += 2)
+      cairo_line_to(cr, pt[0], pt[1]);
+    cairo_stroke(cr);
+  }
+  else if (item->type == ITEM_TEXT) {
+    render_set_rgba(cr, item->brush.color_rgba);
+    font_desc = pango_font_description_from_string(item->font_name);
+    pango_font_description_set_absolute_size(font_desc, item->font_size*PANGO_SCALE);
+    pango_layout_set_font_description(layout, font_desc);
+    pango_font_description_free(font_desc);
+    pango_layout_set_text(layout, item->text, -1);
+    cairo_move_to(cr, item->bbox.left, item->bbox.top);
+    pango_cairo_show_layout(cr, layout);
+  }
+  else if (item->type == ITEM_IMAGE) {
+    scalex = (item->bbox.right-item->bbox.left)/gdk_pixbuf_get_width(item->image);
+    scaley = (item->bbox.bottom-item->bbox.top)/gdk_pixbuf_get_height(item->image);
+    cairo_save(cr);
+    cairo_translate(cr, item->bbox.left, item->bbox.top);
+    cairo_scale(cr, scalex, scaley);
+    gdk_cairo_set_source_pixbuf(cr, item->image, 0, 0);
+    cairo_paint(cr);
+    cairo_restore(cr);
+  }
+}
+
+/* draw the background and the first nlayers layers of a page, in page
+   coordinates, restricted to the dirty area (the whole page if NULL).
+   Layers whose canvas group is hidden are skipped, as on screen, unless
+   a raster cache hid them. */
+
+void xo_render_page(cairo_t *cr, struct Page *pg, int nlayers, struct BBox *dirty)
+{
+  struct BBox all;
+  GList *layerlist, *itemlist;
+  struct Layer *l;
+  struct Item *item;
+  PangoLayout *layout;
+  int n;
+
+  if (dirty == NULL) {
+    all.left = all.top = 0.;
+    all.right = pg->width; all.bottom = pg->height;
+    dirty = &all;
+  }
+  cairo_save(cr);
+  cairo_rectangle(cr, dirty->left, dirty->top, dirty->right-dirty->left, dirty->bottom-dirty->top);
+  cairo_clip(cr);
+  cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+  cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+
+  render_background(cr, pg, dirty);
+
+  layout = pango_cairo_create_layout(cr);
+  for (layerlist = pg->layers, n = 0; layerlist != NULL && n < nlayers;
+       layerlist = layerlist->next, n++) {
+    l = (struct Layer *)layerlist->data;
+    if (l->group != NULL &&
+        !(GNOME_CANVAS_ITEM(l->group)->object.flags & GNOME_CANVAS_ITEM_VISIBLE) &&
+        g_object_get_data(G_OBJECT(l->group), XO_CANVAS_CACHE_HIDDEN_KEY) == NULL) continue;
+    for (itemlist = l->items; itemlist != NULL; itemlist = itemlist->next) {
+      item = (struct Item *)itemlist->data;
+      if (render_item_is_dirty(item, dirty)) render_item(cr, item, layout);
+    }
+  }
+  g_object_unref(layout);
+  cairo_restore(cr);
+}
+
+/* render into an RGB buffer covering canvas pixels [x0,x1)x[y0,y1),
+   with the page-to-canvas affine, over the canvas background color;
+   only the items meeting that rectangle get drawn */
+
+void xo_render_page_to_rgb(struct Page *pg, int nlayers, double *affine,
+                           guchar *pixels, int rowstride, int x0, int y0, int x1, int y1,
+                           guint32 bg_color)
+{
+  cairo_surface_t *surface;
+  cairo_t *cr;
+  cairo_matrix_t matrix;
+  ArtDRect pixrect, rect;
+  double inverse[6];
+  struct BBox dirty;
+  guint32 *src;
+  guchar *dst;
+  int x, y, stride;
+
+  surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, x1-x0, y1-y0);
+  cr = cairo_create(surface);
+  cairo_set_source_rgb(cr, ((bg_color>>16)&0xff)/255.0, ((bg_color>>8)&0xff)/255.0,
+                       (bg_color&0xff)/255.0);
+  cairo_paint(cr);
+  cairo_matrix_init(&matrix, affine[0], affine[1], affine[2], affine[3],
+                    affine[4]-x0, affine[5]-y0);
+  cairo_set_matrix(cr, &matrix);
+  // the dirty area is the buffer, in page coordinates
+  pixrect.x0 = x0; pixrect.y0 = y0; pixrect.x1 = x1; pixrect.y1 = y1;
+  art_affine_invert(inverse, affine);
+  art_drect_affine_transform(&rect, &pixrect, inverse);
+  dirty.left = rect.x0; dirty.top = rect.y0;
+  dirty.right = rect.x1; dirty.bottom = rect.y1;
+  xo_render_page(cr, pg, nlayers, &dirty);
+  cairo_destroy(cr);
+
+  cairo_surface_flush(surface);
+  stride = cairo_image_surface_get_stride(surface);
+  for (y = 0; y < y1-y0; y++) {
+    src = (guint32 *)(cairo_image_surface_get_data(surface) + y*stride);
+    dst = pixels + y*rowstride;
+    for (x = 0; x < x1-x0; x++, dst += 3) {
+      dst[0] = (src[x]>>16) & 0xff;
+      dst[1] = (src[x]>>8) & 0xff;
+      dst[2] = src[x] & 0xff;
+    }
+  }
+  cairo_surface_destroy(surface);
+}
+
+// --benchmark-render: compare the canvas item tree with the direct renderer
+
+// the canvas items in a tree, and the resident memory (-1 if unknown), also for --benchmark-view
+
+int xo_render_count_items(GnomeCanvasItem *item)
+{
+  GList *list;
+  int count = 1;
+
+  if (GNOME_IS_CANVAS_GROUP(item))
+    for (list = GNOME_CANVAS_GROUP(item)->item_list; list != NULL; list = list->next)
+      count += xo_render_count_items(GNOME_CANVAS_ITEM(list->data));
+  return count;
+}
+
+long xo_render_resident_kb(void)
+{
+#ifndef WIN32
+  FILE *f;
+  long size, resident;
+
+  f = fopen("/proc/self/statm", "r");
+  if (f == NULL) return -1;
+  if (fscanf(f, "%ld %ld", &size, &resident) != 2) resident = -1;
+  fclose(f);
+  if (resident >= 0) return resident * (sysconf(_SC_PAGESIZE)/1024);
+#endif
+  return -1;
+}
+
+static void render_canvas_item(GnomeCanvasItem *item, GnomeCanvasBuf *buf)
+{
+  if (item != NULL && (item->object.flags & GNOME_CANVAS_ITEM_VISIBLE) &&
+      GNOME_CANVAS_ITEM_GET_CLASS(item)->render != NULL)
+    GNOME_CANVAS_ITEM_GET_CLASS(item)->render(item, buf);
+}
+
+static void render_canvas_page(struct Page *pg, GnomeCanvasBuf *buf)
+{
+  GList *layerlist;
+
+  render_canvas_item(pg->bg->canvas_item, buf);
+  for (layerlist = pg->layers; layerlist != NULL; layerlist = layerlist->next)
+    render_canvas_item(GNOME_CANVAS_ITEM(((struct Layer *)layerlist->data)->group), buf);
+}
+
+// the canvas pixels a page covers, and its page-to-canvas affine
+
+static void render_page_rect(struct Page *pg, double *affine, int *x0, int *y0, int *x1, int *y1)
+{
+  ArtDRect page, rect;
+
+  gnome_canvas_item_i2c_affine(GNOME_CANVAS_ITEM(pg->group), affine);
+  page.x0 = 0.; page.y0 = 0.; page.x1 = pg->width; page.y1 = pg->height;
+  art_drect_affine_transform(&rect, &page, affine);
+  *x0 = (int)floor(rect.x0); *y0 = (int)floor(rect.y0);
+  *x1 = (int)ceil(rect.x1); *y1 = (int)ceil(rect.y1);
+}
+
+/* time each renderer over every page, in turn, and how much resident
+   memory it takes on top of what's already there */
+
+static void render_benchmark_pass(gboolean use_canvas, int iterations, double *t, long *kb)
+{
+  GList *pglist;
+  struct Page *pg;
+  GnomeCanvasBuf buf;
+  double affine[6];
+  guchar *pixels;
+  GTimer *timer;
+  long rss0, rss;
+  int i, x0, y0, x1, y1;
+
+  timer = g_timer_new();
+  *t = 0.;
+  rss0 = *kb = xo_render_resident_kb();
+  for (i = 0; i < iterations; i++)
+    for (pglist = journal.pages; pglist != NULL; pglist = pglist->next) {
+      pg = (struct Page *)pglist->data;
+      if (pg->group == NULL) continue;
+      render_page_rect(pg, affine, &x0, &y0, &x1, &y1);
+      pixels = g_malloc(3*(x1-x0)*(y1-y0));
+      g_timer_start(timer);
+      if (use_canvas) {
+        buf.buf = pixels;
+        buf.buf_rowstride = 3*(x1-x0);
+        buf.rect.x0 = x0; buf.rect.y0 = y0; buf.rect.x1 = x1; buf.rect.y1 = y1;
+        buf.bg_color = 0xffffff;
+        buf.is_bg = 1;
+        buf.is_buf = 0;
+        render_canvas_page(pg, &buf);
+        gnome_canvas_buf_ensure_buf(&buf);
+      }
+      else
+        xo_render_page_to_rgb(pg, pg->nlayers, affine, pixels, 3*(x1-x0), x0, y0, x1, y1, 0xffffff);
+      *t += g_timer_elapsed(timer, NULL);
+      rss = xo_render_resident_kb();
+      if (rss > *kb) *kb = rss; // the peak, pixels included
+      g_free(pixels);
+    }
+  g_timer_destroy(timer);
+  *kb = (rss0 >= 0) ? *kb - rss0 : -1;
+}
+
+void xo_render_benchmark(int iterations)
+{
+  GList *pglist, *layerlist;
+  double t_canvas, t_cairo;
+  long kb_canvas, kb_cairo;
+  gboolean raster_cache;
+  int npages, nitems, njournal;
+
+  // a raster cache hides the layers it covers from the canvas renderer
+  raster_cache = ui.raster_cache;
+  ui.raster_cache = FALSE;
+  xo_canvas_cache_reset();
+  gnome_canvas_update_now(canvas);
+
+  nitems = xo_render_count_items(GNOME_CANVAS_ITEM(gnome_canvas_root(canvas)));
+  njournal = npages = 0;
+  for (pglist = journal.pages; pglist != NULL; pglist = pglist->next) {
+    if (((struct Page *)pglist->data)->group != NULL) npages += iterations;
+    for (layerlist = ((struct Page *)pglist->data)->layers; layerlist != NULL; layerlist = layerlist->next)
+      njournal += ((struct Layer *)layerlist->data)->nitems;
+  }
+  printf("pages: %d, journal items: %d, canvas items: %d, resident memory: %ld kB\n",
+         journal.npages, njournal, nitems, xo_render_resident_kb());
+
+  render_benchmark_pass(TRUE, iterations, &t_canvas, &kb_canvas);
+  render_benchmark_pass(FALSE, iterations, &t_cairo, &kb_cairo);
+
+  printf("zoom %.2f, %d page renders each\n", ui.zoom, npages);
+  printf("canvas items: %.3f s, %.1f pages/s, resident memory +%ld kB\n", t_canvas,
+         (t_canvas > 0.) ? npages/t_canvas : 0., kb_canvas);
+  printf("cairo:        %.3f s, %.1f pages/s, resident memory +%ld kB\n", t_cairo,
+         (t_cairo > 0.) ? npages/t_cairo : 0., kb_cairo);
+
+  ui.raster_cache = raster_cache;
+  xo_canvas_cache_schedule();
+}
@@ -0,0 +1,37 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XO_RENDER_H
+#define XO_RENDER_H
+
+#include <cairo.h>
+#include <libgnomecanvas/libgnomecanvas.h>
+
+/* Screen rendering of pages straight from the journal (pages -> layers ->
+   items) with cairo, without going through canvas items. Only the items
+   whose bounding box meets the dirty area get drawn. */
+
+void xo_render_page(cairo_t *cr, struct Page *pg, int nlayers, struct BBox *dirty);
+void xo_render_page_to_rgb(struct Page *pg, int nlayers, double *affine,
+                           guchar *pixels, int rowstride, int x0, int y0, int x1, int y1,
+                           guint32 bg_color);
+
+#define BENCHMARK_RENDER_ITERATIONS 5 // times each page is rendered by --benchmark-render
+
+void xo_render_benchmark(int iterations);
+int xo_render_count_items(GnomeCanvasItem *item);
+long xo_render_resident_kb(void);
+
+#endif /* XO_RENDER_H */
@@ -22,12 +22,11 @@
 #include <gtk/gtk.h>
 #include <libgnomecanvas/libgnomecanvas.h>
 #include <libart_lgpl/art_vpath_dash.h>
-#include <libart_lgpl/art_svp_point.h>
-#include <libart_lgpl/art_svp_vpath.h>
 
 #include "xournal.h"
 #include "xo-callbacks.h"
 #include "xo-misc.h"
+#include "xo-canvas-cache.h"
 #include "xo-paint.h"
 #include "xo-selection.h"
 
@@ -56,6 +55,7 @@ void start_selectrect(GdkEvent *event)
   ui.selection->type = ITEM_SELECTRECT;
   ui.selection->items = NULL;
   ui.selection->layer = ui.cur_layer;
+  ui.selection->preview_group = NULL;
 
   get_pointer_coords(event, pt);
   ui.selection->bbox.left = ui.selection->bbox.right = pt[0];
@@ -129,6 +129,7 @@ void start_selectregion(GdkEvent *event)
   ui.selection->type = ITEM_SELECTREGION;
   ui.selection->items = NULL;
   ui.selection->layer = ui.cur_layer;
+  ui.selection->preview_group = NULL;
 
   get_pointer_coords(event, pt);
   ui.selection->bbox.left = ui.selection->bbox.right = pt[0];
@@ -158,64 +159,158 @@ void continue_selectregion(GdkEvent *event)
   if (hypot(pt[0]-pt[-2], pt[1]-pt[-1]) < PIXEL_MOTION_THRESHOLD/ui.zoom)
     return; // not a meaningful motion
   ui.cur_path.num_points++;
+}
+
+void update_selectregion_outline(void)
+{
   if (ui.cur_path.num_points>2)
     gnome_canvas_item_set(ui.selection->canvas_item, 
      "points", &ui.cur_path, NULL);
 }
 
-/* check whether a point, resp. an item, is inside a lasso selection */
+/* check whether a point, resp. an item, is inside a lasso selection.
+   The lasso is converted once into an edge table: its non-horizontal edges
+   are bucketed into horizontal bands, so that testing a point only counts
+   (even-odd) the crossings of the few edges that straddle its scanline. */
+
+#define LASSO_MAX_BANDS 1024
+
+typedef struct LassoEdge {
+  double ymin, ymax; // the edge covers ymin <= y < ymax
+  double x, dxdy;    // x at ymin, and slope
+} LassoEdge;
+
+typedef struct Lasso {
+  struct BBox bbox;
+  LassoEdge *edges;
+  int nbands;
+  double band_top, band_scale; // band index = (y-band_top)*band_scale
+  int *band_start; // edges of band b are band_edges[band_start[b]..band_start[b+1]-1]
+  int *band_edges;
+} Lasso;
+
+static int lasso_band(Lasso *lasso, double y)
+{
+  int b = (int)((y-lasso->band_top)*lasso->band_scale);
+  if (b<0) return 0;
+  if (b>=lasso->nbands) return lasso->nbands-1;
+  return b;
+}
+
+static Lasso *lasso_new(double *coords, int n)
+{
+  Lasso *lasso;
+  LassoEdge *e;
+  double *p, *q;
+  int i, b, nedges, *fill;
+
+  lasso = g_new(Lasso, 1);
+  lasso->bbox.left = lasso->bbox.right = coords[0];
+  lasso->bbox.top = lasso->bbox.bottom = coords[1];
+  lasso->edges = g_new(LassoEdge, n);
+  nedges = 0;
+  for (i=0; i<n; i++) {
+    p = coords+2*i;
+    q = coords+2*((i+1)%n); // the lasso is closed back to its first point
+    if (p[0]<lasso->bbox.left) lasso->bbox.left = p[0];
+    if (p[0]>lasso->bbox.right) lasso->bbox.right = p[0];
+    if (p[1]<lasso->bbox.top) lasso->bbox.top = p[1];
+    if (p[1]>lasso->bbox.bottom) lasso->bbox.bottom = p[1];
+    if (p[1] == q[1]) continue; // horizontal edges never cross a scanline
+    if (p[1] > q[1]) { double *t = p; p = q; q = t; }
+    e = lasso->edges + nedges++;
+    e->ymin = p[1]; e->ymax = q[1];
+    e->x = p[0]; e->dxdy = (q[0]-p[0])/(q[1]-p[1]);
+  }
+
+  lasso->nbands = MAX(1, MIN(nedges/2, LASSO_MAX_BANDS));
+  lasso->band_top = lasso->bbox.top;
+  if (lasso->bbox.bottom > lasso->bbox.top)
+    lasso->band_scale = lasso->nbands/(lasso->bbox.bottom-lasso->bbox.top);
+  else lasso->band_scale = 0.;
+
+  // bucket the edges into bands (counting pass, then filling pass)
+  lasso->band_start = g_new0(int, lasso->nbands+1);
+  for (i=0, e=lasso->edges; i<nedges; i++, e++)
+    for (b=lasso_band(lasso, e->ymin); b<=lasso_band(lasso, e->ymax); b++)
+      lasso->band_start[b+1]++;
+  for (b=0; b<lasso->nbands; b++)
+    lasso->band_start[b+1] += lasso->band_start[b];
+  lasso->band_edges = g_new(int, MAX(1, lasso->band_start[lasso->nbands]));
+  fill = g_memdup(lasso->band_start, lasso->nbands*sizeof(int));
+  for (i=0, e=lasso->edges; i<nedges; i++, e++)
+    for (b=lasso_band(lasso, e->ymin); b<=lasso_band(lasso, e->ymax); b++)
+      lasso->band_edges[fill[b]++] = i;
+  g_free(fill);
+  return lasso;
+}
+
+static void lasso_free(Lasso *lasso)
+{
+  g_free(lasso->edges);
+  g_free(lasso->band_start);
+  g_free(lasso->band_edges);
+  g_free(lasso);
+}
 
-gboolean hittest_point(ArtSVP *lassosvp, double x, double y)
+static gboolean hittest_point(Lasso *lasso, double x, double y)
 {
-  return art_svp_point_wind(lassosvp, x, y)%2;
+  LassoEdge *e;
+  int *idx, *end, b;
+  gboolean inside;
+
+  if (x<lasso->bbox.left || x>lasso->bbox.right || 
+      y<lasso->bbox.top || y>lasso->bbox.bottom) return FALSE;
+  b = lasso_band(lasso, y);
+  end = lasso->band_edges + lasso->band_start[b+1];
+  inside = FALSE;
+  for (idx = lasso->band_edges + lasso->band_start[b]; idx<end; idx++) {
+    e = lasso->edges + *idx;
+    if (y >= e->ymin && y < e->ymax && x < e->x + (y-e->ymin)*e->dxdy)
+      inside = !inside;
+  }
+  return inside;
 }
 
-gboolean hittest_item(ArtSVP *lassosvp, struct Item *item)
+static gboolean hittest_item(Lasso *lasso, struct Item *item)
 {
   int i;
+  double *pt;
   
+  // quick rejection: the item must at least meet the lasso's bounding box
+  if (!have_intersect(&lasso->bbox, &item->bbox)) return FALSE;
+
   if (item->type == ITEM_STROKE) {
-    for (i=0; i<item->path->num_points; i++)
-      if (!hittest_point(lassosvp, item->path->coords[2*i], item->path->coords[2*i+1])) 
+    for (i=0, pt=item->path->coords; i<item->path->num_points; i++, pt+=2)
+      if (!hittest_point(lasso, pt[0], pt[1])) 
         return FALSE;
     return TRUE;
   }
   else 
-    return (hittest_point(lassosvp, item->bbox.left, item->bbox.top) &&
-            hittest_point(lassosvp, item->bbox.right, item->bbox.top) &&
-            hittest_point(lassosvp, item->bbox.left, item->bbox.bottom) &&
-            hittest_point(lassosvp, item->bbox.right, item->bbox.bottom));
+    return (hittest_point(lasso, item->bbox.left, item->bbox.top) &&
+            hittest_point(lasso, item->bbox.right, item->bbox.top) &&
+            hittest_point(lasso, item->bbox.left, item->bbox.bottom) &&
+            hittest_point(lasso, item->bbox.right, item->bbox.bottom));
 }
 
 void finalize_selectregion(void)
 {
   GList *itemlist;
   struct Item *item;
-  ArtVpath *vpath;
-  ArtSVP *lassosvp;
+  Lasso *lasso;
   int i, n;
   double *pt;
   
   ui.cur_item_type = ITEM_NONE;
   
-  // build SVP for the lasso path
+  // build the edge table for the lasso path
   n = ui.cur_path.num_points;
-  vpath = g_malloc((n+2)*sizeof(ArtVpath));
-  for (i=0; i<n; i++) { 
-    vpath[i].x = ui.cur_path.coords[2*i];
-    vpath[i].y = ui.cur_path.coords[2*i+1];
-  }
-  vpath[n].x = vpath[0].x; vpath[n].y = vpath[0].y;
-  vpath[0].code = ART_MOVETO;
-  for (i=1; i<=n; i++) vpath[i].code = ART_LINETO;
-  vpath[n+1].code = ART_END;
-  lassosvp = art_svp_from_vpath(vpath);
-  g_free(vpath);
+  lasso = lasso_new(ui.cur_path.coords, n);
 
   // see which items we selected
   for (itemlist = ui.selection->layer->items; itemlist!=NULL; itemlist = itemlist->next) {
     item = (struct Item *)itemlist->data;
-    if (hittest_item(lassosvp, item)) {
+    if (hittest_item(lasso, item)) {
       // update the selection bbox
       if (ui.selection->items==NULL || ui.selection->bbox.left>item->bbox.left)
         ui.selection->bbox.left = item->bbox.left;
@@ -229,7 +324,7 @@ void finalize_selectregion(void)
       ui.selection->items = g_list_append(ui.selection->items, item); 
     }
   }
-  art_svp_free(lassosvp);
+  lasso_free(lasso);
 
    // expand the bounding box by some amount (medium highlighter, or 3 pixels)
   if (ui.selection->items != NULL) {
@@ -297,6 +392,7 @@ gboolean start_movesel(GdkEvent *event)
     ui.selection->move_layer = ui.selection->layer;
     ui.selection->move_pagedelta = 0.;
     gnome_canvas_item_set(ui.selection->canvas_item, "dash", NULL, NULL);
+    xo_selection_preview_start(TRUE);
     update_cursor();
     return TRUE;
   }
@@ -332,6 +428,7 @@ gboolean start_resizesel(GdkEvent *event)
     ui.selection->new_x1 = ui.selection->bbox.left;
     ui.selection->new_x2 = ui.selection->bbox.right;
     gnome_canvas_item_set(ui.selection->canvas_item, "dash", NULL, NULL);
+    xo_selection_preview_start(FALSE);
     update_cursor_for_resize(pt);
     return TRUE;
   }
@@ -351,6 +448,7 @@ void start_vertspace(GdkEvent *event)
   ui.selection->type = ITEM_MOVESEL_VERT;
   ui.selection->items = NULL;
   ui.selection->layer = ui.cur_layer;
+  ui.selection->preview_group = NULL;
 
   get_pointer_coords(event, pt);
   ui.selection->bbox.top = ui.selection->bbox.bottom = pt[1];
@@ -374,14 +472,13 @@ void start_vertspace(GdkEvent *event)
       "outline-color-rgba", 0x000000ff,
       "fill-color-rgba", 0x80808040,
       "x1", -100.0, "x2", ui.cur_page->width+100, "y1", pt[1], "y2", pt[1], NULL);
+  xo_selection_preview_start(FALSE);
   update_cursor();
 }
 
 void continue_movesel(GdkEvent *event)
 {
   double pt[2], dx, dy, upmargin;
-  GList *list;
-  struct Item *item;
   int tmppageno;
   struct Page *tmppage;
   
@@ -395,12 +492,12 @@ void continue_movesel(GdkEvent *event)
     upmargin = ui.selection->bbox.bottom - ui.selection->bbox.top;
   else upmargin = VIEW_CONTINUOUS_SKIP;
   tmppageno = ui.selection->move_pageno;
-  tmppage = g_list_nth_data(journal.pages, tmppageno);
+  tmppage = journal_page(tmppageno);
   if (ui.view_continuous == VIEW_MODE_CONTINUOUS) {
     while (pt[1] < - upmargin) {
       if (tmppageno == 0) break;
       tmppageno--;
-      tmppage = g_list_nth_data(journal.pages, tmppageno);
+      tmppage = journal_page(tmppageno);
       pt[1] += tmppage->height + VIEW_CONTINUOUS_SKIP;
       ui.selection->move_pagedelta += tmppage->height + VIEW_CONTINUOUS_SKIP;
     }
@@ -409,14 +506,14 @@ void continue_movesel(GdkEvent *event)
       pt[1] -= tmppage->height + VIEW_CONTINUOUS_SKIP;
       ui.selection->move_pagedelta -= tmppage->height + VIEW_CONTINUOUS_SKIP;
       tmppageno++;
-      tmppage = g_list_nth_data(journal.pages, tmppageno);
+      tmppage = journal_page(tmppageno);
     }
   }
   if (ui.view_continuous == VIEW_MODE_HORIZONTAL) {
     while (pt[0] < -VIEW_CONTINUOUS_SKIP) {
       if (tmppageno == 0) break;
       tmppageno--;
-      tmppage = g_list_nth_data(journal.pages, tmppageno);
+      tmppage = journal_page(tmppageno);
       pt[0] += tmppage->width + VIEW_CONTINUOUS_SKIP;
       ui.selection->move_pagedelta += tmppage->width + VIEW_CONTINUOUS_SKIP;
     }
@@ -425,7 +522,7 @@ void continue_movesel(GdkEvent *event)
       pt[0] -= tmppage->width + VIEW_CONTINUOUS_SKIP;
       ui.selection->move_pagedelta -= tmppage->width + VIEW_CONTINUOUS_SKIP;
       tmppageno++;
-      tmppage = g_list_nth_data(journal.pages, tmppageno);
+      tmppage = journal_page(tmppageno);
     }
   }
   
@@ -436,15 +533,15 @@ void continue_movesel(GdkEvent *event)
       ui.selection->move_layer = ui.selection->layer;
     else
       ui.selection->move_layer = (struct Layer *)(g_list_last(
-        ((struct Page *)g_list_nth_data(journal.pages, tmppageno))->layers)->data);
-    gnome_canvas_item_reparent(ui.selection->canvas_item, ui.selection->move_layer->group);
-    for (list = ui.selection->items; list!=NULL; list = list->next) {
-      item = (struct Item *)list->data;
-      if (item->canvas_item!=NULL)
-        gnome_canvas_item_reparent(item->canvas_item, ui.selection->move_layer->group);
-    }
+        ((struct Page *)journal_page(tmppageno))->layers)->data);
+    gnome_canvas_item_reparent(GNOME_CANVAS_ITEM(ui.selection->preview_group),
+                               ui.selection->move_layer->group);
+    if (ui.cur_item_type == ITEM_MOVESEL_VERT) // otherwise the box is in the preview group
+      gnome_canvas_item_reparent(ui.selection->canvas_item, ui.selection->move_layer->group);
     // avoid a refresh bug
     gnome_canvas_item_move(GNOME_CANVAS_ITEM(ui.selection->move_layer->group), 0., 0.);
+    // the raster cache may be hiding the layer the selection went into
+    xo_canvas_cache_schedule();
     if (ui.cur_item_type == ITEM_MOVESEL_VERT)
       gnome_canvas_item_set(ui.selection->canvas_item,
         "x2", tmppage->width+100, 
@@ -460,22 +557,37 @@ void continue_movesel(GdkEvent *event)
   ui.selection->last_x = pt[0];
   ui.selection->last_y = pt[1];
 
-  // move the canvas items
+  // move the canvas items (all at once, via the preview group)
   if (ui.cur_item_type == ITEM_MOVESEL_VERT)
     gnome_canvas_item_set(ui.selection->canvas_item, "y2", pt[1], NULL);
-  else 
-    gnome_canvas_item_move(ui.selection->canvas_item, dx, dy);
-  
-  for (list = ui.selection->items; list != NULL; list = list->next) {
-    item = (struct Item *)list->data;
-    if (item->canvas_item != NULL)
-      gnome_canvas_item_move(item->canvas_item, dx, dy);
-  }
+  gnome_canvas_item_move(GNOME_CANVAS_ITEM(ui.selection->preview_group), dx, dy);
+}
+
+#define SCALING_EPSILON 0.001
+
+/* the affine transformation taking the selection bbox to the new box:
+   scaling by affine[0], affine[3], then offset by affine[4], affine[5] */
+
+static void get_resizesel_affine(double *affine)
+{
+  double scaling_x, scaling_y;
+
+  scaling_x = (ui.selection->new_x2 - ui.selection->new_x1) / 
+              (ui.selection->bbox.right - ui.selection->bbox.left);
+  scaling_y = (ui.selection->new_y2 - ui.selection->new_y1) /
+              (ui.selection->bbox.bottom - ui.selection->bbox.top);
+  // couldn't undo a resize-by-zero...
+  if (fabs(scaling_x)<SCALING_EPSILON) scaling_x = SCALING_EPSILON;
+  if (fabs(scaling_y)<SCALING_EPSILON) scaling_y = SCALING_EPSILON;
+  affine[0] = scaling_x; affine[1] = 0.;
+  affine[2] = 0.; affine[3] = scaling_y;
+  affine[4] = ui.selection->new_x1 - ui.selection->bbox.left * scaling_x;
+  affine[5] = ui.selection->new_y1 - ui.selection->bbox.top * scaling_y;
 }
 
 void continue_resizesel(GdkEvent *event)
 {
-  double pt[2];
+  double pt[2], affine[6];
 
   get_pointer_coords(event, pt);
 
@@ -487,12 +599,18 @@ void continue_resizesel(GdkEvent *event)
   gnome_canvas_item_set(ui.selection->canvas_item, 
     "x1", ui.selection->new_x1, "x2", ui.selection->new_x2,
     "y1", ui.selection->new_y1, "y2", ui.selection->new_y2, NULL);
+
+  // preview: just transform the group, items get rebuilt at pen-up
+  get_resizesel_affine(affine);
+  gnome_canvas_item_affine_absolute(GNOME_CANVAS_ITEM(ui.selection->preview_group), affine);
 }
 
 void finalize_movesel(void)
 {
-  GList *list, *link;
-  
+  // bake the preview translation into the canvas items
+  xo_selection_preview_end(ui.selection->last_x - ui.selection->anchor_x,
+                           ui.selection->last_y - ui.selection->anchor_y);
+
   if (ui.selection->items != NULL) {
     prepare_new_undo();
     undo->type = ITEM_MOVESEL;
@@ -501,17 +619,15 @@ void finalize_movesel(void)
     undo->val_y = ui.selection->last_y - ui.selection->anchor_y;
     undo->layer = ui.selection->layer;
     undo->layer2 = ui.selection->move_layer;
-    undo->auxlist = NULL;
-    // build auxlist = pointers to Item's just before ours (for depths)
-    for (list = ui.selection->items; list!=NULL; list = list->next) {
-      link = g_list_find(ui.selection->layer->items, list->data);
-      if (link!=NULL) link = link->prev;
-      undo->auxlist = g_list_append(undo->auxlist, ((link!=NULL) ? link->data : NULL));
-    }
+    // auxlist = pointers to Item's just before ours (for depths)
+    undo->auxlist = xo_layer_item_depths(ui.selection->layer, ui.selection->items);
     ui.selection->layer = ui.selection->move_layer;
+    /* within a layer the item order doesn't change, only the canvas stacking
+       (the preview raised the selection to the top); restack in one pass */
     move_journal_items_by(undo->itemlist, undo->val_x, undo->val_y,
-                          undo->layer, undo->layer2, 
-                          (undo->layer == undo->layer2)?undo->auxlist:NULL);
+                          undo->layer, undo->layer2, NULL);
+    if (undo->layer == undo->layer2)
+      xo_layer_restack_canvas_items(undo->layer);
   }
 
   if (ui.selection->move_pageno!=ui.selection->orig_pageno) 
@@ -534,26 +650,19 @@ void finalize_movesel(void)
       "y1", ui.selection->bbox.top, "y2", ui.selection->bbox.bottom, NULL);
   }
   ui.cur_item_type = ITEM_NONE;
+  xo_canvas_cache_schedule(); // the target page's cache may cover all its layers again
   update_cursor();
 }
 
-#define SCALING_EPSILON 0.001
-
 void finalize_resizesel(void)
 {
-  struct Item *item;
+  double affine[6], offset_x, offset_y, scaling_x, scaling_y;
 
   // build the affine transformation
-  double offset_x, offset_y, scaling_x, scaling_y;
-  scaling_x = (ui.selection->new_x2 - ui.selection->new_x1) / 
-              (ui.selection->bbox.right - ui.selection->bbox.left);
-  scaling_y = (ui.selection->new_y2 - ui.selection->new_y1) /
-              (ui.selection->bbox.bottom - ui.selection->bbox.top);
-  // couldn't undo a resize-by-zero...
-  if (fabs(scaling_x)<SCALING_EPSILON) scaling_x = SCALING_EPSILON;
-  if (fabs(scaling_y)<SCALING_EPSILON) scaling_y = SCALING_EPSILON;
-  offset_x = ui.selection->new_x1 - ui.selection->bbox.left * scaling_x;
-  offset_y = ui.selection->new_y1 - ui.selection->bbox.top * scaling_y;
+  get_resizesel_affine(affine);
+  scaling_x = affine[0]; scaling_y = affine[3];
+  offset_x = affine[4]; offset_y = affine[5];
+  xo_selection_preview_end(0., 0.);
 
   if (ui.selection->items != NULL) {
     // create the undo information
@@ -567,8 +676,9 @@ void finalize_resizesel(void)
     undo->val_x = offset_x;
     undo->val_y = offset_y;
 
-    // actually do the resize operation
+    // actually do the resize operation (rebuilds the canvas items on top)
     resize_journal_items_by(ui.selection->items, scaling_x, scaling_y, offset_x, offset_y);
+    xo_layer_restack_canvas_items(ui.selection->layer);
   }
 
   if (scaling_x>0) {
@@ -630,7 +740,6 @@ void recolor_selection(int color_no, guint color_rgba)
   GList *itemlist;
   struct Item *item;
   struct Brush *brush;
-  GnomeCanvasGroup *group;
   
   if (ui.selection == NULL) return;
   prepare_new_undo();
@@ -649,16 +758,9 @@ void recolor_selection(int color_no, guint color_rgba)
     // repaint the stroke
     item->brush.color_no = color_no;
     item->brush.color_rgba = color_rgba | 0xff; // no alpha
-    if (item->canvas_item!=NULL) {
-      if (!item->brush.variable_width)
-        gnome_canvas_item_set(item->canvas_item, 
-           "fill-color-rgba", item->brush.color_rgba, NULL);
-      else {
-        group = (GnomeCanvasGroup *) item->canvas_item->parent;
-        gtk_object_destroy(GTK_OBJECT(item->canvas_item));
-        make_canvas_item_one(group, item);
-      }
-    }
+    if (item->canvas_item!=NULL) // lines and stroke outlines alike
+      gnome_canvas_item_set(item->canvas_item, 
+         "fill-color-rgba", item->brush.color_rgba, NULL);
   }
 }
 
@@ -19,6 +19,7 @@ void finalize_selectrect(void);
 void start_selectregion(GdkEvent *event);
 void finalize_selectregion(void);
 void continue_selectregion(GdkEvent *event);
+void update_selectregion_outline(void);
 
 void make_dashed(GnomeCanvasItem *item);
 
@@ -0,0 +1,289 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of  
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <math.h>
+#include <gtk/gtk.h>
+#include <libgnomecanvas/libgnomecanvas.h>
+#include <libart_lgpl/art_affine.h>
+
+#include "xournal.h"
+#include "xo-stroke.h"
+
+/* A variable-width stroke is the union of the strips between its sharp
+   joins (widths interpolated along them) and of round discs at the ends
+   and at those joins. All the pieces go into a single path with the same
+   orientation, so that it can be filled in one go with the nonzero winding
+   rule: one canvas item (or one PDF fill) per stroke. */
+
+static void outline_disc(GnomeCanvasPathDef *outline, double x, double y, double r)
+{
+  double k = r*BEZIER_CIRCLE_KAPPA;
+
+  gnome_canvas_path_def_moveto(outline, x+r, y);
+  gnome_canvas_path_def_curveto(outline, x+r, y+k, x+k, y+r, x, y+r);
+  gnome_canvas_path_def_curveto(outline, x-k, y+r, x-r, y+k, x-r, y);
+  gnome_canvas_path_def_curveto(outline, x-r, y-k, x-k, y-r, x, y-r);
+  gnome_canvas_path_def_curveto(outline, x+k, y-r, x+r, y-k, x+r, y);
+  gnome_canvas_path_def_closepath(outline);
+}
+
+/* a run of n points whose joins need no disc, as one polygon: one side
+   forward, then the other side back. Inside the run, the sides are offset
+   along the mean of the normals of the two segments at each point. */
+
+static void outline_strip(GnomeCanvasPathDef *outline, double *pt, double *w, int n)
+{
+  double *nx, *ny, dx, dy, len;
+  int i;
+
+  nx = g_new0(double, 2*n); ny = nx+n;
+  for (i=0; i<n-1; i++) {
+    dx = pt[2*i+2]-pt[2*i]; dy = pt[2*i+3]-pt[2*i+1];
+    len = hypot(dx, dy);
+    if (len == 0.) { g_free(nx); return; } // only alone in its run: the discs cover it
+    nx[i] -= dy/len; ny[i] += dx/len;
+    nx[i+1] -= dy/len; ny[i+1] += dx/len;
+  }
+  for (i=0; i<n; i++) {
+    len = 2*hypot(nx[i], ny[i]);
+    nx[i] /= len; ny[i] /= len;
+  }
+  // same orientation as the discs
+  gnome_canvas_path_def_moveto(outline, pt[0]-w[0]*nx[0], pt[1]-w[0]*ny[0]);
+  for (i=1; i<n; i++)
+    gnome_canvas_path_def_lineto(outline, pt[2*i]-w[i]*nx[i], pt[2*i+1]-w[i]*ny[i]);
+  for (i=n-1; i>=0; i--)
+    gnome_canvas_path_def_lineto(outline, pt[2*i]+w[i]*nx[i], pt[2*i+1]+w[i]*ny[i]);
+  gnome_canvas_path_def_closepath(outline);
+  g_free(nx);
+}
+
+/* does the join at pt[2..3] leave a visible gap between the segments? */
+
+static gboolean outline_needs_join(double *pt, double w)
+{
+  double ax, ay, bx, by, la, lb;
+
+  ax = pt[2]-pt[0]; ay = pt[3]-pt[1];
+  bx = pt[4]-pt[2]; by = pt[5]-pt[3];
+  la = hypot(ax, ay); lb = hypot(bx, by);
+  if (la == 0. || lb == 0.) return TRUE;
+  if (ax*bx+ay*by <= 0.) return TRUE; // sharp turn
+  return (w/2*fabs(ax*by-ay*bx)/(la*lb) >= OUTLINE_JOIN_TOLERANCE);
+}
+
+GnomeCanvasPathDef *xo_stroke_outline(GnomeCanvasPoints *path, gdouble *widths)
+{
+  GnomeCanvasPathDef *outline;
+  double *pt;
+  int i, n, start;
+
+  n = path->num_points;
+  outline = gnome_canvas_path_def_new_sized(10*n+5);
+  if (n == 0) return outline;
+  pt = path->coords;
+  outline_disc(outline, pt[0], pt[1], widths[0]/2);
+  for (start=0, i=1; i<n; i++)
+    if (i == n-1 || outline_needs_join(pt+2*i-2, widths[i])) {
+      outline_strip(outline, pt+2*start, widths+start, i-start+1);
+      outline_disc(outline, pt[2*i], pt[2*i+1], widths[i]/2);
+      start = i;
+    }
+  return outline;
+}
+
+// fill the outline of a pressure stroke with the current source of cr
+
+void xo_stroke_fill_outline(cairo_t *cr, struct Item *item)
+{
+  GnomeCanvasPathDef *def;
+  ArtBpath *bp;
+
+  def = xo_stroke_outline(item->path, item->widths);
+  for (bp = gnome_canvas_path_def_bpath(def); bp->code != ART_END; bp++) {
+    if (bp->code == ART_MOVETO || bp->code == ART_MOVETO_OPEN)
+      cairo_move_to(cr, bp->x3, bp->y3);
+    else if (bp->code == ART_LINETO)
+      cairo_line_to(cr, bp->x3, bp->y3);
+    else if (bp->code == ART_CURVETO)
+      cairo_curve_to(cr, bp->x1, bp->y1, bp->x2, bp->y2, bp->x3, bp->y3);
+  }
+  gnome_canvas_path_def_unref(def);
+  cairo_set_fill_rule(cr, CAIRO_FILL_RULE_WINDING);
+  cairo_fill(cr);
+}
+
+/* Level of detail: at low zoom, a stroke is displayed from a simplified
+   copy of its path (Douglas-Peucker, keeping a subset of the points, and
+   of the widths for pressure strokes). The levels get built lazily and are
+   kept as point indices on the canvas item, so they stay valid when the
+   stroke is moved; the canvas item is recreated when its shape changes. */
+
+#define STROKE_LOD_KEY "xo-stroke-lod"
+#define STROKE_LOD_FULL (-1)  // level for the full path
+#define STROKE_LOD_UNSET (-2) // no path set yet
+
+struct StrokeLod {
+  int level; // currently displayed
+  int *index[LOD_LEVELS]; // kept points at each level, or NULL if not built
+  int count[LOD_LEVELS];
+};
+
+static void stroke_lod_free(gpointer data)
+{
+  struct StrokeLod *lod = (struct StrokeLod *)data;
+  int i;
+
+  for (i=0; i<LOD_LEVELS; i++) g_free(lod->index[i]);
+  g_free(lod);
+}
+
+/* deviation of point k from the chord i-j; for pressure strokes the
+   difference in half-widths counts too */
+
+static double simplify_deviation(double *p, gdouble *widths, int i, int j, int k)
+{
+  double dx, dy, len, d, t, w;
+
+  dx = p[2*j]-p[2*i]; dy = p[2*j+1]-p[2*i+1];
+  len = hypot(dx, dy);
+  if (len == 0.) {
+    d = hypot(p[2*k]-p[2*i], p[2*k+1]-p[2*i+1]);
+    t = 0.;
+  } else {
+    d = fabs((p[2*k]-p[2*i])*dy - (p[2*k+1]-p[2*i+1])*dx)/len;
+    t = ((p[2*k]-p[2*i])*dx + (p[2*k+1]-p[2*i+1])*dy)/(len*len);
+    t = CLAMP(t, 0., 1.);
+  }
+  if (widths != NULL) {
+    w = widths[i] + t*(widths[j]-widths[i]);
+    d = MAX(d, fabs(widths[k]-w)/2);
+  }
+  return d;
+}
+
+/* Douglas-Peucker simplification of a path (with its widths, or NULL):
+   returns the indices of the points to keep, which include both ends */
+
+int *xo_stroke_simplify(double *coords, gdouble *widths, int n, double tolerance, int *count)
+{
+  int *stack, *index, top, i, j, k, kmax;
+  gboolean *keep;
+  double d, dmax;
+
+  keep = g_new0(gboolean, n);
+  stack = g_new(int, 2*n);
+  keep[0] = keep[n-1] = TRUE;
+  top = 0;
+  stack[top++] = 0; stack[top++] = n-1;
+  while (top > 0) {
+    j = stack[--top]; i = stack[--top];
+    kmax = -1; dmax = tolerance;
+    for (k = i+1; k < j; k++) {
+      d = simplify_deviation(coords, widths, i, j, k);
+      if (d > dmax) { dmax = d; kmax = k; }
+    }
+    if (kmax < 0) continue;
+    keep[kmax] = TRUE;
+    stack[top++] = i; stack[top++] = kmax;
+    stack[top++] = kmax; stack[top++] = j;
+  }
+  index = g_new(int, n);
+  for (k = 0, *count = 0; k < n; k++)
+    if (keep[k]) index[(*count)++] = k;
+  g_free(keep);
+  g_free(stack);
+  return index;
+}
+
+/* the coarsest level whose error doesn't show at this zoom; none when
+   zoomed in enough that simplifying would save few points, so that
+   loading and editing at normal zoom don't pay for it */
+
+int xo_stroke_lod_level(double zoom)
+{
+  int level;
+  double tolerance = LOD_BASE_TOLERANCE;
+
+  if (zoom >= LOD_MAX_ZOOM || tolerance*zoom > LOD_MAX_ERROR) return STROKE_LOD_FULL;
+  for (level = 0; level < LOD_LEVELS-1; level++, tolerance *= LOD_LEVEL_RATIO)
+    if (tolerance*LOD_LEVEL_RATIO*zoom > LOD_MAX_ERROR) break;
+  return level;
+}
+
+/* set the path of a stroke's canvas item (a line, or an outline for
+   pressure strokes) at the level of detail suited to the zoom */
+
+void xo_stroke_show_lod(struct Item *item, double zoom)
+{
+  struct StrokeLod *lod;
+  GnomeCanvasPoints *path;
+  GnomeCanvasPathDef *outline;
+  gdouble *widths;
+  double identity[6];
+  int level, i, n, *index;
+
+  lod = (struct StrokeLod *)g_object_get_data(G_OBJECT(item->canvas_item), STROKE_LOD_KEY);
+  if (lod == NULL) {
+    lod = g_new0(struct StrokeLod, 1);
+    lod->level = STROKE_LOD_UNSET;
+    g_object_set_data_full(G_OBJECT(item->canvas_item), STROKE_LOD_KEY, lod, stroke_lod_free);
+  }
+  level = (item->path->num_points > 2) ? xo_stroke_lod_level(zoom) : STROKE_LOD_FULL;
+  if (level != STROKE_LOD_FULL && lod->index[level] == NULL)
+    lod->index[level] = xo_stroke_simplify(item->path->coords,
+      item->brush.variable_width ? item->widths : NULL, item->path->num_points,
+      LOD_BASE_TOLERANCE*pow(LOD_LEVEL_RATIO, level), &lod->count[level]);
+  if (level != STROKE_LOD_FULL && lod->count[level] == item->path->num_points)
+    level = STROKE_LOD_FULL; // nothing to gain at this level
+  if (level == lod->level) return;
+
+  if (level == STROKE_LOD_FULL) {
+    path = item->path;
+    widths = item->widths;
+  } else {
+    n = lod->count[level];
+    index = lod->index[level];
+    path = gnome_canvas_points_new(n);
+    widths = item->brush.variable_width ? g_new(gdouble, n) : NULL;
+    for (i = 0; i < n; i++) {
+      path->coords[2*i] = item->path->coords[2*index[i]];
+      path->coords[2*i+1] = item->path->coords[2*index[i]+1];
+      if (widths != NULL) widths[i] = item->widths[index[i]];
+    }
+  }
+
+  if (item->brush.variable_width) {
+    outline = xo_stroke_outline(path, widths);
+    gnome_canvas_item_set(item->canvas_item, "bpath", outline, NULL);
+    gnome_canvas_path_def_unref(outline);
+  }
+  else gnome_canvas_item_set(item->canvas_item, "points", path, NULL);
+  // the path is in page coordinates, so drop any translation from earlier moves
+  if (lod->level != STROKE_LOD_UNSET) {
+    art_affine_identity(identity);
+    gnome_canvas_item_affine_absolute(item->canvas_item, identity);
+  }
+  lod->level = level;
+
+  if (path != item->path) {
+    gnome_canvas_points_free(path);
+    g_free(widths);
+  }
+}
@@ -0,0 +1,34 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of  
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// outline geometry of variable-width (pressure) strokes
+
+#define BEZIER_CIRCLE_KAPPA 0.5522847498 // control point offset for a quarter circle
+#define OUTLINE_JOIN_TOLERANCE 0.01 // skip round joins whose gap is smaller (in pt)
+
+GnomeCanvasPathDef *xo_stroke_outline(GnomeCanvasPoints *path, gdouble *widths);
+void xo_stroke_fill_outline(cairo_t *cr, struct Item *item);
+int *xo_stroke_simplify(double *coords, gdouble *widths, int n, double tolerance, int *count);
+
+// levels of detail for display at low zoom
+
+#define LOD_LEVELS 3
+#define LOD_BASE_TOLERANCE 0.25 // Douglas-Peucker tolerance of the finest level (in pt)
+#define LOD_LEVEL_RATIO 4.0 // each level is this much coarser than the previous one
+#define LOD_MAX_ERROR 0.5 // largest deviation allowed on screen (in pixels)
+#define LOD_MAX_ZOOM 1.0 // full paths from this zoom up (at normal zoom, LOD isn't worth its cost)
+
+int xo_stroke_lod_level(double zoom);
+void xo_stroke_show_lod(struct Item *item, double zoom);
@@ -0,0 +1,290 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <math.h>
+#include <gtk/gtk.h>
+#include <libgnomecanvas/libgnomecanvas.h>
+
+#include "xournal.h"
+#include "xo-misc.h"
+#include "xo-canvas-cache.h"
+#include "xo-render.h"
+#include "xo-view.h"
+
+static GtkWidget *view = NULL;
+static guint view_width, view_height; // the size requested, in canvas pixels
+static double view_zoom, view_ox, view_oy; // the world-to-window mapping painted
+static int view_pending_undo = 0; // undo items made since the last idle call
+static guint view_idle_id = 0;
+
+/* paint the pages meeting one exposed rectangle: the pages are culled by
+   their rectangle, then the items by theirs inside xo_render_page() */
+
+static void view_paint_rect(cairo_t *cr, GdkRectangle *r)
+{
+  struct Page *pg;
+  struct BBox dirty;
+  double x0, y0, x1, y1;
+  int n, first, last;
+
+  gnome_canvas_window_to_world(canvas, r->x, r->y, &x0, &y0);
+  gnome_canvas_window_to_world(canvas, r->x + r->width, r->y + r->height, &x1, &y1);
+  if (ui.view_continuous == VIEW_MODE_ONE_PAGE) first = last = -1; // ui.cur_page only
+  else if (ui.view_continuous == VIEW_MODE_HORIZONTAL) {
+    first = page_at_position(x0); last = page_at_position(x1);
+  } else {
+    first = page_at_position(y0); last = page_at_position(y1);
+  }
+  for (n = first; n <= last; n++) {
+    pg = (n < 0) ? ui.cur_page : journal_page(n);
+    if (pg == NULL) continue;
+    dirty.left = MAX(x0, pg->hoffset) - pg->hoffset;
+    dirty.right = MIN(x1, pg->hoffset + pg->width) - pg->hoffset;
+    dirty.top = MAX(y0, pg->voffset) - pg->voffset;
+    dirty.bottom = MIN(y1, pg->voffset + pg->height) - pg->voffset;
+    if (dirty.right <= dirty.left || dirty.bottom <= dirty.top) continue;
+    cairo_save(cr);
+    cairo_translate(cr, view_ox, view_oy);
+    cairo_scale(cr, ui.zoom, ui.zoom);
+    cairo_translate(cr, pg->hoffset, pg->voffset);
+    xo_render_page(cr, pg, pg->nlayers, &dirty);
+    cairo_restore(cr);
+  }
+}
+
+static gboolean view_expose_cb(GtkWidget *widget, GdkEventExpose *event, gpointer user_data)
+{
+  GdkRectangle *rects;
+  cairo_t *cr;
+  int i, nrects;
+
+  // the canvas doesn't get exposed any more: do what its handler does
+  if (ui.view_continuous!=0 && ui.progressive_bg) rescale_bg_pixmaps();
+
+  gnome_canvas_world_to_window(canvas, 0., 0., &view_ox, &view_oy);
+  cr = gdk_cairo_create(widget->window);
+  gdk_cairo_region(cr, event->region);
+  cairo_clip(cr);
+  gdk_cairo_set_source_color(cr, &(GTK_WIDGET(canvas)->style->bg[GTK_STATE_NORMAL]));
+  cairo_paint(cr);
+  gdk_region_get_rectangles(event->region, &rects, &nrects);
+  for (i = 0; i < nrects; i++)
+    view_paint_rect(cr, &rects[i]);
+  g_free(rects);
+  cairo_destroy(cr);
+  return TRUE;
+}
+
+static void view_canvas_changed_cb(GObject *object, gpointer arg, gpointer user_data)
+{
+  xo_view_sync_size();
+}
+
+void xo_view_init(void)
+{
+  if (view != NULL) return;
+  view = gtk_drawing_area_new();
+  /* no input events selected: they go through to the canvas underneath,
+     which scrolls and keeps the tools from painting (see ui.drawing_area_view) */
+  gtk_widget_set_events(view, GDK_EXPOSURE_MASK);
+  gtk_layout_put(GTK_LAYOUT(canvas), view, 0, 0);
+  g_signal_connect(view, "expose_event", G_CALLBACK(view_expose_cb), NULL);
+  g_signal_connect(canvas, "notify::width", G_CALLBACK(view_canvas_changed_cb), NULL);
+  g_signal_connect(canvas, "notify::height", G_CALLBACK(view_canvas_changed_cb), NULL);
+  g_signal_connect_after(canvas, "size-allocate", G_CALLBACK(view_canvas_changed_cb), NULL);
+  view_width = view_height = 0;
+  view_zoom = 0.;
+  xo_view_sync_size();
+  if (ui.drawing_area_view) gtk_widget_show(view);
+}
+
+/* cover the whole canvas layout, and the window around it when the
+   pages are centered in a bigger window */
+
+void xo_view_sync_size(void)
+{
+  guint width, height;
+  double ox, oy;
+
+  if (view == NULL) return;
+  gtk_layout_get_size(GTK_LAYOUT(canvas), &width, &height);
+  width = MAX(width, GTK_WIDGET(canvas)->allocation.width);
+  height = MAX(height, GTK_WIDGET(canvas)->allocation.height);
+  if (width != view_width || height != view_height) {
+    view_width = width; view_height = height;
+    gtk_widget_set_size_request(view, width, height);
+  }
+  gnome_canvas_world_to_window(canvas, 0., 0., &ox, &oy);
+  if (ui.zoom != view_zoom || ox != view_ox || oy != view_oy) {
+    view_zoom = ui.zoom; view_ox = ox; view_oy = oy;
+    gtk_widget_queue_draw(view);
+  }
+}
+
+void xo_view_invalidate(void)
+{
+  if (view != NULL) gtk_widget_queue_draw(view);
+}
+
+void xo_view_invalidate_page(struct Page *pg)
+{
+  GdkRectangle rect;
+  double x0, y0, x1, y1;
+
+  if (view == NULL || pg == NULL || !GTK_WIDGET_DRAWABLE(view)) return;
+  if (ui.view_continuous == VIEW_MODE_ONE_PAGE && pg != ui.cur_page) return;
+  gnome_canvas_world_to_window(canvas, pg->hoffset, pg->voffset, &x0, &y0);
+  gnome_canvas_world_to_window(canvas, pg->hoffset + pg->width, pg->voffset + pg->height, &x1, &y1);
+  rect.x = (int)floor(x0); rect.y = (int)floor(y0);
+  rect.width = (int)ceil(x1) - rect.x; rect.height = (int)ceil(y1) - rect.y;
+  gdk_window_invalidate_rect(view->window, &rect, FALSE);
+}
+
+static struct Page *view_layer_page(struct Layer *l)
+{
+  GList *pglist;
+
+  for (pglist = journal.pages; pglist != NULL; pglist = pglist->next)
+    if (g_list_find(((struct Page *)pglist->data)->layers, l) != NULL)
+      return (struct Page *)pglist->data;
+  return NULL;
+}
+
+void xo_view_invalidate_undo(struct UndoItem *u)
+{
+  switch (u->type) {
+    case ITEM_STROKE: case ITEM_ERASURE: case ITEM_PASTE: case ITEM_TEXT:
+    case ITEM_TEXT_EDIT: case ITEM_RECOGNIZER: case ITEM_IMAGE:
+      xo_view_invalidate_page(view_layer_page(u->layer));
+      break;
+    case ITEM_MOVESEL:
+      xo_view_invalidate_page(view_layer_page(u->layer));
+      xo_view_invalidate_page(view_layer_page(u->layer2));
+      break;
+    case ITEM_NEW_LAYER: case ITEM_DELETE_LAYER: case ITEM_MOVE_LAYER_DOWN:
+    case ITEM_NEW_BG_ONE: case ITEM_NEW_BG_RESIZE: case ITEM_PAPER_RESIZE:
+    case ITEM_NEW_PAGE: case ITEM_DELETE_PAGE:
+      xo_view_invalidate_page(u->page);
+      break;
+    default: // the undo item doesn't say where the edited items are
+      xo_view_invalidate();
+  }
+}
+
+static gboolean view_idle_cb(gpointer data)
+{
+  struct UndoItem *u;
+
+  view_idle_id = 0;
+  // the undo items made since last time are filled in by now
+  for (u = undo; u != NULL && view_pending_undo > 0; u = u->next, view_pending_undo--)
+    xo_view_invalidate_undo(u);
+  view_pending_undo = 0;
+  return FALSE;
+}
+
+void xo_view_note_undo(void)
+{
+  if (view == NULL || !ui.drawing_area_view) return;
+  view_pending_undo++;
+  // before the repaint, so that it includes the edit
+  if (view_idle_id == 0)
+    view_idle_id = g_idle_add_full(G_PRIORITY_HIGH_IDLE + 10, view_idle_cb, NULL, NULL);
+}
+
+/* --benchmark-view: scroll through the journal a tenth of the window at a
+   time, painting each frame on screen before the next, with the canvas
+   items and then with the drawing area */
+
+static double view_benchmark_pass(gboolean use_view, int frames, long *kb)
+{
+  GtkAdjustment *adj;
+  GTimer *timer;
+  double value, t;
+  long rss0;
+  int i;
+
+  ui.drawing_area_view = use_view;
+  if (use_view) gtk_widget_show(view);
+  else gtk_widget_hide(view);
+  if (ui.view_continuous == VIEW_MODE_HORIZONTAL)
+    adj = gtk_layout_get_hadjustment(GTK_LAYOUT(canvas));
+  else adj = gtk_layout_get_vadjustment(GTK_LAYOUT(canvas));
+  gtk_adjustment_set_value(adj, adj->lower);
+  while (gtk_events_pending()) gtk_main_iteration();
+  gnome_canvas_update_now(canvas);
+  gdk_window_process_updates(GTK_LAYOUT(canvas)->bin_window, TRUE);
+  gdk_flush();
+
+  rss0 = xo_render_resident_kb();
+  timer = g_timer_new();
+  for (i = 0; i < frames; i++) {
+    value = adj->value + adj->page_size/10;
+    if (value > adj->upper - adj->page_size) value = adj->lower; // back to the top
+    if (value != adj->value) gtk_adjustment_set_value(adj, value);
+    else gtk_widget_queue_draw(use_view ? view : GTK_WIDGET(canvas)); // nowhere to scroll
+    gnome_canvas_update_now(canvas);
+    gdk_window_process_updates(GTK_LAYOUT(canvas)->bin_window, TRUE);
+    gdk_flush();
+  }
+  t = g_timer_elapsed(timer, NULL);
+  g_timer_destroy(timer);
+  *kb = (rss0 >= 0) ? xo_render_resident_kb() - rss0 : -1;
+  return (t > 0.) ? frames/t : 0.;
+}
+
+void xo_view_benchmark(int frames)
+{
+  GList *pglist, *layerlist;
+  gboolean raster_cache, drawing_area_view;
+  double fps_canvas, fps_view;
+  long kb_canvas, kb_view;
+  int nitems, njournal;
+
+  // compare with the canvas items themselves, not with their raster caches
+  raster_cache = ui.raster_cache;
+  ui.raster_cache = FALSE;
+  xo_canvas_cache_reset();
+  drawing_area_view = ui.drawing_area_view;
+  xo_view_init();
+  gnome_canvas_update_now(canvas);
+
+  nitems = xo_render_count_items(GNOME_CANVAS_ITEM(gnome_canvas_root(canvas)));
+  njournal = 0;
+  for (pglist = journal.pages; pglist != NULL; pglist = pglist->next)
+    for (layerlist = ((struct Page *)pglist->data)->layers; layerlist != NULL; layerlist = layerlist->next)
+      njournal += ((struct Layer *)layerlist->data)->nitems;
+  printf("pages: %d, journal items: %d, canvas items: %d, resident memory: %ld kB\n",
+         journal.npages, njournal, nitems, xo_render_resident_kb());
+
+  fps_canvas = view_benchmark_pass(FALSE, frames, &kb_canvas);
+  fps_view = view_benchmark_pass(TRUE, frames, &kb_view);
+
+  printf("window %dx%d, zoom %.2f, %d frames each\n", GTK_WIDGET(canvas)->allocation.width,
+         GTK_WIDGET(canvas)->allocation.height, ui.zoom, frames);
+  printf("canvas items: %.1f frames/s, resident memory +%ld kB\n", fps_canvas, kb_canvas);
+  printf("drawing area: %.1f frames/s, resident memory +%ld kB\n", fps_view, kb_view);
+
+  ui.drawing_area_view = drawing_area_view;
+  if (drawing_area_view) gtk_widget_show(view);
+  else gtk_widget_hide(view);
+  ui.raster_cache = raster_cache;
+  xo_canvas_cache_schedule();
+}
@@ -0,0 +1,42 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XO_VIEW_H
+#define XO_VIEW_H
+
+/* The drawing_area_view option: a GtkDrawingArea laid over the whole
+   canvas shows the journal instead of the canvas items. The journal
+   itself (pages -> layers -> items) is the retained scene, painted with
+   xo_render_page(); only the pages meeting an exposed rectangle get
+   drawn, and edits only invalidate the pages they touch. The canvas stays
+   underneath for scrolling, zooming and page bookkeeping. The view is
+   display only: the drawing tools are disabled while it is shown. */
+
+// create the drawing area and lay it over the canvas
+void xo_view_init(void);
+// the canvas layout or zoom may have changed: resize and repaint if needed
+void xo_view_sync_size(void);
+// repaint everything on screen, or only where a page is
+void xo_view_invalidate(void);
+void xo_view_invalidate_page(struct Page *pg);
+void xo_view_invalidate_undo(struct UndoItem *u);
+// a new undo item is being filled in: repaint what it touches at idle time
+void xo_view_note_undo(void);
+
+#define BENCHMARK_VIEW_FRAMES 200 // frames painted by each backend in --benchmark-view
+
+void xo_view_benchmark(int frames);
+
+#endif /* XO_VIEW_H */
@@ -65,6 +65,7 @@
 #define DEFAULT_ZOOM_FAST_FACTOR 3
 #define DISPLAY_DPI_DEFAULT 96.0
 #define MIN_ZOOM 0.2
+#define ZOOM_PREVIEW_DELAY 150 // wait this long for more zoom steps before re-rendering (in millisec)
 #define RESIZE_MARGIN 6.0
 #define MOVE_MIN_INTERIOR 12.0
 #define MAX_SAFE_RENDER_DPI 720 // max dpi at which PDF bg's get rendered
@@ -77,8 +78,9 @@
 
 // For gesture scrolling:
 #define SCROLL_MEASURE_INTERVAL 50 // least time interval used to measure finger speed (in millisec)
-#define SCROLL_FRAMETIME 20 // time between two frames of scrolling (in millisec)
-#define SCROLL_SLOWDOWN 0.1 // decrease of scrolling speed in each frame (speed is in pixel per millisec)
+#define SCROLL_FRAMETIME 16 // time between two frames of scrolling, one display refresh at 60Hz (in millisec)
+#define SCROLL_MAX_FRAMETIME 50 // longest time a single scrolling step may catch up on (in millisec)
+#define SCROLL_SLOWDOWN 0.08 // decrease of scrolling speed per SCROLL_FRAMETIME (speed is in pixel per millisec)
 
 /* a string (+ aux data) that maintains a refcount */
 
@@ -106,6 +108,8 @@ typedef struct Background {
   double pixbuf_scale; // for PIXMAP, this is the *current* zoom value
                        // for PDF, this is the *requested* zoom value
   int pixel_height, pixel_width; // PDF only: pixel size of current pixbuf
+  gint64 file_size, file_mtime; // PIXMAP only: of the file when last read or written
+                                // (size -1 if unknown), see stamp_bg_file()
 } Background;
 
 #define BG_SOLID 0
@@ -254,6 +258,7 @@ typedef struct Journal {
   GList *pages;  // the pages in the journal
   int npages;
   int last_attach_no; // for naming of attached backgrounds
+  GArray *page_index; // the pages by number, as laid out (see journal_page())
 } Journal;
 
 typedef struct Selection {
@@ -264,6 +269,7 @@ typedef struct Selection {
   gboolean resizing_top, resizing_bottom, resizing_left, resizing_right; // for selection resizing
   double new_x1, new_x2, new_y1, new_y2; // for selection resizing
   GnomeCanvasItem *canvas_item; // if the selection box is on screen 
+  GnomeCanvasGroup *preview_group; // temporary group while moving/resizing
   GList *items; // the selected items (a list of struct Item)
   int move_pageno, orig_pageno; // if selection moves to a different page
   struct Layer *move_layer;
@@ -303,6 +309,12 @@ typedef struct UIData {
   gboolean discard_corepointer; // discard core pointer events in XInput mode
   gboolean pressure_sensitivity; // use pen pressure to control stroke width?
   double width_minimum_multiplier, width_maximum_multiplier; // calibration for pressure sensitivity
+  int predict_horizon; // extrapolate the pen tip this far ahead (in millisec), 0 = off
+  gboolean predict_measure; // report how much the prediction reduces the ink lag
+  gboolean raster_cache; // render layers and pages that aren't being edited only once
+  gboolean cairo_renderer; // fill the raster caches straight from the journal, with cairo
+  gboolean drawing_area_view; // show the journal in a cairo drawing area over the canvas (display only)
+  double simplify_tolerance; // drop stroke points within this distance at pen-up (in pt), 0 = off
   gboolean is_corestroke; // this stroke is painted with core pointer
   gboolean saved_is_corestroke;
   GdkDevice *stroke_device; // who's painting this stroke
@@ -334,12 +346,14 @@ typedef struct UIData {
   gboolean print_ruling; // print the paper ruling ?
   gboolean exportpdf_prefer_legacy; // prefer legacy code for export-to-pdf?
   gboolean exportpdf_layers; // export PDF one layer at a time
+  gboolean exportpdf_incremental; // export an annotated PDF as an incremental update of it
   gboolean new_page_bg_from_pdf; // do new pages get a duplicated PDF/image background?
   int default_unit; // the default unit for paper sizes
   int startuptool; // the default tool at startup
   int zoom_step_increment; // the increment in the zoom dialog box
   double zoom_step_factor; // the multiplicative factor in zoom in/out
   double zoom_fast_factor; // multiplicative for fast zoom
+  gboolean zoom_preview; // zoom in/out shows a scaled copy of the window first
   double startup_zoom;
   gboolean autoload_pdf_xoj;
   gboolean autocreate_new_xoj;